@@ -0,0 +1,205 @@
+/**
+ * Anomaly Rules ---
+ * Watches what the controller sees go by for trouble that otherwise only shows up when reading the
+ * logs: the furnace short-cycling, burns too short to be real heat, the thermostat not answering
+ * poll after poll, and a fan suddenly taking much longer than usual to answer.
+ *
+ * Each rule keeps a small fixed ring of what it needs: the times the furnace came on in the last
+ * hour, or the latencies of the last few commands with their running sum.  An update adds to the
+ * ring and drops what has aged out of it, so it costs the same however long the controller has
+ * been running, and nothing ever goes back over the history.
+ *
+ * A rule that watches a level (cycles per hour, failed polls in a row) raises its alert once when
+ * the level crosses its limit and clears it once it's back under, rather than on every poll in
+ * between.  One that watches single events (a short burn, a slow command) raises an alert for each.
+ * Alerts go to whatever the controller passes in, and counts of each go in the hourly report.
+ */
+#ifndef ANOMALY_RULES_H_
+#define ANOMALY_RULES_H_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace fancontrol {
+
+enum class Anomaly { SHORT_CYCLING, SHORT_BURN, POLL_FAILURES, SLOW_COMMAND };
+static constexpr std::size_t k_anomalyCount = 4;
+
+inline const char* AnomalyName(const Anomaly anomaly) {
+  static const char* const names[] = {"short-cycling", "short burn", "poll failures",
+                                      "slow command"};
+  return names[int(anomaly)];
+}
+
+struct AnomalyParams {
+  // More heat calls than this in an hour is short-cycling.
+  int maxCyclesPerHour;
+  // A burn shorter than this.
+  std::chrono::steady_clock::duration minOnTime;
+  // This many failed polls in a row.
+  unsigned long maxFailStreak;
+  // A command slower than both this and `latencySpike` times the recent average.
+  std::chrono::steady_clock::duration slowCommand;
+  double latencySpike;
+};
+
+/**
+ * The times of the last N events, for counting how many fall in a window that ends now.  Times
+ * must be added in order.  Past N the oldest are dropped, so a count saturates at N.
+ */
+template <std::size_t N>
+class TimeWindow final {
+  using Clock = std::chrono::steady_clock;
+  std::array<Clock::time_point, N> times;
+  std::size_t first = 0;
+  std::size_t count = 0;
+
+ public:
+  void Add(const Clock::time_point at) {
+    if (count == N) {
+      first = (first + 1) % N;
+      --count;
+    }
+    times[(first + count++) % N] = at;
+  }
+  // Drops everything before `since`.  Each time is dropped once, so this is amortized O(1).
+  void Expire(const Clock::time_point since) {
+    while (count && times[first] < since) {
+      first = (first + 1) % N;
+      --count;
+    }
+  }
+  std::size_t Count() const { return count; }
+};
+
+// The last N samples and their sum.  Integer samples, so the sum never drifts.
+template <std::size_t N>
+class SampleWindow final {
+  std::array<int64_t, N> samples{};
+  std::size_t next = 0;
+  std::size_t count = 0;
+  int64_t sum = 0;
+
+ public:
+  void Add(const int64_t sample) {
+    if (count == N) sum -= samples[next];
+    samples[next] = sample;
+    sum += sample;
+    next = (next + 1) % N;
+    if (count < N) ++count;
+  }
+  std::size_t Count() const { return count; }
+  double Mean() const { return count ? double(sum) / double(count) : 0; }
+};
+
+class AnomalyRules final {
+ public:
+  using Clock = std::chrono::steady_clock;
+  // `raised` is false when a level rule clears.  `detail` says what was seen.
+  using Alert = std::function<void(Anomaly anomaly, bool raised, const std::string& detail)>;
+
+ private:
+  static constexpr auto k_cycleWindow = std::chrono::hours(1);
+  // Comfortably more than any limit on cycles per hour anyone would set.
+  static constexpr std::size_t k_maxCycles = 64;
+  // Commands averaged for the latency baseline, and how many it takes before it counts.
+  static constexpr std::size_t k_latencySamples = 32;
+  static constexpr std::size_t k_minLatencySamples = 8;
+
+  const AnomalyParams params;
+  const Alert alert;
+  TimeWindow<k_maxCycles> heatCalls;
+  SampleWindow<k_latencySamples> latencyMicros;
+  std::optional<Clock::time_point> heatOnSince;
+  std::array<bool, k_anomalyCount> active{};
+  std::array<uint64_t, k_anomalyCount> raised{};
+
+  void Raise(const Anomaly anomaly, const std::string& detail) {
+    ++raised[int(anomaly)];
+    alert(anomaly, true, detail);
+  }
+
+  // For a level rule: raises or clears it as `over` changes.
+  void Level(const Anomaly anomaly, const bool over, const std::string& detail) {
+    if (over == active[int(anomaly)]) return;
+    active[int(anomaly)] = over;
+    if (over) {
+      Raise(anomaly, detail);
+    } else {
+      alert(anomaly, false, detail);
+    }
+  }
+
+  void CheckCycles(const Clock::time_point now) {
+    heatCalls.Expire(now - k_cycleWindow);
+    const std::size_t cycles = heatCalls.Count();
+    Level(Anomaly::SHORT_CYCLING, cycles > std::size_t(params.maxCyclesPerHour),
+          std::to_string(cycles) + " heat calls in the last hour");
+  }
+
+ public:
+  AnomalyRules(const AnomalyParams& params, Alert alert)
+      : params(params), alert(std::move(alert)) {}
+  AnomalyRules(const AnomalyRules&) = delete;
+  AnomalyRules& operator=(const AnomalyRules&) = delete;
+
+  // After every poll.  `failStreak` is how many polls in a row have failed, 0 for this one.
+  void Polled(const Clock::time_point now, const unsigned long failStreak) {
+    Level(Anomaly::POLL_FAILURES, failStreak >= params.maxFailStreak,
+          failStreak ? std::to_string(failStreak) + " failed polls in a row" : "answering again");
+    CheckCycles(now);
+  }
+
+  // When a poll sees the furnace turn on or off.
+  void HeatChanged(const Clock::time_point now, const bool on) {
+    if (on) {
+      heatOnSince = now;
+      heatCalls.Add(now);
+      CheckCycles(now);
+      return;
+    }
+    if (!heatOnSince) return;
+    const auto burn = now - *heatOnSince;
+    heatOnSince.reset();
+    if (burn < params.minOnTime) {
+      Raise(Anomaly::SHORT_BURN,
+            "heat on for only " +
+                std::to_string(std::chrono::duration_cast<std::chrono::seconds>(burn).count()) +
+                " s");
+    }
+  }
+
+  // As each device command comes back, however it went.
+  void Commanded(const std::string& device, const Clock::duration latency) {
+    const int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    const double baseline = latencyMicros.Mean();
+    if (latencyMicros.Count() >= k_minLatencySamples && latency > params.slowCommand &&
+        double(micros) > params.latencySpike * baseline) {
+      char detail[192];
+      std::snprintf(detail, sizeof(detail), "%s took %ld ms against %.0f ms recently",
+                    device.c_str(), long(micros / 1000), baseline / 1000);
+      Raise(Anomaly::SLOW_COMMAND, detail);
+    }
+    latencyMicros.Add(micros);
+  }
+
+  std::string Report() const {
+    std::string line = "Anomalies:";
+    for (std::size_t i = 0; i < k_anomalyCount; ++i) {
+      line += std::string(i ? ", " : " ") + AnomalyName(Anomaly(i)) + " " +
+              std::to_string(raised[i]) + (active[i] ? " (active)" : "");
+    }
+    return line;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // ANOMALY_RULES_H_
@@ -0,0 +1,116 @@
+/**
+ * Config ---
+ * The settings that can be changed without restarting the controller.  The defaults are compiled
+ * in (fan_controller.cpp); a config file overrides any of them, one "key value" per line with
+ * times in seconds:
+ *
+ *   ceilingFanOnDelay 60
+ *   heatOnFanSpeed 3
+ *   fanWatts2 7
+ *
+ * A Config is never modified once built.  Reloading builds a new one and swaps the pointer, so
+ * anything holding the old one keeps a consistent view until it lets go (see fan_controller.cpp).
+ */
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <chrono>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+
+#include "fan_policy.h"
+
+namespace fancontrol {
+
+// What the fans draw while running, in watts, for the energy accounting (see rollups.h).
+struct Wattages {
+  int blower;
+  // By speed; fan[0] is off.
+  int fan[k_maxFanSpeed + 1];
+};
+
+struct Config {
+  PolicyParams policy;
+  std::chrono::seconds pollFrequency;
+  // Used when a call for heat or a scheduled setpoint change is near.
+  std::chrono::seconds fastPollFrequency;
+  // How long SIGTERM handling may take to restore the devices and flush files.
+  std::chrono::seconds shutdownDeadline;
+  // Commands decided together are spread over dispatchWindow, at most dispatchConcurrency at a
+  // time, and must all finish within dispatchDeadline (see dispatcher.h).
+  std::chrono::seconds dispatchWindow;
+  int dispatchConcurrency;
+  std::chrono::seconds dispatchDeadline;
+  // Keys blowerWatts and fanWatts1 to fanWatts6.
+  Wattages wattages;
+
+  /**
+   * Reads `path` over `defaults`.  Returns nullopt, and describes the problem in `error`, if the
+   * file can't be read or has an unknown key or bad value, or leaves the dispatch window no
+   * shorter than its deadline; a partly applied file is never returned.
+   */
+  static std::optional<Config> Load(const std::string& path, const Config& defaults,
+                                    std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+      error = "unable to open " + path;
+      return std::nullopt;
+    }
+    Config config = defaults;
+    std::string line;
+    for (int lineNumber = 1; std::getline(in, line); ++lineNumber) {
+      std::istringstream fields(line);
+      std::string key;
+      long value;
+      if (!(fields >> key) || key[0] == '#') continue;
+      // The whole value must be a number, so "1.5" or "60s" isn't quietly read as 1 or 60.
+      if (!(fields >> value) || value < 0 || !(fields >> std::ws).eof()) {
+        error = path + ":" + std::to_string(lineNumber) + ": bad value for " + key;
+        return std::nullopt;
+      }
+      const std::chrono::seconds secs(value);
+      if (key == "ceilingFanOnDelay") {
+        config.policy.ceilingFanOnDelay = secs;
+      } else if (key == "ceilingFanOffDelay") {
+        config.policy.ceilingFanOffDelay = secs;
+      } else if (key == "runBlowerFanAfterHeatOff") {
+        config.policy.runBlowerFanAfterHeatOff = secs;
+      } else if (key == "heatOnFanSpeed" && value <= k_maxFanSpeed) {
+        config.policy.heatOnFanSpeed = int(value);
+      } else if (key == "heatOffFanSpeed" && value <= k_maxFanSpeed) {
+        config.policy.heatOffFanSpeed = int(value);
+      } else if (key == "pollFrequency" && value > 0) {
+        config.pollFrequency = secs;
+      } else if (key == "fastPollFrequency" && value > 0) {
+        config.fastPollFrequency = secs;
+      } else if (key == "shutdownDeadline" && value > 0) {
+        config.shutdownDeadline = secs;
+      } else if (key == "dispatchWindow") {
+        config.dispatchWindow = secs;
+      } else if (key == "dispatchConcurrency" && value > 0) {
+        config.dispatchConcurrency = int(value);
+      } else if (key == "dispatchDeadline" && value > 0) {
+        config.dispatchDeadline = secs;
+      } else if (key == "blowerWatts") {
+        config.wattages.blower = int(value);
+      } else if (key.size() == 9 && key.compare(0, 8, "fanWatts") == 0 && key[8] >= '1' &&
+                 key[8] <= '0' + k_maxFanSpeed) {
+        config.wattages.fan[key[8] - '0'] = int(value);
+      } else {
+        error = path + ":" + std::to_string(lineNumber) + ": unknown key or bad value: " + key;
+        return std::nullopt;
+      }
+    }
+    if (config.dispatchWindow >= config.dispatchDeadline) {
+      error = path + ": dispatchWindow must be shorter than dispatchDeadline";
+      return std::nullopt;
+    }
+    return config;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // CONFIG_H_
@@ -0,0 +1,182 @@
+/**
+ * Staggered Dispatch ---
+ * Sends a group of commands decided at the same moment (every fan at a heat transition, or every
+ * fan whose delay runs out together) spread over a window instead of all at once, with only a few
+ * in flight, and all done by a deadline.  With many fans on one schedule the simultaneous burst
+ * is what the WiFi and the access point handle worst.
+ *
+ * Command i of n starts no earlier than window * i / n after the group does, and no later than a
+ * free slot allows.  Each is handed the group's deadline to bound its request by; one that can't
+ * start with k_minBudget left is skipped and counted late, and the caller's policy retries it
+ * next poll.  A group is a workflow (see workflow.h) forking one worker per slot, so it runs on
+ * whatever event loop it's started on, alongside everything else there.
+ *
+ * The peak number in flight and the completion times of recent commands (from the start of their
+ * group) are kept for the hourly report.
+ */
+#ifndef DISPATCHER_H_
+#define DISPATCHER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "workflow.h"
+
+namespace fancontrol {
+
+struct DispatchParams {
+  std::chrono::steady_clock::duration window;
+  int maxInFlight;
+  // From the start of the group.
+  std::chrono::steady_clock::duration deadline;
+};
+
+class StaggeredDispatcher final {
+ public:
+  using Clock = std::chrono::steady_clock;
+  struct Command {
+    std::unique_ptr<Workflow> workflow;
+    // Given the group's deadline just before the command starts, to bound its request by.
+    std::function<void(Clock::time_point deadline)> bound;
+  };
+
+  static constexpr auto k_minBudget = std::chrono::milliseconds(100);
+
+ private:
+  // Completion times of this many of the most recent commands make up the distribution.
+  static constexpr std::size_t k_completionSamples = 1024;
+
+  mutable std::mutex lock;
+  int inFlight = 0;
+  int peakInFlight = 0;
+  uint64_t groups = 0;
+  uint64_t commands = 0;
+  uint64_t late = 0;
+  std::vector<uint32_t> completionMs;
+  std::size_t nextCompletion = 0;
+
+  void Started() {
+    const std::lock_guard<std::mutex> guard(lock);
+    peakInFlight = std::max(peakInFlight, ++inFlight);
+  }
+
+  void Finished(const Clock::duration sinceGroupStart, const bool pastDeadline) {
+    const std::lock_guard<std::mutex> guard(lock);
+    --inFlight;
+    ++commands;
+    late += pastDeadline;
+    const auto ms = uint32_t(
+        std::chrono::duration_cast<std::chrono::milliseconds>(sinceGroupStart).count());
+    if (completionMs.size() < k_completionSamples) {
+      completionMs.push_back(ms);
+    } else {
+      completionMs[nextCompletion] = ms;
+      nextCompletion = (nextCompletion + 1) % k_completionSamples;
+    }
+  }
+
+  void Skipped() {
+    const std::lock_guard<std::mutex> guard(lock);
+    ++late;
+  }
+
+  void GroupDone() {
+    const std::lock_guard<std::mutex> guard(lock);
+    ++groups;
+  }
+
+  class Group final : public Workflow {
+    // Takes the next command until there are none left.
+    class Worker final : public Workflow {
+      Group& group;
+      std::size_t i = 0;
+
+     public:
+      explicit Worker(Group& group) : group(group) {}
+
+      void Resume(EventLoop& loop) override {
+        const std::size_t n = group.commands.size();
+        WORKFLOW_BEGIN;
+        while ((i = group.next++) < n) {
+          WORKFLOW_AWAIT(loop.Sleep(*this, group.start + group.params.window * i / n));
+          if (group.deadline - Clock::now() < k_minBudget) {
+            group.dispatcher.Skipped();
+            continue;
+          }
+          group.dispatcher.Started();
+          if (group.commands[i].bound) group.commands[i].bound(group.deadline);
+          WORKFLOW_AWAIT(loop.Call(*this, *group.commands[i].workflow));
+          const auto end = Clock::now();
+          group.dispatcher.Finished(end - group.start, end > group.deadline);
+        }
+        WORKFLOW_END;
+      }
+    };
+
+    StaggeredDispatcher& dispatcher;
+    const std::vector<Command> commands;
+    const DispatchParams params;
+    Clock::time_point start;
+    Clock::time_point deadline;
+    std::size_t next = 0;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+   public:
+    Group(StaggeredDispatcher& dispatcher, std::vector<Command> commands,
+          const DispatchParams& params)
+        : dispatcher(dispatcher), commands(std::move(commands)), params(params) {}
+
+    void Resume(EventLoop& loop) override {
+      WORKFLOW_BEGIN;
+      start = Clock::now();
+      deadline = start + params.deadline;
+      while (workers.size() < std::min<std::size_t>(commands.size(),
+                                                    std::max(1, params.maxInFlight))) {
+        workers.push_back(std::make_unique<Worker>(*this));
+        loop.Fork(*this, *workers.back());
+      }
+      WORKFLOW_AWAIT(loop.Join(*this));
+      dispatcher.GroupDone();
+      WORKFLOW_END;
+    }
+  };
+
+ public:
+  // The sample window is allocated up front so the footprint doesn't creep up as it fills.
+  StaggeredDispatcher() { completionMs.reserve(k_completionSamples); }
+
+  /**
+   * A workflow that sends every command as one group and finishes once they're done.  The
+   * commands go with it, so whoever runs it can look at them until it goes.
+   */
+  std::unique_ptr<Workflow> Stagger(std::vector<Command> commands, const DispatchParams& params) {
+    return std::make_unique<Group>(*this, std::move(commands), params);
+  }
+
+  std::string Report() const {
+    const std::lock_guard<std::mutex> guard(lock);
+    std::vector<uint32_t> sorted(completionMs);
+    std::sort(sorted.begin(), sorted.end());
+    const auto percentile = [&sorted](const double p) {
+      return sorted.empty() ? 0u : sorted[std::size_t(p * (sorted.size() - 1))];
+    };
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "Dispatch: %lu groups, %lu commands, peak %d in flight, completed in p50 %u ms, "
+                  "p90 %u ms, max %u ms, %lu late",
+                  (unsigned long)groups, (unsigned long)commands, peakInFlight, percentile(0.5),
+                  percentile(0.9), percentile(1), (unsigned long)late);
+    return line;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // DISPATCHER_H_
@@ -0,0 +1,337 @@
+/**
+ * Event Log ---
+ * Everything the flight recorder sees (polls, states, decisions, commands, signals, alerts) plus
+ * every syslog message, kept on disk as typed records that can be searched by device, kind and
+ * time instead of grepped out of a mix of console and syslog text.  history_tool tails and
+ * queries it.
+ *
+ * The log is a run of segments, <prefix>.<n>.log, each preallocated to a fixed size and mapped
+ * into memory, so appending a record is a copy and never a syscall.  When the open segment is full
+ * the next one is started and the oldest beyond the limit is removed.  A restart carries on at the
+ * end of the newest segment rather than starting another.  Each segment starts with a
+ * header giving its first sequence number and when it was started, which is all a query needs to
+ * skip the segments outside its time range.
+ *
+ * A record is a fixed header (its length, kind, sequence number, time and the same arguments as a
+ * flight recorder event) followed by the device name and any text, padded to 8 bytes.  The length
+ * is stored last, so a reader, even in another process while the controller is writing, sees
+ * either the whole record or a zero length where the records end.  A crash loses nothing already
+ * appended; the kernel writes the mapped pages out on its own schedule.
+ */
+#ifndef EVENT_LOG_H_
+#define EVENT_LOG_H_
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "flight_recorder.h"
+
+namespace fancontrol {
+
+namespace event_log_detail {
+
+static const uint32_t k_segmentMagic = 0x31564546;  // "FEV1"
+
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t headerBytes;
+  uint64_t firstSequence;
+  int64_t started;  // nanoseconds since the epoch
+  uint64_t reserved[5];
+};
+static_assert(sizeof(SegmentHeader) == 64, "SegmentHeader is written to disk as-is");
+
+struct RecordHeader {
+  // The whole record, padded to 8 bytes.  Written last; 0 where the records end.
+  uint32_t length;
+  uint16_t kind;
+  uint16_t deviceBytes;
+  uint64_t sequence;
+  int64_t time;  // nanoseconds since the epoch
+  int32_t arg[3];
+  float value[2];
+  uint32_t textBytes;
+};
+static_assert(sizeof(RecordHeader) == 48, "RecordHeader is written to disk as-is");
+
+inline std::string SegmentPath(const std::string& prefix, const uint64_t index) {
+  char suffix[32];
+  std::snprintf(suffix, sizeof(suffix), ".%06lu.log", (unsigned long)index);
+  return prefix + suffix;
+}
+
+inline int64_t NowNanos() {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+}  // namespace event_log_detail
+
+// The indices of the segments of the log at `prefix`, oldest first.
+inline std::vector<uint64_t> EventLogSegments(const std::string& prefix) {
+  const std::size_t slash = prefix.rfind('/');
+  const std::string dir = slash == std::string::npos ? "." : prefix.substr(0, slash + 1);
+  const std::string base = slash == std::string::npos ? prefix : prefix.substr(slash + 1);
+  std::vector<uint64_t> segments;
+  DIR* listing = opendir(dir.c_str());
+  if (!listing) return segments;
+  while (const dirent* entry = readdir(listing)) {
+    const std::string name(entry->d_name);
+    if (name.size() <= base.size() + 5 || name.compare(0, base.size() + 1, base + ".") != 0 ||
+        name.compare(name.size() - 4, 4, ".log") != 0) {
+      continue;
+    }
+    const std::string digits = name.substr(base.size() + 1, name.size() - base.size() - 5);
+    if (digits.find_first_not_of("0123456789") == std::string::npos) {
+      segments.push_back(std::strtoull(digits.c_str(), nullptr, 10));
+    }
+  }
+  closedir(listing);
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+struct LoggedEvent {
+  uint64_t sequence;
+  int64_t time;  // nanoseconds since the epoch
+  EventKind kind;
+  std::string_view device;
+  int32_t arg[3];
+  float value[2];
+  std::string_view text;
+};
+
+/**
+ * Read-only view of one segment.  The mapping is shared with the writer, so records appended after
+ * it's opened show up in later scans.
+ */
+class EventSegmentReader final {
+  const uint8_t* data = nullptr;
+  std::size_t size = 0;
+  event_log_detail::SegmentHeader header{};
+
+ public:
+  explicit EventSegmentReader(const std::string& path) {
+    using namespace event_log_detail;
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && std::size_t(st.st_size) >= sizeof(SegmentHeader)) {
+      void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapped != MAP_FAILED) {
+        data = static_cast<const uint8_t*>(mapped);
+        size = st.st_size;
+        std::memcpy(&header, data, sizeof(header));
+        if (header.magic != k_segmentMagic || header.headerBytes < sizeof(SegmentHeader) ||
+            header.headerBytes > size) {
+          munmap(const_cast<uint8_t*>(data), size);
+          data = nullptr;
+        }
+      }
+    }
+    ::close(fd);
+  }
+  ~EventSegmentReader() {
+    if (data) munmap(const_cast<uint8_t*>(data), size);
+  }
+  EventSegmentReader(const EventSegmentReader&) = delete;
+  EventSegmentReader& operator=(const EventSegmentReader&) = delete;
+
+  bool IsOpen() const { return data != nullptr; }
+  uint64_t FirstSequence() const { return header.firstSequence; }
+  int64_t Started() const { return header.started; }
+  // Where Scan() starts from the beginning.
+  std::size_t Begin() const { return header.headerBytes; }
+
+  /**
+   * Calls `fn(const LoggedEvent&)` for each complete record from `offset` on, and returns the
+   * offset after the last, to carry on from once more have been written.  The views into the
+   * record are valid as long as the reader.
+   */
+  template <typename Fn>
+  std::size_t Scan(std::size_t offset, Fn fn) const {
+    using namespace event_log_detail;
+    while (data && offset + sizeof(RecordHeader) <= size) {
+      const uint32_t length =
+          __atomic_load_n(reinterpret_cast<const uint32_t*>(data + offset), __ATOMIC_ACQUIRE);
+      RecordHeader record;
+      std::memcpy(&record, data + offset, sizeof(record));
+      if (length < sizeof(RecordHeader) || length > size - offset ||
+          sizeof(RecordHeader) + record.deviceBytes + record.textBytes > length ||
+          record.kind >= k_eventKinds) {
+        break;
+      }
+      const char* const strings = reinterpret_cast<const char*>(data + offset + sizeof(record));
+      fn(LoggedEvent{record.sequence,
+                     record.time,
+                     EventKind(record.kind),
+                     {strings, record.deviceBytes},
+                     {record.arg[0], record.arg[1], record.arg[2]},
+                     {record.value[0], record.value[1]},
+                     {strings + record.deviceBytes, record.textBytes}});
+      offset += length;
+    }
+    return offset;
+  }
+};
+
+/**
+ * Appends to the log.  Any thread may append; appends are serialized by a lock, which is only ever
+ * held for the copy (and, once per segment, for starting the next).
+ */
+class EventLog final {
+  const std::string prefix;
+  const std::size_t segmentBytes;
+  const std::size_t maxSegments;
+  std::mutex lock;
+  uint8_t* data = nullptr;
+  std::size_t offset = 0;
+  uint64_t segment = 0;
+  uint64_t nextSequence = 0;
+
+  bool Start(const uint64_t index) {
+    using namespace event_log_detail;
+    const std::string path = SegmentPath(prefix, index);
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    // Allocating the blocks up front means a full disk shows up here, not as a SIGBUS later.
+    void* mapped = posix_fallocate(fd, 0, off_t(segmentBytes)) == 0
+                       ? mmap(nullptr, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                       : MAP_FAILED;
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+      std::remove(path.c_str());
+      return false;
+    }
+    data = static_cast<uint8_t*>(mapped);
+    segment = index;
+    offset = sizeof(SegmentHeader);
+    const SegmentHeader header{k_segmentMagic, uint32_t(sizeof(SegmentHeader)), nextSequence,
+                               NowNanos(), {}};
+    std::memcpy(data, &header, sizeof(header));
+    if (index >= maxSegments) std::remove(SegmentPath(prefix, index - maxSegments).c_str());
+    return true;
+  }
+
+  // Maps segment `index` again to append from `end`, where its records stop.  Fails if the file
+  // isn't the size segments are now.
+  bool Reopen(const uint64_t index, const std::size_t end) {
+    using namespace event_log_detail;
+    const int fd = ::open(SegmentPath(prefix, index).c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    void* mapped = fstat(fd, &st) == 0 && std::size_t(st.st_size) == segmentBytes
+                       ? mmap(nullptr, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                       : MAP_FAILED;
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+    data = static_cast<uint8_t*>(mapped);
+    segment = index;
+    offset = end;
+    // A record cut off by a crash has its header and maybe some of its strings, but no length.
+    // Clear it, or a shorter record written over it would leave its bytes where a reader looks
+    // for the next length.
+    if (offset + sizeof(RecordHeader) <= segmentBytes) {
+      RecordHeader torn;
+      std::memcpy(&torn, data + offset, sizeof(torn));
+      const std::size_t tornBytes = std::min<std::size_t>(
+          sizeof(RecordHeader) + torn.deviceBytes + std::size_t(torn.textBytes),
+          segmentBytes - offset);
+      std::memset(data + offset, 0, tornBytes);
+    }
+    return true;
+  }
+
+  void Finish() {
+    if (!data) return;
+    munmap(data, segmentBytes);
+    data = nullptr;
+  }
+
+ public:
+  /**
+   * Carries on from the end of the newest segment already at `prefix`, numbering records on from
+   * its last, or in a new segment after it if it can't be reopened.  Keeps `maxSegments` of
+   * `segmentBytes` each.
+   */
+  EventLog(const std::string& prefix, const std::size_t segmentBytes,
+           const std::size_t maxSegments)
+      : prefix(prefix),
+        segmentBytes(std::max<std::size_t>(segmentBytes, 4096)),
+        maxSegments(std::max<std::size_t>(maxSegments, 1)) {
+    const auto existing = EventLogSegments(prefix);
+    if (existing.empty()) {
+      Start(0);
+      return;
+    }
+    const EventSegmentReader newest(event_log_detail::SegmentPath(prefix, existing.back()));
+    nextSequence = newest.FirstSequence();
+    const std::size_t end = newest.Scan(
+        newest.Begin(), [this](const LoggedEvent& event) { nextSequence = event.sequence + 1; });
+    const bool reopened = newest.IsOpen() && Reopen(existing.back(), end);
+    const uint64_t current = reopened ? existing.back() : existing.back() + 1;
+    // Anything left over from a larger limit goes too.
+    for (const uint64_t index : existing) {
+      if (index + this->maxSegments <= current) {
+        std::remove(event_log_detail::SegmentPath(prefix, index).c_str());
+      }
+    }
+    if (!reopened) Start(current);
+  }
+  ~EventLog() { Finish(); }
+  EventLog(const EventLog&) = delete;
+  EventLog& operator=(const EventLog&) = delete;
+
+  bool IsOpen() const { return data != nullptr; }
+
+  // Returns false if the log isn't open or the record is larger than a segment.
+  bool Append(const EventKind kind, const char* device, const int32_t arg0 = 0,
+              const int32_t arg1 = 0, const int32_t arg2 = 0, const float value0 = 0,
+              const float value1 = 0, const std::string_view text = {}) {
+    using namespace event_log_detail;
+    const std::size_t deviceBytes = device ? std::min<std::size_t>(std::strlen(device), 0xffff) : 0;
+    const std::size_t length = (sizeof(RecordHeader) + deviceBytes + text.size() + 7) & ~7ul;
+    const std::lock_guard<std::mutex> guard(lock);
+    if (!data || length > segmentBytes - sizeof(SegmentHeader)) return false;
+    if (offset + length > segmentBytes) {
+      Finish();
+      if (!Start(segment + 1)) return false;
+    }
+    uint8_t* const record = data + offset;
+    RecordHeader header{0,
+                        uint16_t(kind),
+                        uint16_t(deviceBytes),
+                        nextSequence++,
+                        NowNanos(),
+                        {arg0, arg1, arg2},
+                        {value0, value1},
+                        uint32_t(text.size())};
+    std::memcpy(record, &header, sizeof(header));
+    // Either may be null when empty, which memcpy doesn't allow even for no bytes.
+    if (deviceBytes) std::memcpy(record + sizeof(header), device, deviceBytes);
+    if (!text.empty()) std::memcpy(record + sizeof(header) + deviceBytes, text.data(), text.size());
+    // The length goes in last, and a reader that sees it sees everything before it.
+    __atomic_store_n(reinterpret_cast<uint32_t*>(record), uint32_t(length), __ATOMIC_RELEASE);
+    offset += length;
+    return true;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // EVENT_LOG_H_
@@ -0,0 +1,71 @@
+#!/bin/sh
+# Failover Test ---
+# Runs an active and a standby controller against mock devices (mock_devices.cpp), kills the
+# active one without warning and measures how long the standby takes to make its first decision
+# in its place.  Fails if that's more than a poll interval, or if the standby started from scratch
+# instead of from the active one's snapshot.
+#
+#   ./failover.sh
+#
+# Runs at real time (a soak build with a speedup of 1) since the two controllers compare wall clock
+# times in the snapshot.  CXX and CXXFLAGS are passed through.
+set -e
+
+CXX=${CXX:-g++}
+OUT=${OUT:-failover_build}
+PORTS="18073 18075 18076 18077"  # k_thermostatUrl and k_fanUrls in the soak build
+POLL_MS=15000  # k_thermostatPollFrequencySeconds
+
+mkdir -p "$OUT"
+$CXX $CXXFLAGS -O2 -DFANCONTROL_SOAK=1 fan_controller.cpp -o "$OUT/fan_controller_soak" \
+  -std=c++17 -lcurl -pthread
+$CXX $CXXFLAGS -O2 mock_devices.cpp -o "$OUT/mock_devices" -std=c++17
+
+cd "$OUT"
+rm -f fancontrol_history.bin fancontrol_rollup_*.bin fancontrol_snapshot.bin active.log standby.log
+./mock_devices 1 $PORTS &
+mock=$!
+active=
+standby=
+trap 'kill "$mock" $active $standby 2> /dev/null' EXIT
+
+# Waits up to 30 s for `pattern` to show up in `log`.
+wait_for() {
+  tries=0
+  until grep -q "$2" "$1"; do
+    tries=$((tries + 1))
+    if [ "$tries" -gt 3000 ]; then
+      echo "FAIL: no \"$2\" in $OUT/$1"
+      exit 1
+    fi
+    sleep 0.01
+  done
+}
+
+./fan_controller_soak > /dev/null 2> active.log &
+active=$!
+wait_for active.log "First decision"
+./fan_controller_soak > /dev/null 2> standby.log &
+standby=$!
+wait_for standby.log "waiting as a standby"
+
+killed=$(date +%s%N)
+kill -KILL "$active"
+wait "$active" 2> /dev/null || true
+active=
+wait_for standby.log "First decision"
+failover_ms=$(( ($(date +%s%N) - killed) / 1000000 ))
+kill -TERM "$standby"
+wait "$standby" || true
+standby=
+
+echo "Standby decided $failover_ms ms after the active controller was killed"
+if ! grep -q "Resumed from the snapshot" standby.log; then
+  echo "FAIL: standby didn't resume from the snapshot"
+  exit 1
+fi
+if [ "$failover_ms" -gt "$POLL_MS" ]; then
+  echo "FAIL: failover took longer than a poll ($POLL_MS ms)"
+  exit 1
+fi
+echo "PASS"
@@ -22,72 +22,570 @@
  *    - I started as a single file, which makes it easy to compile
  *    - It's borderline too big for one file
  *    - Some functionality might be useful for other purposes
- * 2) Read in some parameters from a config file
- *    - Might be able to re-use the same logic for other seasons,
- *      and of course avoid recompiling just to make a tweak.
  */
 
 #include <curl/curl.h>
+#include <pthread.h>
 #include <rapidjson/document.h>
 #include <rapidjson/prettywriter.h>
 #include <syslog.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <csignal>
+#include <cstdarg>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <functional>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
-#include <thread>
+#include <string_view>
 #include <vector>
 
+#include "anomaly_rules.h"
+#include "config.h"
+#include "dispatcher.h"
+#include "event_log.h"
+#include "fan_policy.h"
+#include "flight_recorder.h"
+#include "heat_predictor.h"
+#include "history.h"
+#include "perf_profile.h"
+#include "pipeline.h"
+#include "rate_limiter.h"
+#include "resource_usage.h"
+#include "rollups.h"
+#include "standby.h"
+#include "thermostat_program.h"
+#include "workflow.h"
+
 #undef DEBUG
 
 namespace {
-static const auto k_thermostatPollFrequencySeconds = std::chrono::seconds(15);
-static const auto k_runBlowerFanAfterHeatOff = std::chrono::seconds(60 * 6);
-static const auto k_ceilingFanOnDelay = std::chrono::seconds(60);
-static const auto k_ceilingFanOffDelay = std::chrono::seconds(180);
-static const int k_heatOnFanSpeed = 2;
-static const int k_heatOffFanSpeed = 1;
+static constexpr auto k_thermostatPollFrequencySeconds = std::chrono::seconds(15);
+static constexpr auto k_runBlowerFanAfterHeatOff = std::chrono::seconds(60 * 6);
+static constexpr auto k_ceilingFanOnDelay = std::chrono::seconds(60);
+static constexpr auto k_ceilingFanOffDelay = std::chrono::seconds(180);
+static constexpr int k_heatOnFanSpeed = 2;
+static constexpr int k_heatOffFanSpeed = 1;
+// When a call for heat looks imminent, poll this often so we see the furnace start promptly.
+static constexpr auto k_fastPollFrequencySeconds = std::chrono::seconds(3);
+// How far below the setpoint our thermostat lets the house cool before calling for heat, and how
+// much recent history the heat call prediction fits a trend to.
+static constexpr double k_heatCallSwing = 0.5;
+static constexpr auto k_heatTrendWindow = std::chrono::hours(3);
+// A house model fitted by thermal_fit --out, if there is one, predicts heat calls until the trend
+// has enough points (see heat_predictor.h).
+static constexpr const char* k_thermalModelPath = "fancontrol_thermal_model.txt";
+// Ceiling fan changes due between polls are sent on time rather than at the next poll; the fan is
+// queried this long beforehand so the connection is already up when the command goes out.
+static constexpr auto k_fanWarmupLead = std::chrono::seconds(2);
+// At startup the first decision waits up to this long past the thermostat poll for each fan to say
+// what speed it's at.  One that hasn't answered by then sits that decision out (see Boot()).
+static constexpr auto k_discoveryGrace = std::chrono::seconds(1);
+// The thermostat's weekly program is fetched at startup and refreshed this often (or retried this
+// often if fetching fails).  We poll fast from a little before each scheduled setpoint change
+// until a little after, as that's when the furnace is most likely to start or stop.
+static constexpr auto k_programRefreshInterval = std::chrono::hours(24);
+static constexpr auto k_programRetryInterval = std::chrono::hours(1);
+static constexpr auto k_programChangeLead = std::chrono::seconds(30);
+static constexpr auto k_programChangeFollow = std::chrono::minutes(2);
+
+// Sets of thermostat endpoints (relative to /tstat) that together provide every field we poll
+// for.  At startup each set is timed over a few polls and the cheapest is used from then on.
+static const std::vector<std::vector<std::string>> k_pollEndpointCandidates = {
+    {""}, {"/temp", "/ttemp", "/tstate", "/fmode"}};
+static constexpr int k_pollEndpointBenchmarkRounds = 3;
 /*
  *  By default CURL does not timeout http requests. We started with this at 4 seconds,
  *  thinking 3 should be more than enough for the simple requests performed. However,
  *  we saw many instances where this took much longer (need to analyze that!), so we've
  *  bumped this up for the time being.
  */
-static const int k_httpTimeout = 10;  // seconds
+static constexpr int k_httpTimeout = 10;  // seconds
+// Idle connections kept open to each device host in the shared pool.  We never have more than one
+// request to a host in flight, so one is enough to never reconnect.
+static constexpr int k_connectionsPerHost = 1;
+// On SIGTERM the devices are restored and files flushed within this long.
+static constexpr auto k_shutdownDeadline = std::chrono::seconds(5);
+// How often the connection pool and resource usage statistics are written to syslog.
+static constexpr auto k_statsInterval = std::chrono::hours(1);
+
+// Every successful thermostat poll is recorded here, see history.h.
+static constexpr const char* k_historyPath = "fancontrol_history.bin";
+// Minute/hour/day aggregates, see rollups.h.  One file per level is created with this prefix.
+static constexpr const char* k_rollupPathPrefix = "fancontrol_rollup";
+// The last this many events are kept in memory and written here on SIGUSR1, a fatal signal or
+// when the watchdog fires (see flight_recorder.h).  Each event is 48 bytes with its slot.
+static constexpr std::size_t k_flightRecorderEvents = 4096;
+static constexpr const char* k_flightRecorderPath = "fancontrol_flight.txt";
+// The same events, and every syslog message, are also logged to segments of this size named
+// <prefix>.<n>.log, keeping the newest few (see event_log.h).  A segment holds about 50,000 events,
+// or a couple of weeks.
+static constexpr const char* k_eventLogPrefix = "fancontrol_events";
+static constexpr std::size_t k_eventSegmentBytes = 4 << 20;
+static constexpr std::size_t k_eventSegments = 8;
+// The watchdog fires if the main loop hasn't come back to sleep this long after it was due to wake.
+// It has to cover a pass where every device times out.
+static constexpr auto k_watchdogGrace = std::chrono::minutes(5);
+// A second controller started alongside waits as a hot standby for the lease on this file, trying
+// for it this often, and carries on from the snapshot the active one saves after every poll (see
+// standby.h).  A snapshot this old is from a controller that stopped long ago and is ignored.
+static constexpr const char* k_leasePath = "fancontrol.lease";
+static constexpr const char* k_snapshotPath = "fancontrol_snapshot.bin";
+static constexpr auto k_standbyCheckInterval = std::chrono::seconds(1);
+static constexpr auto k_snapshotMaxAge = std::chrono::minutes(10);
+
+// Limits for the anomaly alerts (see anomaly_rules.h).  A furnace calling for heat more than six
+// times an hour, or burning for under three minutes, is short-cycling; four failed polls is a
+// minute without the thermostat; and a command four times slower than usual, and slower than two
+// seconds, is worth a look at the fan's WiFi.
+static constexpr fancontrol::AnomalyParams k_anomalyParams{6, std::chrono::minutes(3), 4,
+                                                           std::chrono::seconds(2), 4.0};
+
+static constexpr fancontrol::PolicyParams k_policy{k_ceilingFanOnDelay, k_ceilingFanOffDelay,
+                                                   k_runBlowerFanAfterHeatOff, k_heatOnFanSpeed,
+                                                   k_heatOffFanSpeed};
+// The settings above that may be overridden from this file, read at startup and on SIGHUP (see
+// config.h).
+static constexpr const char* k_configPath = "fancontrol.conf";
+// Fan commands decided at the same time are spread over this window, this many at a time, and all
+// finish within the deadline (see dispatcher.h).
+static constexpr auto k_dispatchWindow = std::chrono::seconds(2);
+static constexpr int k_dispatchConcurrency = 2;
+static constexpr auto k_dispatchDeadline = std::chrono::seconds(k_httpTimeout);
+// Rough draws for the energy accounting: a PSC blower motor on its fan-only tap, and a Modern Forms
+// DC ceiling fan at each speed.  Measured ones belong in the config file.
+static constexpr fancontrol::Wattages k_wattages{400, {0, 4, 7, 11, 16, 23, 32}};
+static constexpr fancontrol::Config k_defaultConfig{
+    k_policy,           k_thermostatPollFrequencySeconds, k_fastPollFrequencySeconds,
+    k_shutdownDeadline, k_dispatchWindow,                 k_dispatchConcurrency,
+    k_dispatchDeadline, k_wattages};
+
+// A soak build (FANCONTROL_SOAK=<speedup>, see soak.sh) talks to mock devices on localhost and runs
+// the controller's clocks that many times faster than real time, so months of polls, heat cycles
+// and rollups pass in an hour or two.  Request timeouts and latencies stay in real time.
+#ifdef FANCONTROL_SOAK
+static constexpr int64_t k_timeScale = FANCONTROL_SOAK;
+static constexpr const char* k_thermostatUrl = "http://127.0.0.1:18073/tstat";
+static constexpr const char* k_programUrl = "http://127.0.0.1:18073/tstat/program/heat";
+static constexpr const char* k_fanUrls[] = {
+    "http://127.0.0.1:18075/mf", "http://127.0.0.1:18076/mf", "http://127.0.0.1:18077/mf"};
+static constexpr int k_syslogOptions = LOG_PERROR;
+#else
+static constexpr int64_t k_timeScale = 1;
+static constexpr const char* k_thermostatUrl = "http://192.168.0.73/tstat";
+static constexpr const char* k_programUrl = "http://192.168.0.73/tstat/program/heat";
+static constexpr const char* k_fanUrls[] = {"http://192.168.0.75/mf", "http://192.168.0.76/mf",
+                                            "http://192.168.0.77/mf"};
+static constexpr int k_syslogOptions = 0;
+#endif
+
+// Requests to each device, and to all of them together, are rate limited (see rate_limiter.h).  A
+// fan gets a burst of 4 and then one request per 10 s, still several commands per heat cycle.  The
+// thermostat is sturdier and polled much more, up to 4 requests per poll with per-field endpoints.
+static constexpr fancontrol::RateLimit k_fanRateLimit{
+    4, std::chrono::nanoseconds(std::chrono::seconds(10)) / k_timeScale};
+static constexpr fancontrol::RateLimit k_thermostatRateLimit{
+    24, std::chrono::nanoseconds(std::chrono::milliseconds(500)) / k_timeScale};
+static constexpr fancontrol::RateLimit k_globalRateLimit{
+    32, std::chrono::nanoseconds(std::chrono::milliseconds(250)) / k_timeScale};
+// How long a request may wait for its tokens before it's dropped and counted as failed.
+static constexpr auto k_rateLimitMaxWait = std::chrono::seconds(3);
+
+// The clock polls, fan delays and schedules run on: steady_clock, sped up in soak builds.
+struct Clock {
+  using duration = std::chrono::steady_clock::duration;
+  using time_point = std::chrono::steady_clock::time_point;
+  static time_point now() {
+    if constexpr (k_timeScale == 1) return std::chrono::steady_clock::now();
+    static const time_point start = std::chrono::steady_clock::now();
+    return start + (std::chrono::steady_clock::now() - start) * k_timeScale;
+  }
+};
+
+// Console output for watching the controller by hand.  The embedded profile (FANCONTROL_EMBEDDED,
+// see README) leaves it out of the polling path; everything that matters also goes to syslog.
+#ifdef FANCONTROL_EMBEDDED
+#define CONSOLE_OUT(message) \
+  do {                       \
+  } while (0)
+#define CONSOLE_ERR(message) \
+  do {                       \
+  } while (0)
+#else
+#define CONSOLE_OUT(message)                                  \
+  do {                                                        \
+    const PerfProfiler::Scope scope(ProfileSection::LOGGING); \
+    std::cout << message << std::endl;                        \
+  } while (0)
+#define CONSOLE_ERR(message)                                  \
+  do {                                                        \
+    const PerfProfiler::Scope scope(ProfileSection::LOGGING); \
+    std::cerr << message << std::endl;                        \
+  } while (0)
+#endif
+
+using fancontrol::BLOWER_ON;
+using fancontrol::EventKind;
+using fancontrol::EventLoop;
+using fancontrol::PerfProfiler;
+using fancontrol::ProfileSection;
+using fancontrol::RequestPriority;
+using fancontrol::Workflow;
+
+// The decision thread's profiler, set by main() when profiling (-p).  The I/O thread has its own
+// (see perf_profile.h).
+PerfProfiler* profiler = nullptr;
+
+// The configuration in effect.  Readers take their own reference for as long as they need a
+// consistent view, and a reload swaps in a new one; the old one is freed when its last reader lets
+// go.  In-flight state (latched blower mode, pending fan changes) lives in the policies, which
+// take the config per call, so it carries over.
+std::shared_ptr<const fancontrol::Config> config =
+    std::make_shared<const fancontrol::Config>(k_defaultConfig);
+std::shared_ptr<const fancontrol::Config> CurrentConfig() { return std::atomic_load(&config); }
+
+fancontrol::FlightRecorder<k_flightRecorderEvents> recorder;
+// Set by main() once it holds the lease, so events and messages are kept on disk too.
+fancontrol::EventLog* eventLog = nullptr;
+
+// Records an event in the flight recorder and the event log.  Not for signal handlers, which have
+// the recorder alone.
+void RecordEvent(const EventKind kind, const char* device, const int32_t arg0 = 0,
+                 const int32_t arg1 = 0, const int32_t arg2 = 0, const float value0 = 0,
+                 const float value1 = 0, const std::string_view text = {}) {
+  recorder.Record(kind, device, arg0, arg1, arg2, value0, value1);
+  if (eventLog) eventLog->Append(kind, device, arg0, arg1, arg2, value0, value1, text);
+}
+
+// syslog(), with the message also kept in the event log.
+__attribute__((format(printf, 2, 3))) void Log(const int priority, const char* format, ...) {
+  char buffer[512];
+  std::string longer;
+  std::va_list args;
+  va_start(args, format);
+  const int length = std::vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  if (length < 0) return;
+  std::string_view text(buffer, std::size_t(length));
+  if (std::size_t(length) >= sizeof(buffer)) {
+    // Thermostat responses can make for long lines.
+    longer.resize(std::size_t(length) + 1);
+    va_start(args, format);
+    std::vsnprintf(longer.data(), longer.size(), format, args);
+    va_end(args);
+    text = std::string_view(longer.data(), std::size_t(length));
+  }
+  syslog(priority, "%.*s", length, text.data());
+  if (eventLog) eventLog->Append(EventKind::MESSAGE, nullptr, priority, 0, 0, 0, 0, text);
+}
+
+// Set by main() once it holds the lease.  The watchdog gives it up for the standby.
+fancontrol::Lease* lease = nullptr;
+
+void DumpFlightRecorder(const char* reason) {
+  if (recorder.Dump(k_flightRecorderPath, reason)) {
+    Log(LOG_INFO, "Flight recorder written to %s (%s)", k_flightRecorderPath, reason);
+  } else {
+    Log(LOG_ERR, "Unable to write flight recorder to %s", k_flightRecorderPath);
+  }
+}
+
+/**
+ * SIGHUP (reload config), SIGUSR1 (dump the flight recorder) and SIGTERM/SIGINT (shut down) are
+ * blocked in every thread and taken synchronously while the main loop sleeps, so a signal never
+ * lands in the middle of a device request.  One that arrives mid-request waits for the next sleep.
+ */
+sigset_t HandledSignals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  for (const int sig : {SIGHUP, SIGUSR1, SIGTERM, SIGINT}) sigaddset(&signals, sig);
+  return signals;
+}
+
+// The signals that can't wait for a sleep.  Handlers may only use async-signal-safe calls, which
+// is all FlightRecorder::Dump() makes; syslog() isn't one.
+void OnFatalSignal(const int sig) {
+  recorder.Record(EventKind::SIGNAL, nullptr, sig);
+  recorder.Dump(k_flightRecorderPath, "fatal signal");
+  // SA_RESETHAND put the default action back, so this ends the process as the signal would have.
+  raise(sig);
+}
+void OnWatchdog(int /*sig*/) {
+  recorder.Dump(k_flightRecorderPath, "watchdog, main loop stalled");
+  // Whatever has this controller stuck, a standby can do better.
+  if (lease) lease->Abandon();
+}
+
+void InstallCrashHandlers() {
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = OnFatalSignal;
+  action.sa_flags = SA_RESETHAND | SA_NODEFER;
+  for (const int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT}) sigaction(sig, &action, nullptr);
+  action.sa_handler = OnWatchdog;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGALRM, &action, nullptr);
+}
+
+// Rearms the watchdog for a sleep until `wake`.
+void FeedWatchdog(const Clock::time_point wake) {
+  using namespace std::chrono;
+  const auto timeout =
+      duration_cast<seconds>((wake - Clock::now()) / k_timeScale + k_watchdogGrace);
+  alarm(unsigned(std::max<int64_t>(1, timeout.count())));
+}
+bool reloadRequested = false;
+bool shutdownRequested = false;
+
+// Sleeps until `until`, noting any signals, even if that's already past.  Returns false, early,
+// once asked to shut down.
+bool SleepUntil(const Clock::time_point until) {
+  using namespace std::chrono;
+  const sigset_t signals = HandledSignals();
+  do {
+    const auto remaining = std::max(nanoseconds::zero(),
+                                    duration_cast<nanoseconds>(until - Clock::now()) / k_timeScale);
+    const timespec timeout{time_t(remaining.count() / 1000000000),
+                           long(remaining.count() % 1000000000)};
+    const int sig = sigtimedwait(&signals, nullptr, &timeout);
+    if (sig > 0) RecordEvent(EventKind::SIGNAL, nullptr, sig);
+    if (sig == SIGUSR1) DumpFlightRecorder("SIGUSR1");
+    if (sig == SIGHUP) reloadRequested = true;
+    if (sig == SIGTERM || sig == SIGINT) shutdownRequested = true;
+  } while (!shutdownRequested && Clock::now() < until);
+  return !shutdownRequested;
+}
+
+// Loads k_configPath over the defaults and swaps it in, keeping the current config on error.
+void ReloadConfig() {
+  using namespace std::chrono;
+  const auto startTime(steady_clock::now());
+  std::string error;
+  auto loaded = fancontrol::Config::Load(k_configPath, k_defaultConfig, error);
+  if (!loaded) {
+    Log(LOG_ERR, "Config not loaded, keeping the current one: %s", error.c_str());
+    return;
+  }
+  std::atomic_store(&config, std::make_shared<const fancontrol::Config>(*loaded));
+  const auto reloadTime(duration_cast<microseconds>(steady_clock::now() - startTime));
+  Log(LOG_INFO, "Loaded config %s in %ld us", k_configPath, long(reloadTime.count()));
+}
+
+// Set by main() so device commands are counted in the rollups as they happen.
+fancontrol::RollupRecorder* rollups = nullptr;
+// Set by main() so device commands are checked for latency spikes.
+fancontrol::AnomalyRules* anomalies = nullptr;
+
+int64_t WallClockSeconds() {
+  using namespace std::chrono;
+  const auto now = system_clock::to_time_t(system_clock::now());
+  if constexpr (k_timeScale == 1) return now;
+  static const int64_t start = now;
+  static const auto clockStart = Clock::now();
+  return start + duration_cast<seconds>(Clock::now() - clockStart).count();
+}
+
+// Commands are recorded on the decision thread as each is collected (see FanTask::Collected()).
+void RecordCommand(const std::string& device, const std::chrono::milliseconds opTime,
+                   const bool ok) {
+  if (rollups) rollups->AddCommand(WallClockSeconds(), uint32_t(opTime.count()), ok);
+  if (anomalies) anomalies->Commanded(device, opTime);
+}
+
+/**
+ * DNS and connection cache shared by every device handle.  A connection opened by one handle is
+ * reused by the others talking to the same host (the thermostat poll, blower commands and the
+ * program fetch all go to the thermostat), and outlives the handles.  Requests run on the I/O
+ * thread (see pipeline.h) while main() reports the statistics, so the share and statistics are
+ * locked.
+ */
+std::string HostOf(const std::string& url) {
+  const std::size_t start = url.find("//");
+  const std::size_t from = start == std::string::npos ? 0 : start + 2;
+  return url.substr(from, url.find('/', from) - from);
+}
 
-static const int BLOWER_ON = 2;
+class ConnectionPool final {
+  struct HostStats {
+    uint64_t requests = 0;
+    uint64_t newConnections = 0;
+    uint64_t failures = 0;
+    double lookupSeconds = 0;
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+  };
+  CURLSH* share;
+  std::mutex shareLocks[CURL_LOCK_DATA_LAST];
+  std::mutex statsLock;
+  std::map<std::string, HostStats> hosts;
+  std::vector<CURL*> handles;
+
+  static void Lock(CURL*, curl_lock_data data, curl_lock_access, void* pool) {
+    static_cast<ConnectionPool*>(pool)->shareLocks[data].lock();
+  }
+  static void Unlock(CURL*, curl_lock_data data, void* pool) {
+    static_cast<ConnectionPool*>(pool)->shareLocks[data].unlock();
+  }
+
+ public:
+  ConnectionPool() : share(curl_share_init()) {
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, Lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, Unlock);
+    curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  }
+  // Every attached handle must be cleaned up first.
+  ~ConnectionPool() { curl_share_cleanup(share); }
+
+  void Attach(CURL* curl, const std::string& url) {
+    const std::lock_guard<std::mutex> lock(statsLock);
+    hosts[HostOf(url)];
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    handles.push_back(curl);
+    // The cap applies to the whole cache, so size it for every host we talk to, on every handle:
+    // whichever handle finishes a request applies its own cap.
+    for (CURL* handle : handles) {
+      curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, long(k_connectionsPerHost * hosts.size()));
+    }
+  }
+
+  // Called after each request on an attached handle.
+  void Record(CURL* curl, const bool ok) {
+    const char* url = nullptr;
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    long newConnections = 0, requestBytes = 0, headerBytes = 0;
+    double lookupSeconds = 0;
+    curl_off_t uploaded = 0, downloaded = 0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &newConnections);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &lookupSeconds);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &requestBytes);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &headerBytes);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    const std::lock_guard<std::mutex> lock(statsLock);
+    HostStats& stats = hosts[HostOf(url ? url : "")];
+    ++stats.requests;
+    stats.newConnections += uint64_t(newConnections);
+    stats.failures += !ok;
+    stats.lookupSeconds += lookupSeconds;
+    stats.bytesSent += uint64_t(requestBytes + uploaded);
+    stats.bytesReceived += uint64_t(headerBytes + downloaded);
+  }
+
+  void Log() {
+    const std::lock_guard<std::mutex> lock(statsLock);
+    for (const auto& [host, stats] : hosts) {
+      const uint64_t reused =
+          stats.requests > stats.newConnections ? stats.requests - stats.newConnections : 0;
+      ::Log(LOG_INFO,
+            "Connections to %s: %lu requests, %lu reused connections, %lu new, %lu failed, "
+            "%.3f s resolving, %lu bytes sent, %lu received",
+            host.c_str(), (unsigned long)stats.requests, (unsigned long)reused,
+            (unsigned long)stats.newConnections, (unsigned long)stats.failures,
+            stats.lookupSeconds, (unsigned long)stats.bytesSent,
+            (unsigned long)stats.bytesReceived);
+    }
+  }
+};
+
+// Set by main() so each request is counted in the pool statistics.
+ConnectionPool* connectionPool = nullptr;
+// Set by main() so each request is rate limited.
+fancontrol::RequestLimiter* requestLimiter = nullptr;
+// Set by main() so commands decided together are staggered.
+fancontrol::StaggeredDispatcher* dispatcher = nullptr;
+// Set by main() so device requests run on the I/O thread, see pipeline.h.
+fancontrol::IoPipeline* pipeline = nullptr;
+// Set by main() so work done outside the main loop body is accounted for too.
+fancontrol::ResourceUsage* resourceUsage = nullptr;
+
+// Today's fan running costs so far, from the open day rollup.
+void LogEnergy(const fancontrol::Rollup& day) {
+  uint32_t fanSeconds = 0;
+  for (int speed = 1; speed <= fancontrol::k_maxFanSpeed; ++speed) {
+    fanSeconds += day.fanSpeedSeconds[speed];
+  }
+  Log(LOG_INFO,
+      "Energy today: blower %.2f h (%.2f h past the heat), ceiling fans %.2f h, %.3f kWh "
+      "(%.3f kWh past the heat)",
+      day.blowerOnSeconds / 3600.0, day.extendedBlowerSeconds / 3600.0, fanSeconds / 3600.0,
+      day.KWh(), day.extendedBlowerWh / 1000);
+}
+
+void LogStats(ConnectionPool& pool) {
+  pool.Log();
+  if (rollups) LogEnergy(rollups->Current(fancontrol::RollupLevel::DAY));
+  if (requestLimiter) {
+    for (const auto& line : requestLimiter->Report()) Log(LOG_INFO, "%s", line.c_str());
+  }
+  if (dispatcher) Log(LOG_INFO, "%s", dispatcher->Report().c_str());
+  if (pipeline) Log(LOG_INFO, "%s", pipeline->Report().c_str());
+  if (resourceUsage) {
+    if (pipeline) {
+      const auto io = pipeline->IoUsage();
+      resourceUsage->SetThreadTotals(fancontrol::Subsystem::DEVICE_IO, io.workflows, io.cpuNanos,
+                                     io.contextSwitches);
+    }
+    for (const auto& line : resourceUsage->Report()) Log(LOG_INFO, "%s", line.c_str());
+  }
+  if (anomalies) Log(LOG_INFO, "%s", anomalies->Report().c_str());
+  if (profiler) {
+    for (const auto& line : profiler->Report()) Log(LOG_INFO, "Profile %s", line.c_str());
+    if (pipeline) {
+      for (const auto& line : pipeline->ProfileReport()) {
+        Log(LOG_INFO, "Profile I/O thread %s", line.c_str());
+      }
+    }
+  }
+}
 
 class CurlObj {
   CURL* curl;
+  curl_slist* headers = nullptr;
 
  public:
-  CurlObj(const std::string& url) {
+  CurlObj(const std::string& url, ConnectionPool* pool = nullptr) {
     curl = curl_easy_init();
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    if (pool) pool->Attach(curl, url);
 
     // Don't bother trying IPv6, which would increase DNS resolution time.
     curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, k_httpTimeout);  // default is forever
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    // Requests run on the I/O thread, and the watchdog owns SIGALRM.
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 
     // All our messages to the devices use JSON data.  Although we did find that our
     // devices don't seem to care if we set this or not, examples typically did set it.
-    struct curl_slist* headers = NULL;
-    curl_slist_append(headers, "Content-Type: application/json");
-    curl_slist_append(headers, "charset: utf-8");
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    headers = curl_slist_append(headers, "charset: utf-8");
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
   }
-  ~CurlObj() { curl_easy_cleanup(curl); }
+  ~CurlObj() {
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+  }
+  CurlObj(const CurlObj&) = delete;
+  CurlObj& operator=(const CurlObj&) = delete;
   CURL* operator()() { return curl; }
 };
 
 std::string GetURL(CURL* c) {
   const char* urlStr = NULL;
-  CURLcode rc = curl_easy_getinfo(c, CURLINFO_EFFECTIVE_URL, &urlStr);
+  curl_easy_getinfo(c, CURLINFO_EFFECTIVE_URL, &urlStr);
   if (!urlStr) return std::string();
   return std::string(urlStr);
 }
@@ -103,31 +601,46 @@ struct ThermostatState {
                   const int blowerState)
       : temp(temp), targetTemp(targetTemp), isHeatOn(isHeatOn), blowerState(blowerState) {}
 };
+// Only for the console output, which the embedded profile leaves out.
+#ifndef FANCONTROL_EMBEDDED
 std::ostream& operator<<(std::ostream& os, const ThermostatState& currentState) {
   os << "State: Temp: " << currentState.temp << " Target: " << currentState.targetTemp
      << " Heat On: " << currentState.isHeatOn << " Blower: " << currentState.blowerState;
   return os;
 }
+#endif
 
 class Thermostat final {
   CURL* curlInstance;
+  const std::string baseUrl;
+  std::vector<std::string> pollPaths;
   std::optional<ThermostatState> previousState;
-  std::chrono::steady_clock::time_point lastTransitionTime;
+  // Unset until we've seen the furnace turn on or off.
+  std::optional<std::chrono::steady_clock::time_point> lastTransitionTime;
+  std::optional<std::chrono::steady_clock::time_point> lastPollTime;
   bool stateChanged;
   unsigned long failCount;
 
+  class Query;
+
   void SetState(const ThermostatState& newState);
-  std::optional<ThermostatState> ParseState(const std::string& stateData);
+  std::optional<ThermostatState> ParseState(const std::vector<std::string>& stateData);
+  std::pair<long, std::vector<std::string>> Fetch(const std::vector<std::string>& paths,
+                                                  RequestPriority priority,
+                                                  double* wireBytes = nullptr);
 
   friend std::ostream& operator<<(std::ostream& os, const Thermostat& currentState);
 
  public:
-  Thermostat(CURL* curlInstance);
+  Thermostat(CURL* curlInstance, const std::string& baseUrl);
   ~Thermostat();
 
-  // Returns the time since the furnace last turned on or turned off, or zero is we haven't yet seen
-  // a transition.
-  auto GetTimeSinceTransition() const;
+  // Times each of k_pollEndpointCandidates and polls the cheapest from then on.
+  void SelectPollEndpoints();
+
+  // Returns the time since the furnace last turned on or turned off, or nullopt if we haven't yet
+  // seen a transition.
+  std::optional<std::chrono::steady_clock::duration> GetTimeSinceTransition() const;
 
   // Returns true iff we were able to successfully retrieve and parse the new state data from the
   // thermostat.
@@ -138,156 +651,517 @@ class Thermostat final {
   // True if the furnace mode (off, heat, cool) changed since the last update.
   bool StateChanged() const;
 
+  // How many polls in a row have failed, 0 if the last one worked.
+  unsigned long FailStreak() const { return failCount; }
+
   bool isFurnaceOn() const;
 
   // \return the last known blower state, or -1 if we haven't fetched thermostat data yet.
   int GetBlowerState() const;
+
+  // The most recently fetched state, if any.
+  const std::optional<ThermostatState>& GetState() const;
+
+  // Snapshot of the above for the fan policies.
+  fancontrol::PolicyInput GetPolicyInput() const;
+
+  // Saves the state and transition time for a standby, or picks them up from the controller this
+  // one took over from (see standby.h).
+  void Save(fancontrol::ControllerSnapshot& snapshot) const;
+  void Resume(const fancontrol::ControllerSnapshot& snapshot);
+};
+
+// Cached copy of the thermostat's weekly heat program.
+class ThermostatSchedule final {
+  CURL* curlInstance;
+  const std::string url;
+  std::optional<fancontrol::ThermostatProgram> program;
+  std::chrono::steady_clock::time_point nextFetchTime;
+
+ public:
+  ThermostatSchedule(CURL* curlInstance);
+
+  // Fetches the program if we don't have it or it's time to refresh.
+  void Refresh();
+
+  // True if a scheduled setpoint change is about to happen or just happened.
+  bool NearScheduledChange() const;
+};
+
+/**
+ * A device interaction (see workflow.h) that says whether it worked.  It runs on the I/O thread
+ * (see pipeline.h), and Collected() is called back on the decision thread once it's back, whether
+ * or not it got to run.
+ */
+class FanTask : public Workflow {
+ public:
+  bool ok = false;
+  // Bounds its request, if set before it starts.  Otherwise k_httpTimeout applies.
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+
+  virtual ~FanTask() = default;
+  virtual void Collected() {}
 };
 
 class Fan {
  protected:
   CURL* curlInstance;
+  // Fixed at construction, so the flight recorder can hold on to it, and so the decision thread
+  // never has to ask the handle.
+  const std::string url;
 
  public:
-  Fan(CURL* inst) : curlInstance(inst) {}
+  // Set while a task dispatched for it is out (see Dispatch()).
+  bool busy = false;
+
+  Fan(CURL* inst) : curlInstance(inst), url(GetURL(inst)) {}
   virtual ~Fan() {}
-  virtual void Update(const Thermostat& tstat) = 0;
+  // What to set the fan to after this poll, if anything.  The caller sends it with the task from
+  // Send(), which reports the outcome back to the policy once it's collected; the fans' commands go
+  // out together (see Dispatch()).
+  virtual std::optional<int> Decide(const Thermostat& tstat) = 0;
+  virtual std::unique_ptr<FanTask> Send(int value) = 0;
   virtual void Debug() = 0;
+
+  // Fans with a change scheduled before the next poll say how long until it's due, so main() can
+  // wake up for it.  DecideDue() is then called in place of Decide() at that time, and Warm() a
+  // little before.
+  virtual std::optional<std::chrono::steady_clock::duration> TimeUntilDue(
+      const Thermostat& /*tstat*/) const {
+    return std::nullopt;
+  }
+  virtual std::optional<int> DecideDue(const Thermostat& /*tstat*/) { return std::nullopt; }
+  virtual std::unique_ptr<FanTask> Warm() { return nullptr; }
+  // Learns the device's current state at startup, if there's anything to learn.  Runs alongside
+  // the first thermostat poll, so it mustn't use the thermostat's handle.
+  virtual std::unique_ptr<FanTask> Discover() { return nullptr; }
+  // What a standby needs to carry on from this fan's policy (see standby.h), and taking it back.
+  virtual int32_t SaveState() const { return 0; }
+  virtual void LoadState(int32_t /*state*/) {}
+
+  // Puts the device back the way we leave it between heat cycles, for shutdown, or nullptr if it
+  // already is.  The devices are restored together on the I/O thread.
+  virtual std::unique_ptr<FanTask> Restore() = 0;
+  // Adds what it's running as now to `loads`, for the energy accounting (see rollups.h).
+  virtual void AddLoad(fancontrol::Loads& /*loads*/) const {}
+  const std::string& Name() const { return url; }
 };
 
 class FurnaceBlower : public Fan {
-  std::optional<int> latchedState;
+  fancontrol::BlowerPolicy policy;
 
  public:
   FurnaceBlower(CURL*);
   ~FurnaceBlower();
-  void Update(const Thermostat& tstat) final;
+  std::optional<int> Decide(const Thermostat& tstat) final;
+  std::unique_ptr<FanTask> Send(int value) final;
   void Debug() final;
-  bool SetBlowerState(int newState);
+  int32_t SaveState() const final;
+  void LoadState(int32_t state) final;
+  std::unique_ptr<FanTask> Restore() final;
+  void AddLoad(fancontrol::Loads& loads) const final;
+
+ private:
+  class SetMode;
 };
 
 class CeilingFan : public Fan {
-  bool fanStateUpdatedSinceLastTransition;
+  fancontrol::CeilingFanPolicy policy;
+  // What Discover() found, until the first decision.
+  std::optional<int> discoveredSpeed;
+  // What it last reported or was last set to, if we know.
+  std::optional<int> knownSpeed;
+  // Furnace transitions seen, so the outcome of a command sent before the latest one isn't taken
+  // for the policy's answer to it.
+  uint64_t transitions = 0;
 
  public:
   CeilingFan(CURL*);
   ~CeilingFan();
-  void Update(const Thermostat& tstat) final;
+  std::optional<int> Decide(const Thermostat& tstat) final;
+  std::unique_ptr<FanTask> Send(int value) final;
   void Debug() final;
-  bool SetFanSpeed(int speed);
-  int GetFanSpeed();
-  void Reboot();
+  std::optional<std::chrono::steady_clock::duration> TimeUntilDue(
+      const Thermostat& tstat) const final;
+  std::optional<int> DecideDue(const Thermostat& tstat) final;
+  std::unique_ptr<FanTask> Warm() final;
+  std::unique_ptr<FanTask> Discover() final;
+  int32_t SaveState() const final;
+  void LoadState(int32_t state) final;
+  std::unique_ptr<FanTask> Restore() final;
+  void AddLoad(fancontrol::Loads& loads) const final;
+
+ private:
+  class Query;
+  class SetSpeed;
 };
 
+#ifdef DEBUG
 void writeJsonOut(const rapidjson::Document& doc) {
   rapidjson::StringBuffer sb;
   rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sb);
   doc.Accept(writer);
-  std::cout << "\nJSON data received:" << std::endl;
-  std::cout << sb.GetString() << std::endl;
+  CONSOLE_OUT("\nJSON data received:\n" << sb.GetString());
 }
+#endif
 
 std::size_t callback(const char* in, std::size_t size, std::size_t num, std::string* out) {
   const std::size_t totalBytes(size * num);
-  if (out) out->assign(in, totalBytes);
+  // Larger responses can arrive in more than one piece.
+  if (out) out->append(in, totalBytes);
   return totalBytes;
 }
 
 /**
- * Return the data from an HTTP request.  If an error in the return code, an empty string.
+ * Return the data from an HTTP request.  If an error in the return code, an empty string.  A
+ * request the rate limiter drops isn't sent and returns code 0, like one that got no response.
  */
-std::pair<long, std::string> doHttpRequest(CURL* curlInstance) {
+std::pair<long, std::string> doHttpRequest(
+    CURL* curlInstance, const RequestPriority priority = RequestPriority::NORMAL) {
   std::string result;
+  if (requestLimiter) {
+    const char* url = nullptr;
+    curl_easy_getinfo(curlInstance, CURLINFO_EFFECTIVE_URL, &url);
+    if (!requestLimiter->Acquire(HostOf(url ? url : ""), priority, k_rateLimitMaxWait)) {
+      return std::make_pair(0L, result);
+    }
+  }
   curl_easy_setopt(curlInstance, CURLOPT_WRITEFUNCTION, callback);
   curl_easy_setopt(curlInstance, CURLOPT_WRITEDATA, &result);
-  curl_easy_perform(curlInstance);
+  const CURLcode rc = curl_easy_perform(curlInstance);
   long httpReturnCode(0);
   curl_easy_getinfo(curlInstance, CURLINFO_RESPONSE_CODE, &httpReturnCode);
+  if (connectionPool) connectionPool->Record(curlInstance, rc == CURLE_OK);
   return std::make_pair(httpReturnCode, result);
 }
 
-Thermostat::Thermostat(CURL* curlInstance)
+/**
+ * Runs `workflow` to the end, for callers that want the outcome now: on the I/O thread once main()
+ * has started it, waiting for it there, and on the calling thread before that.
+ */
+void RunToCompletion(Workflow& workflow) {
+  if (pipeline) {
+    pipeline->Run(workflow);
+    return;
+  }
+  EventLoop loop;
+  loop.Start(workflow);
+  loop.Run(EventLoop::Clock::time_point::max());
+}
+
+/**
+ * doHttpRequest() as a workflow: waits for the rate limiter on a timer rather than blocking the
+ * loop.  A request the limiter drops isn't sent and gets code 0.  `setup` sets the handle up for
+ * this request (URL, method, body) once it's free; the body must outlive the request.
+ */
+class DeviceRequest final : public Workflow {
+  CURL* const curlInstance;
+  const RequestPriority priority;
+  const std::string host;
+  const std::function<void(CURL*)> setup;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point retryAt;
+  // Our place in the rate limiter's queue while it holds us back.
+  std::optional<uint64_t> ticket;
+
+  void Setup() const {
+    using namespace std::chrono;
+    if (setup) setup(curlInstance);
+    const auto timeout = deadline ? duration_cast<milliseconds>(*deadline - steady_clock::now())
+                                  : milliseconds(seconds(k_httpTimeout));
+    curl_easy_setopt(curlInstance, CURLOPT_TIMEOUT_MS, long(std::max<int64_t>(1, timeout.count())));
+  }
+
+ public:
+  fancontrol::HttpResponse response;
+  // Bounds the request if set before it starts (see FanTask).
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+
+  DeviceRequest(CURL* curlInstance, const std::string& url, const RequestPriority priority,
+                std::function<void(CURL*)> setup)
+      : curlInstance(curlInstance),
+        priority(priority),
+        host(HostOf(url)),
+        setup(std::move(setup)) {}
+  ~DeviceRequest() override {
+    // Abandoned while held back, e.g. by a deadline, so don't leave it queued ahead of others.
+    if (requestLimiter && ticket) requestLimiter->Dropped(host, ticket);
+  }
+
+  void Resume(EventLoop& loop) override {
+    WORKFLOW_BEGIN;
+    start = std::chrono::steady_clock::now();
+    while (requestLimiter && !requestLimiter->TryAcquire(host, priority, start, ticket, retryAt)) {
+      if (retryAt > start + k_rateLimitMaxWait) {
+        requestLimiter->Dropped(host, ticket);
+        WORKFLOW_RETURN;
+      }
+      WORKFLOW_AWAIT(loop.Sleep(*this, retryAt));
+    }
+    WORKFLOW_AWAIT(loop.Request(*this, curlInstance, response, [this]() { Setup(); }));
+    if (connectionPool) connectionPool->Record(curlInstance, response.result == CURLE_OK);
+    WORKFLOW_END;
+  }
+};
+
+// Sends all of `fields` to a fan in one request, e.g. {{"fanOn", 1}, {"fanSpeed", 3}}.  The fan
+// answers every request with its current state, which is kept parsed in `state`.
+class FanCommand final : public Workflow {
+  std::string postData;
+  DeviceRequest request;
+
+ public:
+  // The fan's state from its answer, if it answered with one.
+  std::optional<rapidjson::Document> state;
+  // Bounds the request if set before it starts (see FanTask).
+  std::optional<std::chrono::steady_clock::time_point> deadline;
+
+  FanCommand(CURL* curlInstance, const std::string& url,
+             const std::vector<std::pair<std::string, int>>& fields,
+             const RequestPriority priority)
+      : request(curlInstance, url, priority, [this](CURL* curl) {
+          curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.c_str());
+        }) {
+    for (const auto& field : fields) {
+      postData += (postData.empty() ? "{\"" : ", \"") + field.first +
+                  "\": " + std::to_string(field.second);
+    }
+    postData += "}";
+  }
+  long Code() const { return request.response.code; }
+
+  void Resume(EventLoop& loop) override {
+    WORKFLOW_BEGIN;
+    request.deadline = deadline;
+    WORKFLOW_AWAIT(loop.Call(*this, request));
+    state.emplace();
+    state->Parse(request.response.body.c_str());
+    if (Code() != 200 || state->HasParseError() || !state->IsObject()) state.reset();
+#ifdef DEBUG
+    if (state) writeJsonOut(*state);
+#endif
+    WORKFLOW_END;
+  }
+};
+
+Thermostat::Thermostat(CURL* curlInstance, const std::string& baseUrl)
     : curlInstance(curlInstance),
+      baseUrl(baseUrl),
+      pollPaths(k_pollEndpointCandidates.front()),
       previousState(std::nullopt),
-      lastTransitionTime(std::chrono::steady_clock::now() - k_runBlowerFanAfterHeatOff),
       stateChanged(false),
       failCount(0) {}
 
 Thermostat::~Thermostat() {}
 
-// Returns the time since the funace last turned on or turned off, or zero is we haven't yet seen a
-// transition.
-auto Thermostat::GetTimeSinceTransition() const {
-  if (lastTransitionTime.time_since_epoch() == std::chrono::steady_clock::duration::zero()) {
-    return std::chrono::steady_clock::duration::zero();
-  }
-  return std::chrono::steady_clock::now() - lastTransitionTime;
+// Returns the time since the funace last turned on or turned off, or nullopt if we haven't yet seen
+// a transition.
+std::optional<std::chrono::steady_clock::duration> Thermostat::GetTimeSinceTransition() const {
+  if (!lastTransitionTime) return std::nullopt;
+  return Clock::now() - *lastTransitionTime;
 }
 
-std::optional<ThermostatState> Thermostat::ParseState(const std::string& thermostatData) {
-  if (thermostatData.empty()) {
-    std::cerr << "Empty thermostat data returned!" << std::endl;
-    return std::nullopt;
-  }
+std::string JoinResponses(const std::vector<std::string>& responses) {
+  std::string joined;
+  for (const auto& response : responses) joined += (joined.empty() ? "" : " ") + response;
+  return joined;
+}
+
+// The fields may be spread over several responses when polling the smaller endpoints.
+std::optional<ThermostatState> Thermostat::ParseState(
+    const std::vector<std::string>& thermostatData) {
+  const PerfProfiler::Scope scope(ProfileSection::PARSE_STATE);
+  std::optional<float> temp, targetTemp;
+  std::optional<int> tstate, fmode;
+  for (const auto& response : thermostatData) {
+    if (response.empty()) {
+      CONSOLE_ERR("Empty thermostat data returned!");
+      return std::nullopt;
+    }
 
-  rapidjson::Document jsonDoc;
-  jsonDoc.Parse(thermostatData.c_str());
+    rapidjson::Document jsonDoc;
+    jsonDoc.Parse(response.c_str());
 #ifdef DEBUG
-  writeJsonOut(jsonDoc);
+    writeJsonOut(jsonDoc);
 #endif
-  if (jsonDoc.HasParseError()) {
-    std::cerr << "Error parsing thermostat data: " << thermostatData << std::endl;
-    return std::nullopt;
+    if (jsonDoc.HasParseError() || !jsonDoc.IsObject()) {
+      CONSOLE_ERR("Error parsing thermostat data: " << response);
+      return std::nullopt;
+    }
+    if (jsonDoc.HasMember("temp")) temp = jsonDoc["temp"].GetFloat();
+    if (jsonDoc.HasMember("t_heat")) targetTemp = jsonDoc["t_heat"].GetFloat();
+    if (jsonDoc.HasMember("tstate")) tstate = jsonDoc["tstate"].GetInt();
+    if (jsonDoc.HasMember("fmode")) fmode = jsonDoc["fmode"].GetInt();
   }
-  if (!jsonDoc.HasMember("temp") || !jsonDoc.HasMember("t_heat") || !jsonDoc.HasMember("tstate") ||
-      !jsonDoc.HasMember("fmode")) {
-    std::cerr << "Missing fields in thermostat data: " << thermostatData << std::endl;
+  if (!temp || !targetTemp || !tstate || !fmode) {
+    CONSOLE_ERR("Missing fields in thermostat data: " << JoinResponses(thermostatData));
     return std::nullopt;
   }
 
-  return ThermostatState{jsonDoc["temp"].GetFloat(), jsonDoc["t_heat"].GetFloat(),
-                         jsonDoc["tstate"].GetInt() == 1, jsonDoc["fmode"].GetInt()};
+  return ThermostatState{*temp, *targetTemp, *tstate == 1, *fmode};
+}
+
+// Fetch() as a workflow.  The handle is shared with the blower, so each request sets its URL.
+class Thermostat::Query final : public Workflow {
+  const Thermostat& tstat;
+  const std::vector<std::string> paths;
+  const RequestPriority priority;
+  std::size_t next = 0;
+  std::optional<DeviceRequest> request;
+
+ public:
+  // The last HTTP code and the response bodies.
+  long code = 0;
+  std::vector<std::string> responses;
+  double wireBytes = 0;
+
+  Query(const Thermostat& tstat, const std::vector<std::string>& paths,
+        const RequestPriority priority)
+      : tstat(tstat), paths(paths), priority(priority) {}
+
+  void Resume(EventLoop& loop) override {
+    WORKFLOW_BEGIN;
+    for (; next < paths.size(); ++next) {
+      request.emplace(tstat.curlInstance, tstat.baseUrl, priority,
+                      [url = tstat.baseUrl + paths[next]](CURL* curl) {
+                        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+                        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+                      });
+      WORKFLOW_AWAIT(loop.Call(*this, *request));
+      {
+        curl_off_t downloaded = 0;
+        long headerBytes = 0, requestBytes = 0;
+        curl_easy_getinfo(tstat.curlInstance, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+        curl_easy_getinfo(tstat.curlInstance, CURLINFO_HEADER_SIZE, &headerBytes);
+        curl_easy_getinfo(tstat.curlInstance, CURLINFO_REQUEST_SIZE, &requestBytes);
+        wireBytes += double(downloaded) + headerBytes + requestBytes;
+      }
+      code = request->response.code;
+      responses.push_back(std::move(request->response.body));
+      if (code != 200) break;
+    }
+    WORKFLOW_END;
+  }
+};
+
+/**
+ * GETs each of `paths` under the thermostat URL, stopping at the first failure.  Returns the last
+ * HTTP code and the response bodies.  If `wireBytes` is given, the bytes sent and received are
+ * added to it.
+ */
+std::pair<long, std::vector<std::string>> Thermostat::Fetch(const std::vector<std::string>& paths,
+                                                            const RequestPriority priority,
+                                                            double* wireBytes) {
+  Query query(*this, paths, priority);
+  RunToCompletion(query);
+  if (wireBytes) *wireBytes += query.wireBytes;
+  return {query.code, std::move(query.responses)};
 }
 
 bool Thermostat::Update() {
+  using namespace std::chrono;
   stateChanged = false;
-  curl_easy_setopt(curlInstance, CURLOPT_HTTPGET, 1L);
-  auto thermostatData = doHttpRequest(curlInstance);
+  const auto startTime(steady_clock::now());
+  auto thermostatData = Fetch(pollPaths, RequestPriority::HIGH);
+  RecordEvent(
+      EventKind::POLL, baseUrl.c_str(), int32_t(thermostatData.first),
+      int32_t(duration_cast<microseconds>(steady_clock::now() - startTime).count()));
   if (thermostatData.first != 200) {
-    std::cerr << "Thermostat returned error code: " << thermostatData.first << std::endl;
+    CONSOLE_ERR("Thermostat returned error code: " << thermostatData.first);
 
     if (++failCount % 6 == 0)
-      syslog(LOG_ERR,
-             "Thermostat %s failed to get data %lu attempts. Returned code: %ld, response: %s",
-             GetURL(curlInstance).c_str(), failCount, thermostatData.first,
-             thermostatData.second.c_str());
+      Log(LOG_ERR,
+          "Thermostat %s failed to get data %lu attempts. Returned code: %ld, response: %s",
+          baseUrl.c_str(), failCount, thermostatData.first,
+          JoinResponses(thermostatData.second).c_str());
     return false;
   }
 
   std::optional<ThermostatState> newState = ParseState(thermostatData.second);
   if (!newState) {
     if (++failCount % 6 == 0)
-      syslog(LOG_ERR,
-             "Thermostat %s failed to parse data %lu attempts. Returned code: %ld, response: %s",
-             GetURL(curlInstance).c_str(), failCount, thermostatData.first,
-             thermostatData.second.c_str());
+      Log(LOG_ERR,
+          "Thermostat %s failed to parse data %lu attempts. Returned code: %ld, response: %s",
+          baseUrl.c_str(), failCount, thermostatData.first,
+          JoinResponses(thermostatData.second).c_str());
     return false;
   }
   failCount = 0;
+  RecordEvent(EventKind::STATE, nullptr, newState->isHeatOn, newState->blowerState, 0,
+              newState->temp, newState->targetTemp);
 
+  const auto now = Clock::now();
   stateChanged = previousState && newState->isHeatOn != previousState->isHeatOn;
   previousState = *newState;
-  if (stateChanged) lastTransitionTime = std::chrono::steady_clock::now();
+  // The furnace changed somewhere since the last poll; halfway is our best guess.
+  if (stateChanged) lastTransitionTime = lastPollTime ? now - (now - *lastPollTime) / 2 : now;
+  lastPollTime = now;
 
   return true;
 }
 
+void Thermostat::SelectPollEndpoints() {
+  using namespace std::chrono;
+  struct Measurement {
+    const std::vector<std::string>* paths;
+    milliseconds latency;  // median of the rounds
+    double bytes;          // per poll
+  };
+  std::vector<Measurement> usable;
+  for (const auto& candidate : k_pollEndpointCandidates) {
+    std::vector<milliseconds> latencies;
+    double bytes = 0;
+    for (int round = 0; round < k_pollEndpointBenchmarkRounds; ++round) {
+      const auto startTime(steady_clock::now());
+      const auto result = Fetch(candidate, RequestPriority::LOW, &bytes);
+      latencies.push_back(duration_cast<milliseconds>(steady_clock::now() - startTime));
+      if (result.first != 200 || !ParseState(result.second)) break;
+    }
+    if (latencies.size() < std::size_t(k_pollEndpointBenchmarkRounds)) continue;
+    std::sort(latencies.begin(), latencies.end());
+    usable.push_back({&candidate, latencies[latencies.size() / 2], bytes / latencies.size()});
+  }
+  if (usable.empty()) {
+    Log(LOG_ERR, "Thermostat %s: no poll endpoints answered, polling %s", baseUrl.c_str(),
+        baseUrl.c_str());
+    return;
+  }
+  // The full state (the first candidate) is what the others are measured against.
+  const auto full = std::find_if(usable.begin(), usable.end(), [](const Measurement& m) {
+    return m.paths == &k_pollEndpointCandidates.front();
+  });
+  if (full == usable.end()) {
+    Log(LOG_ERR, "Thermostat %s: full state didn't answer, keeping the endpoints polled now",
+        baseUrl.c_str());
+    return;
+  }
+
+  const Measurement& best =
+      *std::min_element(usable.begin(), usable.end(), [](const auto& a, const auto& b) {
+        return a.latency != b.latency ? a.latency < b.latency : a.bytes < b.bytes;
+      });
+  pollPaths = *best.paths;
+  std::string chosen;
+  for (const auto& path : pollPaths) chosen += (chosen.empty() ? "" : ",") + baseUrl + path;
+  CONSOLE_OUT("Thermostat endpoints:");
+  // Unused in the embedded profile, which has no console output.
+  for ([[maybe_unused]] const auto& m : usable) {
+    CONSOLE_OUT("  " << m.paths->size() << " request(s) starting " << baseUrl << m.paths->front()
+                      << ": " << m.latency.count() << "ms, " << m.bytes << " bytes per poll");
+  }
+  Log(LOG_INFO, "Polling thermostat via %s: %ld ms, %.0f bytes per poll (full %s: %ld ms, %.0f)",
+      chosen.c_str(), long(best.latency.count()), best.bytes, baseUrl.c_str(),
+      long(full->latency.count()), full->bytes);
+  CONSOLE_OUT("Polling thermostat via " << chosen << ", saving "
+                                         << (full->latency - best.latency).count() << "ms and "
+                                         << (full->bytes - best.bytes) << " bytes per poll");
+}
+
 void Thermostat::Debug() {
   curl_easy_setopt(curlInstance, CURLOPT_HTTPGET, 1L);
   auto thermostatData = doHttpRequest(curlInstance);
-  std::cout << "Thermostat response: " << thermostatData.first << std::endl
-            << thermostatData.second << std::endl
-            << std::endl;
+  CONSOLE_OUT("Thermostat response: " << thermostatData.first << "\n"
+                                       << thermostatData.second << "\n");
 }
 
 // True if the furnace mode (off, heat, cool) changed since the last update.
@@ -298,122 +1172,598 @@ bool Thermostat::isFurnaceOn() const { return previousState && previousState->is
 // \return the last known blower state, or -1 if we haven't fetched thermostat data yet.
 int Thermostat::GetBlowerState() const { return previousState ? previousState->blowerState : -1; }
 
+const std::optional<ThermostatState>& Thermostat::GetState() const { return previousState; }
+
+fancontrol::PolicyInput Thermostat::GetPolicyInput() const {
+  return {StateChanged(), isFurnaceOn(), GetTimeSinceTransition(), GetBlowerState()};
+}
+
+// Times are saved as wall clock seconds, which the two controllers agree on.
+void Thermostat::Save(fancontrol::ControllerSnapshot& snapshot) const {
+  using namespace std::chrono;
+  snapshot.written = WallClockSeconds();
+  snapshot.lastTransition =
+      lastTransitionTime
+          ? snapshot.written - duration_cast<seconds>(Clock::now() - *lastTransitionTime).count()
+          : fancontrol::ControllerSnapshot::k_noTransition;
+  snapshot.hasState = previousState.has_value();
+  if (previousState) {
+    snapshot.temp = previousState->temp;
+    snapshot.targetTemp = previousState->targetTemp;
+    snapshot.isHeatOn = previousState->isHeatOn;
+    snapshot.blowerState = previousState->blowerState;
+  }
+}
+
+// The first poll after this compares against the saved state, so a transition while nobody was
+// polling is still seen.
+void Thermostat::Resume(const fancontrol::ControllerSnapshot& snapshot) {
+  using namespace std::chrono;
+  const auto now = Clock::now();
+  const int64_t wallNow = WallClockSeconds();
+  if (snapshot.lastTransition != fancontrol::ControllerSnapshot::k_noTransition) {
+    lastTransitionTime = now - seconds(wallNow - snapshot.lastTransition);
+  }
+  lastPollTime = now - seconds(wallNow - snapshot.written);
+  if (snapshot.hasState) {
+    previousState = ThermostatState(snapshot.temp, snapshot.targetTemp, snapshot.isHeatOn,
+                                    snapshot.blowerState);
+  }
+}
+
+// Console output only, like ThermostatState's.
+#ifndef FANCONTROL_EMBEDDED
 std::ostream& operator<<(std::ostream& os, const Thermostat& tstat) {
   using namespace std::chrono;
   if (tstat.previousState) os << *tstat.previousState << " ";
-  os << "  Time since transition: "
-     << duration_cast<seconds>(tstat.GetTimeSinceTransition()).count();
+  os << "  Time since transition: ";
+  if (const auto since = tstat.GetTimeSinceTransition()) {
+    os << duration_cast<seconds>(*since).count();
+  } else {
+    os << "none yet";
+  }
   return os;
 }
+#endif
 
-CeilingFan::CeilingFan(CURL* curlInstance)
-    : Fan(curlInstance), fanStateUpdatedSinceLastTransition(false) {}
-CeilingFan::~CeilingFan() {}
+ThermostatSchedule::ThermostatSchedule(CURL* curlInstance)
+    : curlInstance(curlInstance), url(GetURL(curlInstance)), nextFetchTime(Clock::now()) {}
+
+void ThermostatSchedule::Refresh() {
+  const auto now = Clock::now();
+  if (now < nextFetchTime) return;
+  DeviceRequest request(curlInstance, url, RequestPriority::LOW,
+                        [](CURL* curl) { curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L); });
+  RunToCompletion(request);
+  const auto& response = request.response;
+  auto fetched =
+      response.code == 200 ? fancontrol::ThermostatProgram::Parse(response.body) : std::nullopt;
+  if (!fetched) {
+    Log(LOG_ERR, "Unable to fetch thermostat program %s. Returned code: %ld, response: %s",
+        url.c_str(), response.code, response.body.c_str());
+    nextFetchTime = now + k_programRetryInterval;
+    return;
+  }
+  if (!program) {
+    Log(LOG_INFO, "Fetched thermostat program: %zu setpoint changes a week", fetched->Size());
+  }
+  program = std::move(fetched);
+  nextFetchTime = now + k_programRefreshInterval;
+}
 
-bool CeilingFan::SetFanSpeed(const int speed) {
+bool ThermostatSchedule::NearScheduledChange() const {
   using namespace std::chrono;
-  const auto startTime(steady_clock::now());
+  if (!program) return false;
+  const int secondOfWeek = fancontrol::ThermostatProgram::SecondOfWeek(WallClockSeconds());
+  return seconds(program->NextChange(secondOfWeek).second) <= k_programChangeLead ||
+         seconds(program->PreviousChange(secondOfWeek).second) <= k_programChangeFollow;
+}
 
-  const std::string postData = "{\"fanSpeed\": " + std::to_string(speed) + "}";
-  curl_easy_setopt(curlInstance, CURLOPT_POSTFIELDS, postData.c_str());
-  auto result = doHttpRequest(curlInstance);
-  const std::string fanURL = GetURL(curlInstance);
-  const auto opTime(duration_cast<milliseconds>(steady_clock::now() - startTime));
-  std::cout << "  Setting fan " << fanURL << " speed to: " << postData
-            << " Return Code: " << result.first << " took: " << opTime.count() << "ms" << std::endl;
-  syslog(result.first == 200 ? LOG_INFO : LOG_ERR,
-         "Setting fan %s speed to: %d.  %ld : %s (%ld ms)", GetURL(curlInstance).c_str(), speed,
-         result.first, result.first == 200 ? "" : result.second.c_str(), opTime.count());
-#ifdef DEBUG
-  std::cout << "Fan return code :" << result.first << std::endl << result.second << std::endl;
-#endif
-  return (result.first == 200);
+CeilingFan::CeilingFan(CURL* curlInstance) : Fan(curlInstance) {}
+CeilingFan::~CeilingFan() {}
+
+// Sets the speed, then checks the fan's answer says it took.  The state in the response to the set
+// doubles as the read back, so that costs no extra round trip.
+class CeilingFan::SetSpeed final : public FanTask {
+  CeilingFan& fan;
+  const int speed;
+  const uint64_t transition;
+  std::chrono::steady_clock::time_point startTime;
+  std::chrono::milliseconds opTime{};
+  FanCommand command;
+
+  // Logs how it went.
+  bool Check() {
+    using namespace std::chrono;
+    const std::string& fanURL = fan.url;
+    const auto elapsed(steady_clock::now() - startTime);
+    RecordEvent(EventKind::COMMAND, fan.url.c_str(), speed, int32_t(command.Code()),
+                int32_t(duration_cast<microseconds>(elapsed).count()));
+    opTime = duration_cast<milliseconds>(elapsed);
+    std::optional<int> reportedSpeed;
+    if (command.state && command.state->HasMember("fanSpeed") &&
+        (*command.state)["fanSpeed"].IsInt()) {
+      reportedSpeed = (*command.state)["fanSpeed"].GetInt();
+    }
+    // Older firmware may not echo the state back; then a 200 is all we have to go on.
+    const bool ok = command.Code() == 200 && (!reportedSpeed || *reportedSpeed == speed);
+    CONSOLE_OUT("  Setting fan " << fanURL << " speed to: " << speed << " Return Code: "
+                                  << command.Code() << " took: " << opTime.count() << "ms");
+    {
+      const PerfProfiler::Scope scope(ProfileSection::LOGGING);
+      Log(ok ? LOG_INFO : LOG_ERR, "Setting fan %s speed to: %d.  %ld : reports %d (%ld ms)",
+          fanURL.c_str(), speed, command.Code(), reportedSpeed.value_or(-1), opTime.count());
+    }
+    return ok;
+  }
+
+ public:
+  SetSpeed(CeilingFan& fan, const int speed)
+      : fan(fan),
+        speed(speed),
+        transition(fan.transitions),
+        command(fan.curlInstance, fan.url, {{"fanSpeed", speed}}, RequestPriority::NORMAL) {}
+
+  void Resume(EventLoop& loop) override {
+    WORKFLOW_BEGIN;
+    startTime = std::chrono::steady_clock::now();
+    command.deadline = deadline;
+    WORKFLOW_AWAIT(loop.Call(*this, command));
+    ok = Check();
+    WORKFLOW_END;
+  }
+
+  // Records it and reports back to the policy, unless the furnace has turned on or off since.
+  void Collected() override {
+    if (Done()) RecordCommand(fan.url, opTime, ok);
+    if (ok) fan.knownSpeed = speed;
+    if (transition == fan.transitions) fan.policy.Commanded(ok);
+  }
+};
+
+std::optional<int> CeilingFan::Decide(const Thermostat& tstat) {
+  const auto input = tstat.GetPolicyInput();
+  transitions += input.stateChanged;
+  auto speed = policy.Decide(input, CurrentConfig()->policy);
+  if (speed) {
+    RecordEvent(EventKind::DECISION, url.c_str(), *speed);
+    // At startup the fan is often already where we want it.
+    if (speed == discoveredSpeed) {
+      policy.Commanded(true);
+      speed.reset();
+    }
+  }
+  discoveredSpeed.reset();
+  return speed;
 }
 
-int CeilingFan::GetFanSpeed() {
-  curl_easy_setopt(curlInstance, CURLOPT_POSTFIELDS, "{\"queryDynamicShadowData\": 1}");
-  auto fanQuery = doHttpRequest(curlInstance);
-  if (fanQuery.first != 200) return -1;
-  rapidjson::Document jsonDoc;
-  jsonDoc.Parse(fanQuery.second.c_str());
-#ifdef DEBUG
-  writeJsonOut(jsonDoc);
-#endif
-  return jsonDoc["fanSpeed"].GetInt();
+std::unique_ptr<FanTask> CeilingFan::Send(const int speed) {
+  return std::make_unique<SetSpeed>(*this, speed);
 }
 
-void CeilingFan::Reboot() {
-  // Reboot commands don't get a response, instead they will timeout.  :/
-  curl_easy_setopt(curlInstance, CURLOPT_POSTFIELDS, "{\"reboot\": 1}");
-  doHttpRequest(curlInstance);
+std::optional<std::chrono::steady_clock::duration> CeilingFan::TimeUntilDue(
+    const Thermostat& tstat) const {
+  return policy.TimeUntilDue(tstat.GetPolicyInput(), CurrentConfig()->policy);
 }
 
-void CeilingFan::Update(const Thermostat& tstat) {
-  if (tstat.StateChanged()) {
-    fanStateUpdatedSinceLastTransition = false;
-  } else if (!fanStateUpdatedSinceLastTransition &&
-             tstat.GetTimeSinceTransition() >
-                 (tstat.isFurnaceOn() ? k_ceilingFanOnDelay : k_ceilingFanOffDelay)) {
-    fanStateUpdatedSinceLastTransition =
-        SetFanSpeed(tstat.isFurnaceOn() ? k_heatOnFanSpeed : k_heatOffFanSpeed);
+std::optional<int> CeilingFan::DecideDue(const Thermostat& tstat) {
+  // The transition itself was already handled at the poll that saw it.
+  auto input = tstat.GetPolicyInput();
+  input.stateChanged = false;
+  const auto speed = policy.Decide(input, CurrentConfig()->policy);
+  if (speed) RecordEvent(EventKind::DECISION, url.c_str(), *speed);
+  return speed;
+}
+
+// Asks the fan its state, which also opens a connection to it.  At startup the speed it reports
+// is kept for the first decision.
+class CeilingFan::Query final : public FanTask {
+  CeilingFan& fan;
+  const bool discover;
+  FanCommand query;
+  std::optional<int> reportedSpeed;
+
+ public:
+  Query(CeilingFan& fan, const bool discover)
+      : fan(fan),
+        discover(discover),
+        query(fan.curlInstance, fan.url, {{"queryDynamicShadowData", 1}}, RequestPriority::LOW) {}
+
+  void Resume(EventLoop& loop) override {
+    WORKFLOW_BEGIN;
+    query.deadline = deadline;
+    WORKFLOW_AWAIT(loop.Call(*this, query));
+    ok = query.Code() == 200;
+    if (query.state && query.state->HasMember("fanSpeed") && (*query.state)["fanSpeed"].IsInt()) {
+      reportedSpeed = (*query.state)["fanSpeed"].GetInt();
+    }
+    WORKFLOW_END;
   }
+
+  void Collected() override {
+    if (reportedSpeed) fan.knownSpeed = reportedSpeed;
+    if (discover) fan.discoveredSpeed = reportedSpeed;
+  }
+};
+
+std::unique_ptr<FanTask> CeilingFan::Warm() { return std::make_unique<Query>(*this, false); }
+std::unique_ptr<FanTask> CeilingFan::Discover() { return std::make_unique<Query>(*this, true); }
+
+int32_t CeilingFan::SaveState() const { return policy.UpdatedSinceTransition(); }
+void CeilingFan::LoadState(const int32_t state) { policy.Commanded(state != 0); }
+
+void CeilingFan::AddLoad(fancontrol::Loads& loads) const {
+  if (!knownSpeed || *knownSpeed < 0 || *knownSpeed > fancontrol::k_maxFanSpeed) return;
+  ++loads.fansAtSpeed[*knownSpeed];
+  loads.fanWatts += float(CurrentConfig()->wattages.fan[*knownSpeed]);
+}
+
+std::unique_ptr<FanTask> CeilingFan::Restore() {
+  return std::make_unique<SetSpeed>(*this, CurrentConfig()->policy.heatOffFanSpeed);
 }
 
 void CeilingFan::Debug() {
   curl_easy_setopt(curlInstance, CURLOPT_POSTFIELDS, "{\"queryDynamicShadowData\": 1}");
   auto fanQuery = doHttpRequest(curlInstance);
-  std::cout << "Fan query response for: " << GetURL(curlInstance) << " " << fanQuery.first
-            << std::endl
-            << fanQuery.second << std::endl
-            << std::endl;
+  CONSOLE_OUT("Fan query response for: " << GetURL(curlInstance) << " " << fanQuery.first << "\n"
+                                          << fanQuery.second << "\n");
 }
 
 FurnaceBlower::FurnaceBlower(CURL* curlInstance) : Fan(curlInstance) {}
 FurnaceBlower::~FurnaceBlower() {}
-void FurnaceBlower::Update(const Thermostat& tstat) {
-  const int currentBlowerState = tstat.GetBlowerState();
-  if (!tstat.isFurnaceOn() &&
-      (tstat.StateChanged() || tstat.GetTimeSinceTransition() < k_runBlowerFanAfterHeatOff)) {
-    if (!latchedState && currentBlowerState != -1) {
-      latchedState = currentBlowerState;
-      std::cout << "Latched blower state to: " << currentBlowerState << std::endl;
+std::optional<int> FurnaceBlower::Decide(const Thermostat& tstat) {
+  const bool wasLatched = policy.LatchedState().has_value();
+  const auto newState = policy.Decide(tstat.GetPolicyInput(), CurrentConfig()->policy);
+  if (!wasLatched && policy.LatchedState()) {
+    CONSOLE_OUT("Latched blower state to: " << *policy.LatchedState());
+  }
+  if (newState) RecordEvent(EventKind::DECISION, url.c_str(), *newState);
+  return newState;
+}
+
+int32_t FurnaceBlower::SaveState() const { return policy.LatchedState().value_or(-1); }
+void FurnaceBlower::LoadState(const int32_t state) {
+  policy.SetLatchedState(state >= 0 ? std::optional<int>(state) : std::nullopt);
+}
+
+// While the blower mode is latched we're running it past the heat, unless it was on anyway.
+void FurnaceBlower::AddLoad(fancontrol::Loads& loads) const {
+  loads.blowerExtended = policy.LatchedState() && *policy.LatchedState() != BLOWER_ON;
+  loads.blowerWatts = float(CurrentConfig()->wattages.blower);
+}
+
+void FurnaceBlower::Debug() { Thermostat(curlInstance, GetURL(curlInstance)).Debug(); }
+
+// The blower shares the thermostat's handle, which the poll points elsewhere, so it sets the URL.
+class FurnaceBlower::SetMode final : public FanTask {
+  FurnaceBlower& blower;
+  const int mode;
+  const std::string postData;
+  std::chrono::steady_clock::time_point startTime;
+  std::chrono::milliseconds opTime{};
+  DeviceRequest request;
+
+  // Logs how it went.
+  bool Check() {
+    using namespace std::chrono;
+    const long code = request.response.code;
+    const auto elapsed(steady_clock::now() - startTime);
+    RecordEvent(EventKind::COMMAND, blower.url.c_str(), mode, int32_t(code),
+                int32_t(duration_cast<microseconds>(elapsed).count()));
+    opTime = duration_cast<milliseconds>(elapsed);
+    CONSOLE_OUT("  Set blower fan to: " << postData.c_str() << " Return code :" << code
+                                         << " took: " << opTime.count() << "ms");
+    {
+      const PerfProfiler::Scope scope(ProfileSection::LOGGING);
+      Log(code == 200 ? LOG_INFO : LOG_ERR, "Setting blower %s to: %d, response %s (%ld ms)",
+          blower.url.c_str(), mode, request.response.body.c_str(), opTime.count());
     }
-    if (currentBlowerState != BLOWER_ON) {
-      SetBlowerState(BLOWER_ON);
+    return code == 200;
+  }
+
+ public:
+  SetMode(FurnaceBlower& blower, const int mode)
+      : blower(blower),
+        mode(mode),
+        postData("{\"fmode\": " + std::to_string(mode) + "}"),
+        request(blower.curlInstance, blower.url, RequestPriority::NORMAL, [this](CURL* curl) {
+          curl_easy_setopt(curl, CURLOPT_URL, this->blower.url.c_str());
+          curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.c_str());
+        }) {}
+
+  void Resume(EventLoop& loop) override {
+    WORKFLOW_BEGIN;
+    startTime = std::chrono::steady_clock::now();
+    request.deadline = deadline;
+    WORKFLOW_AWAIT(loop.Call(*this, request));
+    ok = Check();
+    WORKFLOW_END;
+  }
+
+  void Collected() override {
+    if (Done()) RecordCommand(blower.url, opTime, ok);
+  }
+};
+
+std::unique_ptr<FanTask> FurnaceBlower::Send(const int state) {
+  return std::make_unique<SetMode>(*this, state);
+}
+
+// Only if we took over the blower; otherwise it's already in the user's mode.
+std::unique_ptr<FanTask> FurnaceBlower::Restore() {
+  const auto latched = policy.LatchedState();
+  if (!latched) return nullptr;
+  return std::make_unique<SetMode>(*this, *latched);
+}
+
+/**
+ * Sends a task per fan as one group through the dispatcher on the I/O thread, each bounded by the
+ * group deadline, and returns without waiting.  The fans are busy until the group is collected,
+ * when each task's Collected() runs.  Commands decided from a poll pass when its response came
+ * back, for the pipeline's latency.
+ */
+void Dispatch(std::vector<std::pair<Fan*, std::unique_ptr<FanTask>>> tasks,
+              const std::optional<fancontrol::IoPipeline::Clock::time_point> decidedFrom =
+                  std::nullopt) {
+  if (tasks.empty()) return;
+  const auto config = CurrentConfig();
+  std::vector<fancontrol::StaggeredDispatcher::Command> commands;
+  std::vector<std::pair<Fan*, FanTask*>> sent;
+  for (auto& [fan, task] : tasks) {
+    fan->busy = true;
+    sent.emplace_back(fan, task.get());
+    commands.push_back(
+        {std::move(task), [task = sent.back().second](const auto deadline) {
+           task->deadline = deadline;
+         }});
+  }
+  pipeline->Submit(
+      dispatcher->Stagger(std::move(commands),
+                          {Clock::duration(config->dispatchWindow) / k_timeScale,
+                           config->dispatchConcurrency, config->dispatchDeadline}),
+      [sent]() {
+        for (const auto& [fan, task] : sent) {
+          fan->busy = false;
+          task->Collected();
+        }
+      },
+      decidedFrom);
+}
+
+/**
+ * Decides for every fan and dispatches the resulting commands together.  A fan whose last command
+ * is still out is decided for but not sent anything; its policy asks again next poll.
+ */
+void DecideAndSend(const std::vector<Fan*>& fans, const Thermostat& tstat, const bool due,
+                   const std::optional<fancontrol::IoPipeline::Clock::time_point> decidedFrom =
+                       std::nullopt) {
+  // A controller that stalled and gave up the lease mustn't fight the one that took over.
+  if (lease && lease->Abandoned()) return;
+  // Whatever came back since, so the policies decide from it.
+  pipeline->Collect();
+  std::vector<std::pair<Fan*, std::unique_ptr<FanTask>>> commands;
+  for (Fan* fan : fans) {
+    const auto value = due ? fan->DecideDue(tstat) : fan->Decide(tstat);
+    if (value && !fan->busy) commands.emplace_back(fan, fan->Send(*value));
+  }
+  Dispatch(std::move(commands), decidedFrom);
+}
+
+/**
+ * Sends the fan changes that come due before `until`, each at its due time, rather than leaving
+ * them for the next poll.  Returns once nothing else is due before then.
+ */
+void RunDueFanChanges(std::vector<std::unique_ptr<Fan>>& fans, const Thermostat& tstat,
+                      const Clock::time_point until) {
+  while (true) {
+    const auto now = Clock::now();
+    std::optional<Clock::time_point> nextDue;
+    pipeline->Collect();
+    for (const auto& fan : fans) {
+      // One with a command out is left for the next poll, when its policy knows how it went.
+      if (fan->busy) continue;
+      const auto due = fan->TimeUntilDue(tstat);
+      if (due && (!nextDue || now + *due < *nextDue)) nextDue = now + *due;
     }
-  } else if (latchedState) {
-    if (latchedState == currentBlowerState) {
-      latchedState.reset();
-    } else {
-      SetBlowerState(*latchedState);
+    if (!nextDue || *nextDue >= until) return;
+
+    std::vector<Fan*> dueFans;
+    for (auto& fan : fans) {
+      if (fan->busy) continue;
+      const auto due = fan->TimeUntilDue(tstat);
+      if (due && now + *due <= *nextDue) dueFans.push_back(fan.get());
     }
+    if (!SleepUntil(*nextDue - k_fanWarmupLead)) return;
+    if (resourceUsage) resourceUsage->Wakeup();
+    std::optional<fancontrol::ResourceUsage::Scope> scope;
+    if (resourceUsage) scope.emplace(*resourceUsage, fancontrol::Subsystem::FANS);
+    std::vector<std::pair<Fan*, std::unique_ptr<FanTask>>> warmups;
+    for (auto* fan : dueFans) {
+      if (auto warmup = fan->Warm()) warmups.emplace_back(fan, std::move(warmup));
+    }
+    Dispatch(std::move(warmups));
+    if (!SleepUntil(*nextDue)) return;
+    if (resourceUsage) resourceUsage->Wakeup();
+    // A fan whose warm-up is still out is busy, and DecideAndSend() would skip it until the next
+    // poll, so the warm-ups are collected first.  The dispatch deadline bounds them.
+    pipeline->WaitUntil(
+        [&dueFans]() {
+          return std::none_of(dueFans.begin(), dueFans.end(), [](Fan* fan) { return fan->busy; });
+        },
+        fancontrol::IoPipeline::Clock::now() + CurrentConfig()->dispatchDeadline);
+    const PerfProfiler::Scope profileScope(ProfileSection::FAN_UPDATE);
+    DecideAndSend(dueFans, tstat, true);
+  }
+}
+
+// Saves what a standby needs to carry on from this poll (see standby.h).
+void SaveSnapshot(const Thermostat& tstat, const std::vector<std::unique_ptr<Fan>>& fans) {
+  static bool failing = false;
+  fancontrol::ControllerSnapshot snapshot;
+  tstat.Save(snapshot);
+  snapshot.writer = int32_t(getpid());
+  for (const auto& fan : fans) {
+    if (snapshot.fanCount == fancontrol::ControllerSnapshot::k_maxFans) break;
+    snapshot.fanState[snapshot.fanCount++] = fan->SaveState();
   }
+  const bool saved = fancontrol::SaveSnapshot(k_snapshotPath, snapshot);
+  if (!saved && !failing) Log(LOG_ERR, "Unable to save snapshot %s", k_snapshotPath);
+  failing = !saved;
 }
 
-void FurnaceBlower::Debug() { Thermostat(curlInstance).Debug(); }
+/**
+ * Picks up where the previous controller left off, if it stopped recently.  A standby passes the
+ * last good snapshot it read while waiting, which is used if the file no longer checks out or is
+ * older.
+ */
+void ResumeFromSnapshot(Thermostat& tstat, std::vector<std::unique_ptr<Fan>>& fans,
+                        const std::optional<fancontrol::ControllerSnapshot>& lastGood) {
+  auto snapshot = fancontrol::LoadSnapshot(k_snapshotPath);
+  if (lastGood && (!snapshot || snapshot->written < lastGood->written)) {
+    if (!snapshot) {
+      Log(LOG_WARNING, "Snapshot %s doesn't check out, using the last good one", k_snapshotPath);
+    }
+    snapshot = lastGood;
+  }
+  if (!snapshot) return;
+  const int64_t age = WallClockSeconds() - snapshot->written;
+  if (age > std::chrono::seconds(k_snapshotMaxAge).count()) return;
+  tstat.Resume(*snapshot);
+  // Fan states only line up if it ran the same fans.
+  if (snapshot->fanCount == fans.size()) {
+    for (std::size_t i = 0; i < fans.size(); ++i) fans[i]->LoadState(snapshot->fanState[i]);
+  }
+  Log(LOG_INFO, "Resumed from the snapshot saved by pid %d %ld s ago", snapshot->writer,
+      long(age));
+}
 
-bool FurnaceBlower::SetBlowerState(int newState) {
+/**
+ * Waits as a standby until the lease is ours, keeping the last good snapshot in `lastGood` and
+ * warning if the active controller stops saving them while it still holds it.  Returns false if
+ * asked to shut down first.
+ */
+bool WaitForLease(fancontrol::Lease& controllerLease,
+                  std::optional<fancontrol::ControllerSnapshot>& lastGood) {
   using namespace std::chrono;
-  const auto startTime(steady_clock::now());
+  Log(LOG_INFO, "Another controller holds %s, waiting as a standby", k_leasePath);
+  const auto standbyStart(steady_clock::now());
+  bool warned = false;
+  while (!controllerLease.TryAcquire()) {
+    if (!SleepUntil(Clock::now() + k_standbyCheckInterval)) return false;
+    if (reloadRequested) {
+      reloadRequested = false;
+      ReloadConfig();
+    }
+    // A poll and a round of fan commands, each timing out, and then some.
+    const auto expected = 2 * CurrentConfig()->pollFrequency + 2 * seconds(k_httpTimeout);
+    if (const auto snapshot = fancontrol::LoadSnapshot(k_snapshotPath)) lastGood = snapshot;
+    const int64_t age = lastGood ? WallClockSeconds() - lastGood->written : -1;
+    if (age > expected.count() && !warned) {
+      Log(LOG_WARNING, "Active controller pid %d hasn't saved a snapshot in %ld s",
+          lastGood->writer, long(age));
+    }
+    warned = age > expected.count();
+  }
+  Log(LOG_INFO, "Took over as the active controller after %ld s as a standby",
+      long(duration_cast<seconds>(steady_clock::now() - standbyStart).count()));
+  return true;
+}
+
+/**
+ * The first poll: the thermostat and every fan's current state are fetched at once on the I/O
+ * thread, so the first decision is ready one round trip after startup.  A fan is busy until its
+ * answer is collected, so one that doesn't answer within k_discoveryGrace of the poll sits out the
+ * first decision rather than holding it up.  The thermostat program isn't needed for it and is
+ * fetched after.  Returns whether the thermostat poll succeeded.
+ */
+bool Boot(Thermostat& tstat, std::vector<std::unique_ptr<Fan>>& fans) {
+  for (auto& fan : fans) {
+    auto discovery = fan->Discover();
+    if (!discovery) continue;
+    fan->busy = true;
+    FanTask* const task = discovery.get();
+    pipeline->Submit(std::move(discovery), [fan = fan.get(), task]() {
+      fan->busy = false;
+      task->Collected();
+    });
+  }
+  const bool updated = tstat.Update();
+  pipeline->WaitUntil(
+      [&fans]() {
+        return std::none_of(fans.begin(), fans.end(), [](const auto& fan) { return fan->busy; });
+      },
+      fancontrol::IoPipeline::Clock::now() + k_discoveryGrace);
+  return updated;
+}
 
-  const std::string postData = "{\"fmode\": " + std::to_string(newState) + "}";
-  curl_easy_setopt(curlInstance, CURLOPT_POSTFIELDS, postData.c_str());
-  auto result = doHttpRequest(curlInstance);
-  const auto opTime(duration_cast<milliseconds>(steady_clock::now() - startTime));
-  std::cout << "  Set blower fan to: " << postData.c_str() << " Return code :" << result.first
-            << " took: " << opTime.count() << "ms" << std::endl;
-  syslog(result.first == 200 ? LOG_INFO : LOG_ERR, "Setting blower %s to: %d, response %s (%ld ms)",
-         GetURL(curlInstance).c_str(), newState, result.second.c_str(), opTime.count());
-  return (result.first == 200);
+/**
+ * Restores every device at once on the I/O thread, within the configured deadline, then flushes
+ * history and rollups, and logs what didn't get done.  Returns false if anything failed.  A restore
+ * still running at the deadline is abandoned, and the I/O thread is stopped.
+ */
+bool Shutdown(std::vector<std::unique_ptr<Fan>>& fans, fancontrol::HistoryWriter& history,
+              fancontrol::RollupRecorder& rollupRecorder) {
+  using namespace std::chrono;
+  const auto startTime(steady_clock::now());
+  const auto deadline = startTime + CurrentConfig()->shutdownDeadline;
+  Log(LOG_INFO, "Shutting down, restoring %zu devices", fans.size());
+
+  std::vector<std::unique_ptr<FanTask>> restores;
+  for (auto& fan : fans) {
+    restores.push_back(fan->Restore());
+    if (!restores.back()) continue;
+    restores.back()->deadline = deadline;
+    pipeline->Submit(*restores.back());
+  }
+  std::string problems;
+  for (std::size_t i = 0; i < restores.size(); ++i) {
+    if (!restores[i]) continue;
+    if (!pipeline->Wait(*restores[i], deadline)) {
+      problems += " " + fans[i]->Name() + " unfinished;";
+      continue;
+    }
+    restores[i]->Collected();
+    if (!restores[i]->ok) problems += " " + fans[i]->Name() + " failed;";
+  }
+  // Anything still out is abandoned with it, before the restores it holds go.
+  pipeline->Stop();
+  if (!history.Flush()) problems += " history not flushed;";
+  std::cout.flush();
+  // Restores record their commands in the rollups as they're collected, so this comes after them.
+  if (!rollupRecorder.Persist()) problems += " rollups not persisted;";
+
+  const auto shutdownTime(duration_cast<milliseconds>(steady_clock::now() - startTime));
+  if (problems.empty()) {
+    Log(LOG_INFO, "Shut down cleanly in %ld ms", long(shutdownTime.count()));
+  } else {
+    problems.pop_back();
+    Log(LOG_ERR, "Shut down in %ld ms with problems:%s", long(shutdownTime.count()),
+        problems.c_str());
+  }
+  return problems.empty();
 }
 }  // namespace
 
 int main(int argc, char* argv[]) {
-  openlog("fancontrol", 0, LOG_USER);
-  CurlObj tstatCurl("http://192.168.0.73/tstat");
-  CurlObj fan1Curl("http://192.168.0.75/mf");
-  CurlObj fan2Curl("http://192.168.0.76/mf");
-  CurlObj fan3Curl("http://192.168.0.77/mf");
+  const auto startTime(std::chrono::steady_clock::now());
+  openlog("fancontrol", k_syslogOptions, LOG_USER);
+  // Before any threads (libcurl's resolver, shutdown) start, so they inherit it.
+  const sigset_t signals = HandledSignals();
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  InstallCrashHandlers();
+  if (std::ifstream(k_configPath)) ReloadConfig();
+  // Declared before the handles so it outlives them.
+  ConnectionPool pool;
+  connectionPool = &pool;
+  fancontrol::RequestLimiter limiter(k_globalRateLimit);
+  limiter.AddDevice(HostOf(k_thermostatUrl), k_thermostatRateLimit);
+  for (const char* url : k_fanUrls) limiter.AddDevice(HostOf(url), k_fanRateLimit);
+  requestLimiter = &limiter;
+  CurlObj tstatCurl(k_thermostatUrl, &pool);
+  CurlObj programCurl(k_programUrl, &pool);
+  CurlObj fan1Curl(k_fanUrls[0], &pool);
+  CurlObj fan2Curl(k_fanUrls[1], &pool);
+  CurlObj fan3Curl(k_fanUrls[2], &pool);
 
   std::vector<std::unique_ptr<Fan>> fans;
   fans.push_back(std::make_unique<CeilingFan>(fan1Curl()));
@@ -423,34 +1773,182 @@ int main(int argc, char* argv[]) {
 
   using std::chrono::steady_clock;
 
-  Thermostat tstat(tstatCurl());
+  Thermostat tstat(tstatCurl(), GetURL(tstatCurl()));
+
+  std::optional<PerfProfiler> perfProfiler;
+  if (argc > 1 && std::string(argv[1]).rfind("-p", 0) == 0) {
+    perfProfiler.emplace();
+    profiler = &*perfProfiler;
+    Log(LOG_INFO, "Profiling with %s", perfProfiler->Source().c_str());
+  }
 
   if (argc > 1 && std::string(argv[1]).rfind("-d", 0) == 0) {
-    std::cout << "Fetching Debug data" << std::endl;
+    CONSOLE_OUT("Fetching Debug data");
     for (auto& fan : fans) {
       fan->Debug();
     }
+    pool.Log();
     return 0;
   }
 
 #ifdef DEBUG
   tstat.Update();
-  std::cout << CeilingFan(fan1Curl).GetFanSpeed() << std::endl;
 #endif
 
-  while (true) {
-    const auto loopStartTime = steady_clock::now();
+  // Only the lease holder touches the devices and the files below.
+  fancontrol::Lease controllerLease(k_leasePath);
+  std::optional<fancontrol::ControllerSnapshot> lastGoodSnapshot;
+  auto activeSince = startTime;
+  if (!controllerLease.IsOpen()) {
+    Log(LOG_ERR, "Unable to open lease %s, running without a standby", k_leasePath);
+  } else {
+    if (!controllerLease.TryAcquire()) {
+      if (!WaitForLease(controllerLease, lastGoodSnapshot)) return 0;
+      activeSince = steady_clock::now();
+    }
+    lease = &controllerLease;
+  }
+  ResumeFromSnapshot(tstat, fans, lastGoodSnapshot);
 
-    if (tstat.Update()) {
-      for (auto& fan : fans) {
-        fan->Update(tstat);
+  fancontrol::EventLog events(k_eventLogPrefix, k_eventSegmentBytes, k_eventSegments);
+  if (events.IsOpen()) {
+    eventLog = &events;
+  } else {
+    Log(LOG_ERR, "Unable to open event log %s.*.log", k_eventLogPrefix);
+  }
+  fancontrol::HistoryWriter history(k_historyPath);
+  if (!history.IsOpen()) Log(LOG_ERR, "Unable to open history file %s", k_historyPath);
+  fancontrol::RollupRecorder rollupRecorder(k_rollupPathPrefix);
+  if (!rollupRecorder.IsOpen()) Log(LOG_ERR, "Unable to open rollups %s_*", k_rollupPathPrefix);
+  rollups = &rollupRecorder;
+  fancontrol::HeatCallPredictor heatPredictor(k_heatTrendWindow, k_heatCallSwing);
+  if (const auto model = fancontrol::ThermalModel::Load(k_thermalModelPath)) {
+    heatPredictor.SetModel(*model);
+    Log(LOG_INFO, "Predicting heat calls with the house model in %s until there's a trend",
+        k_thermalModelPath);
+  }
+  fancontrol::AnomalyRules anomalyRules(
+      k_anomalyParams,
+      [](const fancontrol::Anomaly anomaly, const bool raised, const std::string& detail) {
+        const char* name = fancontrol::AnomalyName(anomaly);
+        RecordEvent(EventKind::ALERT, name, int32_t(anomaly), raised, 0, 0, 0, detail);
+        Log(raised ? LOG_WARNING : LOG_INFO, "Anomaly %s %s: %s", name,
+            raised ? "raised" : "cleared", detail.c_str());
+      });
+  anomalies = &anomalyRules;
+  ThermostatSchedule schedule(programCurl());
+  fancontrol::ResourceUsage usage;
+  resourceUsage = &usage;
+  fancontrol::StaggeredDispatcher staggeredDispatcher;
+  dispatcher = &staggeredDispatcher;
+  // From here on only the I/O thread touches the device handles.  It uses everything above, so
+  // it's declared after it and stops first.
+  fancontrol::IoPipeline ioPipeline(perfProfiler.has_value());
+  pipeline = &ioPipeline;
+  auto nextStatsTime = Clock::now() + k_statsInterval;
+
+  using fancontrol::Subsystem;
+  bool booted = false;
+  bool decided = false;
+  while (!shutdownRequested) {
+    if (lease && lease->Abandoned()) {
+      // The standby has the devices now, so they're left as they are.
+      Log(LOG_ERR, "Gave up the lease after the main loop stalled, exiting");
+      std::_Exit(1);
+    }
+    if (reloadRequested) {
+      reloadRequested = false;
+      ReloadConfig();
+    }
+    const auto loopStartTime = Clock::now();
+    const auto pollStartTime(steady_clock::now());
+
+    bool updated;
+    {
+      const auto scope = usage.Measure(Subsystem::POLL);
+      updated = booted ? tstat.Update() : Boot(tstat, fans);
+      booted = true;
+    }
+    const auto polled = ioPipeline.LastResponse();
+    const auto pollTime =
+        std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() - pollStartTime);
+    rollupRecorder.AddPoll(WallClockSeconds(), uint32_t(pollTime.count()));
+    anomalyRules.Polled(Clock::now(), tstat.FailStreak());
+    if (updated) {
+      const ThermostatState& state = *tstat.GetState();
+      const int64_t now = WallClockSeconds();
+      {
+        const auto scope = usage.Measure(Subsystem::HISTORY);
+        // Append writes out a block each time one fills, and a block that fails to write is gone.
+        if (!history.Append(
+                {now, state.temp, state.targetTemp, state.isHeatOn, uint8_t(state.blowerState)}))
+          Log(LOG_ERR, "Unable to write history to %s, a block of samples was lost", k_historyPath);
+      }
+      fancontrol::Loads loads;
+      for (const auto& fan : fans) fan->AddLoad(loads);
+      rollupRecorder.AddSample(now, state.temp, state.isHeatOn,
+                               state.isHeatOn || state.blowerState == BLOWER_ON, loads);
+      heatPredictor.Add(Clock::now(), state.temp, state.targetTemp, state.isHeatOn);
+      if (tstat.StateChanged()) anomalyRules.HeatChanged(Clock::now(), state.isHeatOn);
+
+      {
+        const auto scope = usage.Measure(Subsystem::FANS);
+        const PerfProfiler::Scope profileScope(ProfileSection::FAN_UPDATE);
+        std::vector<Fan*> all;
+        for (auto& fan : fans) all.push_back(fan.get());
+        DecideAndSend(all, tstat, false, polled);
+      }
+      {
+        const auto scope = usage.Measure(Subsystem::HISTORY);
+        SaveSnapshot(tstat, fans);
       }
-      std::cout << tstat << std::endl;
+      if (!decided) {
+        decided = true;
+        Log(LOG_INFO, "First decision %ld ms after %s",
+            long(std::chrono::duration_cast<std::chrono::milliseconds>(steady_clock::now() -
+                                                                       activeSince)
+                     .count()),
+            activeSince == startTime ? "startup" : "taking over");
+        // Timing the thermostat's endpoints takes several polls' worth of requests, so it waits
+        // until the fans are taken care of.
+        tstat.SelectPollEndpoints();
+      }
+      CONSOLE_OUT(tstat);
+    }
+    {
+      const auto scope = usage.Measure(Subsystem::ROLLUPS);
+      rollupRecorder.Persist();
+    }
+    {
+      const auto scope = usage.Measure(Subsystem::SCHEDULE);
+      schedule.Refresh();
+    }
+    usage.Tick();
+    if (Clock::now() >= nextStatsTime) {
+      {
+        // A block only fills every four hours or so; this caps what a crash loses at an hour.
+        const auto scope = usage.Measure(Subsystem::HISTORY);
+        if (!history.Flush()) Log(LOG_ERR, "Unable to write history to %s", k_historyPath);
+      }
+      LogStats(pool);
+      nextStatsTime += k_statsInterval;
     }
 
-    const auto loopExecTime = steady_clock::now() - loopStartTime;
-    std::this_thread::sleep_for(k_thermostatPollFrequencySeconds - loopExecTime);
+    const auto tickConfig = CurrentConfig();
+    auto nextPollTime = loopStartTime + tickConfig->pollFrequency;
+    const auto heatCallIn = heatPredictor.TimeUntilHeatCall(Clock::now());
+    if ((heatCallIn && *heatCallIn < 2 * tickConfig->pollFrequency) ||
+        schedule.NearScheduledChange()) {
+      nextPollTime = loopStartTime + tickConfig->fastPollFrequency;
+    }
+    RunDueFanChanges(fans, tstat, nextPollTime);
+    FeedWatchdog(nextPollTime);
+    if (SleepUntil(nextPollTime)) usage.Wakeup();
   }
 
-  return 0;
+  alarm(0);
+  const bool clean = Shutdown(fans, history, rollupRecorder);
+  // The devices are back at rest, so a standby taking over starts afresh.
+  if (clean) std::remove(k_snapshotPath);
+  return clean ? 0 : 1;
 }
@@ -0,0 +1,118 @@
+/**
+ * Fan Policy ---
+ * The decisions behind the furnace blower and ceiling fans, separated from the devices so the same
+ * logic drives the live controller and offline replays of recorded history (policy_sweep).
+ *
+ * The policies are evaluated once per thermostat poll.  They only say what should be commanded;
+ * the caller talks to the device and reports back whether the command stuck.
+ */
+#ifndef FAN_POLICY_H_
+#define FAN_POLICY_H_
+
+#include <chrono>
+#include <optional>
+
+namespace fancontrol {
+
+static const int BLOWER_ON = 2;
+// Ceiling fan speeds run from 1 to this, the most a Modern Forms fan has; 0 is off.
+static const int k_maxFanSpeed = 6;
+
+struct PolicyParams {
+  // How long after the heat turns on/off before changing the ceiling fan speed.
+  std::chrono::seconds ceilingFanOnDelay;
+  std::chrono::seconds ceilingFanOffDelay;
+  // How long to keep the blower on after the heat turns off.
+  std::chrono::seconds runBlowerFanAfterHeatOff;
+  int heatOnFanSpeed;
+  int heatOffFanSpeed;
+};
+
+// What the policies need to know about the thermostat at each poll.
+struct PolicyInput {
+  // True if the furnace turned on or off since the previous poll.
+  bool stateChanged;
+  bool furnaceOn;
+  // Unset until a transition has been seen, as at startup, which counts as long ago.
+  std::optional<std::chrono::steady_clock::duration> timeSinceTransition;
+  // 0 = AUTO, 1 = CIRCULATE, 2 = ON, or -1 if we haven't fetched thermostat data yet.
+  int blowerState;
+};
+
+/**
+ * Turns the ceiling fan up a while after the heat comes on, and back down a while after it goes
+ * off.  A failed command is retried on the next poll.
+ */
+class CeilingFanPolicy final {
+  bool fanStateUpdatedSinceLastTransition = false;
+
+ public:
+  // Returns the speed to set on this poll, if any.  Report the outcome with Commanded().
+  std::optional<int> Decide(const PolicyInput& input, const PolicyParams& params) {
+    if (input.stateChanged) {
+      fanStateUpdatedSinceLastTransition = false;
+    } else if (!fanStateUpdatedSinceLastTransition &&
+               (!input.timeSinceTransition ||
+                *input.timeSinceTransition >
+                    (input.furnaceOn ? params.ceilingFanOnDelay : params.ceilingFanOffDelay))) {
+      return input.furnaceOn ? params.heatOnFanSpeed : params.heatOffFanSpeed;
+    }
+    return std::nullopt;
+  }
+
+  void Commanded(const bool success) { fanStateUpdatedSinceLastTransition = success; }
+  // Whether the fan has been set since the last transition.  A controller taking over from another
+  // (see standby.h) passes it to Commanded().
+  bool UpdatedSinceTransition() const { return fanStateUpdatedSinceLastTransition; }
+
+  // How long until Decide() will want to change the fan, if that's still ahead of us.  Changes
+  // already due (including retries of failed ones) are left to the next poll.
+  std::optional<std::chrono::steady_clock::duration> TimeUntilDue(
+      const PolicyInput& input, const PolicyParams& params) const {
+    if (fanStateUpdatedSinceLastTransition || !input.timeSinceTransition) return std::nullopt;
+    const auto remaining =
+        (input.furnaceOn ? params.ceilingFanOnDelay : params.ceilingFanOffDelay) -
+        *input.timeSinceTransition;
+    if (remaining < std::chrono::steady_clock::duration::zero()) return std::nullopt;
+    return remaining;
+  }
+};
+
+/**
+ * Runs the blower after the heat turns off.  The blower mode the user had set is latched when we
+ * take over, and restored once the run time is up (or the heat comes back on).
+ */
+class BlowerPolicy final {
+  std::optional<int> latchedState;
+
+ public:
+  // Returns the blower mode to set on this poll, if any.
+  std::optional<int> Decide(const PolicyInput& input, const PolicyParams& params) {
+    const int currentBlowerState = input.blowerState;
+    if (!input.furnaceOn &&
+        (input.stateChanged || (input.timeSinceTransition &&
+                                *input.timeSinceTransition < params.runBlowerFanAfterHeatOff))) {
+      if (!latchedState && currentBlowerState != -1) {
+        latchedState = currentBlowerState;
+      }
+      if (currentBlowerState != BLOWER_ON) {
+        return BLOWER_ON;
+      }
+    } else if (latchedState) {
+      if (latchedState == currentBlowerState) {
+        latchedState.reset();
+      } else {
+        return *latchedState;
+      }
+    }
+    return std::nullopt;
+  }
+
+  const std::optional<int>& LatchedState() const { return latchedState; }
+  // For a controller taking over from another that latched the blower (see standby.h).
+  void SetLatchedState(const std::optional<int>& state) { latchedState = state; }
+};
+
+}  // namespace fancontrol
+
+#endif  // FAN_POLICY_H_
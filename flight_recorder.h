@@ -0,0 +1,205 @@
+/**
+ * Flight Recorder ---
+ * The last few thousand things the controller did (polls, thermostat states, fan decisions, device
+ * commands, signals, anomaly alerts) with nanosecond timestamps, kept in memory so that when
+ * something odd happens overnight there's more to go on than a few syslog lines.  Recording an
+ * event is a fetch_add and a 40 byte copy, cheap enough to leave on all the time.
+ *
+ * Any thread may record without a lock: a writer claims the next slot with a fetch_add and
+ * brackets its write with the slot's sequence number, seqlock style.  A dump skips a slot that's
+ * mid-write or gets overwritten while it's copied, so it never waits for a writer.
+ *
+ * Dump() sticks to async-signal-safe calls (open, write, clock_gettime) and formats numbers by
+ * hand, so it may run in a fatal signal handler.  Events are written oldest first, one per line,
+ * timed in seconds before the dump:
+ *
+ *   -12.345678 command http://192.168.0.75/mf 3 code 200 in 41234 us
+ */
+#ifndef FLIGHT_RECORDER_H_
+#define FLIGHT_RECORDER_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+namespace fancontrol {
+
+// What each kind keeps in an Event's arg and value fields.
+enum class EventKind : uint32_t {
+  POLL,      // device: thermostat, arg: {HTTP code, latency us}
+  STATE,     // arg: {heat on, blower mode}, value: {temperature, setpoint}
+  DECISION,  // device: fan, arg: {speed or blower mode decided}
+  COMMAND,   // device: fan, arg: {speed or blower mode sent, HTTP code, latency us}
+  SIGNAL,    // arg: {signal number}
+  ALERT,     // device: anomaly rule, arg: {rule, raised (1) or cleared (0)}
+  MESSAGE,   // arg: {syslog priority}; the text itself is only in the event log (event_log.h)
+};
+static constexpr int k_eventKinds = int(EventKind::MESSAGE) + 1;
+
+inline const char* EventKindName(const EventKind kind) {
+  static const char* const names[] = {"poll",   "state", "decision", "command",
+                                      "signal", "alert", "message"};
+  return names[int(kind)];
+}
+
+struct Event {
+  uint64_t nanos;  // CLOCK_MONOTONIC
+  // Must outlive the recorder; a device's URL held for the life of the program.
+  const char* device;
+  EventKind kind;
+  int32_t arg[3];
+  float value[2];
+};
+
+template <std::size_t N>
+class FlightRecorder final {
+  struct Slot {
+    // 2 * index + 1 while event `index` is being written, 2 * index + 2 once it's complete.
+    std::atomic<uint64_t> sequence{0};
+    Event event;
+  };
+
+  std::atomic<uint64_t> next{0};
+  Slot slots[N];
+
+  static uint64_t MonotonicNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // Builds lines in a fixed buffer and writes them out as it fills, without allocating.
+  class LineWriter final {
+    const int fd;
+    char buf[4096];
+    std::size_t length = 0;
+
+   public:
+    explicit LineWriter(const int fd) : fd(fd) {}
+    ~LineWriter() { Flush(); }
+    void Flush() {
+      for (std::size_t done = 0; done < length;) {
+        const ssize_t n = write(fd, buf + done, length - done);
+        if (n <= 0) break;
+        done += std::size_t(n);
+      }
+      length = 0;
+    }
+    LineWriter& operator<<(const char* s) {
+      if (!s) s = "-";
+      for (; *s; ++s) {
+        if (length == sizeof(buf)) Flush();
+        buf[length++] = *s;
+      }
+      return *this;
+    }
+    LineWriter& operator<<(const int64_t v) {
+      char digits[24];
+      int n = 0;
+      uint64_t magnitude = v < 0 ? 0 - uint64_t(v) : uint64_t(v);
+      do {
+        digits[n++] = char('0' + magnitude % 10);
+        magnitude /= 10;
+      } while (magnitude);
+      if (v < 0) *this << "-";
+      char text[24];
+      for (int i = 0; i < n; ++i) text[i] = digits[n - 1 - i];
+      text[n] = '\0';
+      return *this << text;
+    }
+    // `v` / `scale` with as many decimals as `scale` has zeros.
+    LineWriter& Fixed(int64_t v, const int64_t scale) {
+      if (v < 0) {
+        *this << "-";
+        v = -v;
+      }
+      *this << v / scale << ".";
+      for (int64_t place = scale / 10; place > 0; place /= 10) *this << (v / place) % 10;
+      return *this;
+    }
+  };
+
+  static void Format(LineWriter& out, const Event& e, const uint64_t dumpNanos) {
+    out.Fixed(int64_t(e.nanos / 1000) - int64_t(dumpNanos / 1000), 1000000) << " "
+                                                                           << EventKindName(e.kind);
+    switch (e.kind) {
+      case EventKind::POLL:
+        out << " " << e.device << " code " << e.arg[0] << " in " << e.arg[1] << " us";
+        break;
+      case EventKind::STATE:
+        out << " temp ";
+        out.Fixed(int64_t(e.value[0] * 100), 100) << " target ";
+        out.Fixed(int64_t(e.value[1] * 100), 100) << " heat " << e.arg[0] << " blower "
+                                                  << e.arg[1];
+        break;
+      case EventKind::DECISION:
+        out << " " << e.device << " " << e.arg[0];
+        break;
+      case EventKind::COMMAND:
+        out << " " << e.device << " " << e.arg[0] << " code " << e.arg[1] << " in " << e.arg[2]
+            << " us";
+        break;
+      case EventKind::SIGNAL:
+        out << " " << e.arg[0];
+        break;
+      case EventKind::ALERT:
+        out << " " << e.device << (e.arg[1] ? " raised" : " cleared");
+        break;
+      case EventKind::MESSAGE:
+        out << " " << e.arg[0];
+        break;
+    }
+    out << "\n";
+  }
+
+ public:
+  FlightRecorder() = default;
+  FlightRecorder(const FlightRecorder&) = delete;
+  FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+  void Record(const EventKind kind, const char* device, const int32_t arg0 = 0,
+              const int32_t arg1 = 0, const int32_t arg2 = 0, const float value0 = 0,
+              const float value1 = 0) {
+    const uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots[index % N];
+    slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.event = {MonotonicNanos(), device, kind, {arg0, arg1, arg2}, {value0, value1}};
+    slot.sequence.store(2 * index + 2, std::memory_order_release);
+  }
+
+  // Overwrites `path` with the events still in the ring, after a line giving `reason`.  Returns
+  // false if the file couldn't be created.
+  bool Dump(const char* path, const char* reason) const {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    const uint64_t dumpNanos = MonotonicNanos();
+    const uint64_t end = next.load(std::memory_order_acquire);
+    const uint64_t begin = end > N ? end - N : 0;
+    {
+      LineWriter out(fd);
+      out << "# " << reason << ": " << int64_t(end - begin) << " of " << int64_t(end)
+          << " events at " << int64_t(std::time(nullptr)) << "\n";
+      for (uint64_t index = begin; index < end; ++index) {
+        const Slot& slot = slots[index % N];
+        const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * index + 2) continue;
+        const Event event = slot.event;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence) continue;
+        Format(out, event, dumpNanos);
+      }
+    }
+    close(fd);
+    return true;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // FLIGHT_RECORDER_H_
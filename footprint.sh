@@ -0,0 +1,41 @@
+#!/bin/sh
+# Footprint Report ---
+# Builds the controller in the default and embedded profiles and reports their sizes.  Given a
+# number of seconds, also runs the embedded build that long and reports its peak RSS and CPU time,
+# scaled up to a day.
+#
+#   ./footprint.sh [seconds]
+#
+# The embedded build is static.  A distro libcurl pulls in TLS, HTTP/2, LDAP and more, none of
+# which we use, so for the target build a small HTTP-only libcurl and point CURL_LIBS at it (see
+# README).  CXX and CXXFLAGS are passed through.
+set -e
+
+CXX=${CXX:-g++}
+OUT=${OUT:-footprint_build}
+CURL_LIBS=${CURL_LIBS:-$(pkg-config --static --libs libcurl 2>/dev/null || echo -lcurl)}
+
+mkdir -p "$OUT"
+$CXX $CXXFLAGS -O2 fan_controller.cpp -o "$OUT/fan_controller" -std=c++17 -lcurl -pthread
+$CXX $CXXFLAGS -Os -DFANCONTROL_EMBEDDED -static -ffunction-sections -fdata-sections \
+  -Wl,--gc-sections -s fan_controller.cpp -o "$OUT/fan_controller_embedded" -std=c++17 $CURL_LIBS \
+  -pthread
+
+echo "Binary sizes (bytes):"
+for binary in fan_controller fan_controller_embedded; do
+  echo "  $binary: $(wc -c < "$OUT/$binary") file, $(size "$OUT/$binary" | awk 'NR == 2 {
+    print $1 " text, " $2 " data, " $3 " bss" }')"
+done
+
+[ -n "$1" ] || exit 0
+# Run from the build directory so the history and rollup files land there.
+(cd "$OUT" && exec ./fan_controller_embedded) > /dev/null 2>&1 &
+pid=$!
+sleep "$1"
+ticks=$(awk '{ print $14 + $15 }' "/proc/$pid/stat")
+peakKb=$(awk '/^VmHWM/ { print $2 }' "/proc/$pid/status")
+kill "$pid"
+echo "Embedded build over $1 s:"
+echo "  peak RSS: $peakKb kB"
+awk -v ticks="$ticks" -v hz="$(getconf CLK_TCK)" -v secs="$1" 'BEGIN {
+  printf "  CPU: %.2f s, %.1f s per day\n", ticks / hz, ticks / hz * 86400 / secs }'
@@ -0,0 +1,158 @@
+/**
+ * Heat Call Predictor ---
+ * Keeps a rolling least squares fit of temperature against time while the heat is off, and from
+ * it estimates when the temperature will drift far enough below the setpoint for the thermostat
+ * to call for heat.  The controller uses that to poll faster right before a heat call, so it
+ * notices the furnace starting within a few seconds instead of up to a full poll interval late.
+ *
+ * The thermostat reports temperature in coarse steps, so fitting the readings themselves mostly
+ * fits the staircase.  Instead each point of the fit is a moment the reading changed, where the
+ * real temperature is about halfway between the old and new readings (see thermal_model.h).
+ *
+ * Each point updates running sums, and points leaving the window are subtracted back out, so an
+ * update is O(1) no matter how long the window is.  To keep rounding from piling up over months of
+ * add/subtract, the sums are rebuilt from the window every so often (amortized O(1)).
+ *
+ * The window starts over every time the heat goes off, and needs a couple of steps of the reading
+ * before it has a trend.  Given a model fitted to the history (thermal_fit, thermal_model.h), the
+ * prediction comes from the model's cooling curve until then.
+ */
+#ifndef HEAT_PREDICTOR_H_
+#define HEAT_PREDICTOR_H_
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <optional>
+
+#include "thermal_model.h"
+
+namespace fancontrol {
+
+class HeatCallPredictor final {
+  using Clock = std::chrono::steady_clock;
+  static const std::size_t k_rebuildInterval = 1024;
+
+  struct Point {
+    double t;  // seconds relative to `origin`
+    double temp;
+  };
+
+  const Clock::duration window;
+  // How far below the setpoint the thermostat lets the temperature fall before calling for heat.
+  const double swing;
+  Clock::time_point origin;
+  std::deque<Point> points;
+  double sumT = 0, sumTT = 0, sumY = 0, sumTY = 0;
+  std::size_t updatesSinceRebuild = 0;
+  std::optional<double> lastReading;
+  double lastTarget = 0;
+  bool lastHeatOn = false;
+  Clock::time_point lastTime;
+  std::optional<ThermalModel> model;
+
+  void Clear() {
+    points.clear();
+    sumT = sumTT = sumY = sumTY = 0;
+  }
+
+  void Accumulate(const Point& p, const double sign) {
+    sumT += sign * p.t;
+    sumTT += sign * p.t * p.t;
+    sumY += sign * p.temp;
+    sumTY += sign * p.t * p.temp;
+  }
+
+  // Re-centers time on the oldest point and recomputes the sums exactly.
+  void Rebuild(const Clock::time_point newOrigin) {
+    const double shift = std::chrono::duration<double>(newOrigin - origin).count();
+    origin = newOrigin;
+    sumT = sumTT = sumY = sumTY = 0;
+    for (auto& p : points) {
+      p.t -= shift;
+      Accumulate(p, 1);
+    }
+    updatesSinceRebuild = 0;
+  }
+
+ public:
+  HeatCallPredictor(const Clock::duration window, const double swing)
+      : window(window), swing(swing) {}
+
+  // Predicts from `fitted` while the window has no trend of its own.
+  void SetModel(const ThermalModel& fitted) { model = fitted; }
+
+  void Add(const Clock::time_point now, const double temp, const double target,
+           const bool heatOn) {
+    // Only the drift with the heat off matters, so start over whenever the heat changes.
+    if (heatOn != lastHeatOn) Clear();
+    if (!heatOn && lastReading && temp != *lastReading) {
+      if (points.empty()) origin = now;
+      const Point point{std::chrono::duration<double>(lastTime - origin).count() +
+                            std::chrono::duration<double>(now - lastTime).count() / 2,
+                        (temp + *lastReading) / 2};
+      points.push_back(point);
+      Accumulate(point, 1);
+      const double oldest = point.t - std::chrono::duration<double>(window).count();
+      while (points.front().t < oldest) {
+        Accumulate(points.front(), -1);
+        points.pop_front();
+      }
+      if (++updatesSinceRebuild >= k_rebuildInterval)
+        Rebuild(origin + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double>(points.front().t)));
+    }
+    lastReading = temp;
+    lastTarget = target;
+    lastHeatOn = heatOn;
+    lastTime = now;
+  }
+
+  // Degrees per hour, or nullopt until the window has enough spread to say.
+  std::optional<double> SlopePerHour() const {
+    const double n = double(points.size());
+    if (n < 2) return std::nullopt;
+    const double denominator = n * sumTT - sumT * sumT;
+    if (denominator <= 0) return std::nullopt;
+    return (n * sumTY - sumT * sumY) / denominator * 3600;
+  }
+
+  /**
+   * Time from `now` until the thermostat is expected to call for heat, or nullopt if the heat is
+   * already on, the temperature isn't falling, or it's already past where we think the call
+   * happens (so our idea of the swing is off and there's nothing useful to predict).
+   */
+  std::optional<Clock::duration> TimeUntilHeatCall(const Clock::time_point now) const {
+    if (lastHeatOn || !lastReading) return std::nullopt;
+    const auto slope = SlopePerHour();
+    if (!slope) return ModelTimeUntilHeatCall(now);
+    if (*slope >= 0) return std::nullopt;
+    // Go from the fitted line rather than the last (coarse) reading, so the estimate keeps moving
+    // between steps of the thermostat's display.
+    const double n = double(points.size());
+    const double t = std::chrono::duration<double>(now - origin).count();
+    const double fittedTemp = sumY / n + *slope / 3600 * (t - sumT / n);
+    const double degreesToGo = fittedTemp - (lastTarget - swing);
+    if (degreesToGo < 0) return std::nullopt;
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(degreesToGo / -*slope * 3600));
+  }
+
+ private:
+  // TimeUntilHeatCall() from the model's cooling curve, starting at the last reading.
+  std::optional<Clock::duration> ModelTimeUntilHeatCall(const Clock::time_point now) const {
+    const double threshold = lastTarget - swing;
+    if (!model || *lastReading < threshold) return std::nullopt;
+    const auto seconds = model->SecondsUntilFallsTo(*lastReading, threshold);
+    if (!seconds) return std::nullopt;
+    const auto remaining =
+        std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(*seconds)) -
+        (now - lastTime);
+    if (remaining < Clock::duration::zero()) return std::nullopt;
+    return remaining;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // HEAT_PREDICTOR_H_
@@ -0,0 +1,404 @@
+/**
+ * Compressed thermostat history ---
+ * The controller samples the thermostat every poll (15 s), which is ~2 million samples a year.
+ * Stored raw that's tens of megabytes and slow to scan, so samples are packed into blocks:
+ *
+ *   - timestamps (seconds) as delta-of-delta, which is almost always zero at a fixed poll rate
+ *   - temperature and setpoint as deltas in hundredths of a degree
+ *   - heat and blower mode bit-packed into one nibble per sample
+ *
+ * Each numeric column is a stream of zigzag varints where a zero is followed by a run length, so
+ * the long flat stretches typical of a house cost a couple of bytes per run.  Every block starts
+ * with a fixed header holding its time span, which is all the reader needs to build a sparse
+ * index and jump straight to the blocks covering a requested time range.
+ *
+ * Blocks are appended to the file as they fill, and the controller flushes the one in progress
+ * every hour, so a crash loses at most an hour of samples.  A partial block at the end of the file
+ * (from a crash mid-write) is dropped on the next open.  The reader checks each block's column
+ * offsets against its payload, and never decodes past the end of a column, so a corrupt block is
+ * skipped rather than read out of bounds.
+ */
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace fancontrol {
+
+struct HistorySample {
+  int64_t time;  // seconds since the epoch
+  float temp;
+  float targetTemp;
+  bool isHeatOn;
+  uint8_t blowerState;  // 0 = AUTO, 1 = CIRCULATE, 2 = ON
+};
+
+namespace history_detail {
+
+static const uint32_t k_blockMagic = 0x31425648;  // "HVB1"
+// ~4 hours of samples at our poll rate, small enough that a range scan rarely decodes much extra.
+static const uint32_t k_samplesPerBlock = 1024;
+
+struct BlockHeader {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t payloadBytes;
+  uint32_t tempOffset;    // payload offsets of each column; the time column starts at 0
+  uint32_t targetOffset;
+  uint32_t flagsOffset;
+  int64_t firstTime;
+  int64_t lastTime;
+};
+static_assert(sizeof(BlockHeader) == 40, "BlockHeader is written to disk as-is");
+
+inline uint64_t ZigZag(int64_t v) { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+inline int64_t UnZigZag(uint64_t v) { return int64_t(v >> 1) ^ -int64_t(v & 1); }
+
+inline void PutVarint(std::vector<uint8_t>& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(uint8_t(v) | 0x80);
+    v >>= 7;
+  }
+  out.push_back(uint8_t(v));
+}
+
+// Reads a varint that must end before `end`.  Returns false, with `p` wherever it got to, if not.
+inline bool GetVarint(const uint8_t*& p, const uint8_t* const end, uint64_t& v) {
+  // Nearly every value we store fits in one byte, so keep that path short.
+  if (p < end && *p < 0x80) {
+    v = *p++;
+    return true;
+  }
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    const uint8_t b = *p++;
+    v |= uint64_t(b & 0x7f) << shift;
+    if (b < 0x80) return true;
+  }
+  return false;
+}
+
+// Writes `values` as zigzag varints, replacing each run of zeros by a 0 followed by the run length.
+inline void EncodeColumn(const std::vector<int64_t>& values, std::vector<uint8_t>& out) {
+  for (std::size_t i = 0; i < values.size();) {
+    if (values[i] != 0) {
+      PutVarint(out, ZigZag(values[i++]));
+      continue;
+    }
+    std::size_t run = 1;
+    while (i + run < values.size() && values[i + run] == 0) ++run;
+    PutVarint(out, 0);
+    PutVarint(out, run - 1);
+    i += run;
+  }
+}
+
+// Decodes a column of `n` deltas from [p, end), integrating them once (order 1) or twice (order 2)
+// starting from `initial`, and storing each result through `store(index, value)`.  Returns false
+// if the column runs past `end`, having stored only some of the values.
+template <int order, typename Store>
+inline bool DecodeColumn(const uint8_t* p, const uint8_t* const end, const std::size_t n,
+                         int64_t initial, Store store) {
+  int64_t value = initial;
+  int64_t delta = 0;
+  for (std::size_t i = 0; i < n;) {
+    // Nearly every token is a one-byte delta or a zero followed by a one-byte run length, so take
+    // those in a tight loop and leave longer varints (and the column's last byte) to the general
+    // path below.
+    while (i < n && end - p > 1) {
+      const uint8_t b = p[0];
+      if (uint8_t(b - 1) < 0x7f) {
+        if (order == 2) {
+          delta += UnZigZag(b);
+          value += delta;
+        } else {
+          value += UnZigZag(b);
+        }
+        store(i++, value);
+        ++p;
+      } else if (b == 0 && p[1] < 0x80) {
+        const std::size_t last = i + 1 + std::min<std::size_t>(p[1], n - i - 1);
+        if (order == 2) {
+          for (; i < last; ++i) store(i, value += delta);
+        } else {
+          for (; i < last; ++i) store(i, value);
+        }
+        p += 2;
+      } else {
+        break;
+      }
+    }
+    if (i == n) break;
+    uint64_t token;
+    if (!GetVarint(p, end, token)) return false;
+    if (token != 0) {
+      if (order == 2) {
+        delta += UnZigZag(token);
+        value += delta;
+      } else {
+        value += UnZigZag(token);
+      }
+      store(i++, value);
+      continue;
+    }
+    uint64_t run;
+    if (!GetVarint(p, end, run)) return false;
+    const std::size_t last = i + 1 + std::size_t(std::min<uint64_t>(run, n - i - 1));
+    if (order == 2) {
+      for (; i < last; ++i) store(i, value += delta);
+    } else {
+      for (; i < last; ++i) store(i, value);
+    }
+  }
+  return true;
+}
+
+// Whether the columns `header` describes lie in order inside its payload.
+inline bool ValidBlockHeader(const BlockHeader& header) {
+  return header.magic == k_blockMagic && header.count != 0 &&
+         header.tempOffset <= header.targetOffset && header.targetOffset <= header.flagsOffset &&
+         header.flagsOffset <= header.payloadBytes &&
+         header.payloadBytes - header.flagsOffset >= (uint64_t(header.count) + 1) / 2 &&
+         header.firstTime <= header.lastTime;
+}
+
+inline int64_t ToCentidegrees(const float temp) { return std::lround(double(temp) * 100.0); }
+
+}  // namespace history_detail
+
+// Serializes one block (header followed by payload) for the given samples.
+inline std::vector<uint8_t> EncodeHistoryBlock(const std::vector<HistorySample>& samples) {
+  using namespace history_detail;
+  if (samples.empty()) return {};
+  std::vector<uint8_t> out(sizeof(BlockHeader));
+  BlockHeader header{};
+  header.magic = k_blockMagic;
+  header.count = uint32_t(samples.size());
+  header.firstTime = samples.front().time;
+  header.lastTime = samples.back().time;
+
+  std::vector<int64_t> column;
+  column.reserve(samples.size());
+  int64_t prevDelta = 0;
+  for (std::size_t i = 1; i < samples.size(); ++i) {
+    const int64_t delta = samples[i].time - samples[i - 1].time;
+    column.push_back(delta - prevDelta);
+    prevDelta = delta;
+  }
+  EncodeColumn(column, out);
+
+  auto encodeTemps = [&](auto field) {
+    column.clear();
+    int64_t prev = 0;
+    for (const auto& s : samples) {
+      const int64_t v = ToCentidegrees(field(s));
+      column.push_back(v - prev);
+      prev = v;
+    }
+    EncodeColumn(column, out);
+  };
+  header.tempOffset = uint32_t(out.size() - sizeof(BlockHeader));
+  encodeTemps([](const HistorySample& s) { return s.temp; });
+  header.targetOffset = uint32_t(out.size() - sizeof(BlockHeader));
+  encodeTemps([](const HistorySample& s) { return s.targetTemp; });
+
+  header.flagsOffset = uint32_t(out.size() - sizeof(BlockHeader));
+  for (std::size_t i = 0; i < samples.size(); i += 2) {
+    uint8_t packed = (samples[i].isHeatOn ? 1 : 0) | (samples[i].blowerState & 3) << 1;
+    if (i + 1 < samples.size())
+      packed |= ((samples[i + 1].isHeatOn ? 1 : 0) | (samples[i + 1].blowerState & 3) << 1) << 4;
+    out.push_back(packed);
+  }
+
+  header.payloadBytes = uint32_t(out.size() - sizeof(BlockHeader));
+  std::memcpy(out.data(), &header, sizeof(header));
+  return out;
+}
+
+/**
+ * Decodes a whole block into `out`, which must have room for `header.count` samples.  `header` must
+ * have passed ValidBlockHeader() and `payload` hold its `payloadBytes`.  Returns false if a column
+ * is corrupt, leaving `out` partly written.
+ */
+inline bool DecodeHistoryBlock(const history_detail::BlockHeader& header, const uint8_t* payload,
+                               HistorySample* out) {
+  using namespace history_detail;
+  const std::size_t n = header.count;
+  out[0].time = header.firstTime;
+  const bool decoded =
+      DecodeColumn<2>(payload, payload + header.tempOffset, n - 1, header.firstTime,
+                      [out](std::size_t i, int64_t v) { out[i + 1].time = v; }) &&
+      DecodeColumn<1>(payload + header.tempOffset, payload + header.targetOffset, n, 0,
+                      [out](std::size_t i, int64_t v) { out[i].temp = float(v) * 0.01f; }) &&
+      DecodeColumn<1>(payload + header.targetOffset, payload + header.flagsOffset, n, 0,
+                      [out](std::size_t i, int64_t v) { out[i].targetTemp = float(v) * 0.01f; });
+  if (!decoded) return false;
+  const uint8_t* flags = payload + header.flagsOffset;
+  for (std::size_t i = 0; i < n; ++i) {
+    const uint8_t nibble = flags[i >> 1] >> ((i & 1) * 4);
+    out[i].isHeatOn = nibble & 1;
+    out[i].blowerState = (nibble >> 1) & 3;
+  }
+  return true;
+}
+
+/**
+ * Appends samples to a history file, writing a block each time one fills.  Flush() writes out a
+ * partial block, which is fine to do at any time (e.g. on shutdown); the reader handles blocks of
+ * any size.
+ */
+class HistoryWriter final {
+  std::string path;
+  FILE* file;
+  std::vector<HistorySample> pending;
+  int64_t lastTime;
+
+ public:
+  explicit HistoryWriter(const std::string& path) : path(path), file(nullptr), lastTime(INT64_MIN) {
+    using namespace history_detail;
+    // Drop anything after the last complete block so new blocks are reachable by the reader.
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return;
+    struct stat st;
+    off_t validEnd = 0;
+    if (fstat(fd, &st) == 0) {
+      BlockHeader header;
+      while (pread(fd, &header, sizeof(header), validEnd) == sizeof(header) &&
+             ValidBlockHeader(header) &&
+             validEnd + off_t(sizeof(header) + header.payloadBytes) <= st.st_size) {
+        validEnd += sizeof(header) + header.payloadBytes;
+        lastTime = header.lastTime;
+      }
+      if (validEnd != st.st_size && ftruncate(fd, validEnd) != 0) validEnd = st.st_size;
+    }
+    ::close(fd);
+    file = std::fopen(path.c_str(), "ab");
+    pending.reserve(k_samplesPerBlock);
+  }
+  ~HistoryWriter() {
+    Flush();
+    if (file) std::fclose(file);
+  }
+  HistoryWriter(const HistoryWriter&) = delete;
+  HistoryWriter& operator=(const HistoryWriter&) = delete;
+
+  bool IsOpen() const { return file != nullptr; }
+
+  // Returns false if a full block could not be written.
+  bool Append(HistorySample sample) {
+    // Blocks must stay in time order for the reader's index, so ride out a wall clock step back.
+    sample.time = std::max(sample.time, lastTime);
+    lastTime = sample.time;
+    pending.push_back(sample);
+    return pending.size() < history_detail::k_samplesPerBlock || Flush();
+  }
+
+  bool Flush() {
+    if (!file || pending.empty()) return true;
+    const std::vector<uint8_t> block = EncodeHistoryBlock(pending);
+    pending.clear();
+    return std::fwrite(block.data(), 1, block.size(), file) == block.size() &&
+           std::fflush(file) == 0;
+  }
+};
+
+/**
+ * Read-only view of a history file.  The file is mapped and only block headers are touched on
+ * open; payloads are decoded on demand by Scan().
+ */
+class HistoryReader final {
+  struct BlockIndex {
+    int64_t firstTime;
+    int64_t lastTime;
+    history_detail::BlockHeader header;  // copied out, as blocks aren't aligned in the file
+    const uint8_t* payload;
+  };
+
+  const uint8_t* data;
+  std::size_t size;
+  std::vector<BlockIndex> index;
+  std::size_t sampleCount;
+
+ public:
+  explicit HistoryReader(const std::string& path) : data(nullptr), size(0), sampleCount(0) {
+    using namespace history_detail;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped != MAP_FAILED) {
+        data = static_cast<const uint8_t*>(mapped);
+        size = st.st_size;
+      }
+    }
+    ::close(fd);
+
+    for (std::size_t offset = 0; offset + sizeof(BlockHeader) <= size;) {
+      BlockHeader header;
+      std::memcpy(&header, data + offset, sizeof(header));
+      if (!ValidBlockHeader(header) || header.payloadBytes > size - offset - sizeof(BlockHeader))
+        break;
+      index.push_back({header.firstTime, header.lastTime, header, data + offset + sizeof(header)});
+      sampleCount += header.count;
+      offset += sizeof(BlockHeader) + header.payloadBytes;
+    }
+  }
+  ~HistoryReader() {
+    if (data) munmap(const_cast<uint8_t*>(data), size);
+  }
+  HistoryReader(const HistoryReader&) = delete;
+  HistoryReader& operator=(const HistoryReader&) = delete;
+
+  bool IsOpen() const { return data != nullptr; }
+  std::size_t BlockCount() const { return index.size(); }
+  std::size_t SampleCount() const { return sampleCount; }
+  std::size_t FileBytes() const { return size; }
+  int64_t FirstTime() const { return index.empty() ? 0 : index.front().firstTime; }
+  int64_t LastTime() const { return index.empty() ? 0 : index.back().lastTime; }
+
+  /**
+   * Calls `fn(const HistorySample* samples, std::size_t count)` with consecutive runs of samples
+   * whose time is in [from, to], in time order.  The pointer is only valid during the call.
+   */
+  template <typename Fn>
+  void Scan(const int64_t from, const int64_t to, Fn fn) const {
+    auto it = std::lower_bound(index.begin(), index.end(), from,
+                               [](const BlockIndex& b, int64_t t) { return b.lastTime < t; });
+    std::vector<HistorySample> decoded(history_detail::k_samplesPerBlock);
+    for (; it != index.end() && it->firstTime <= to; ++it) {
+      const auto& header = it->header;
+      if (decoded.size() < header.count) decoded.resize(header.count);
+      if (!DecodeHistoryBlock(header, it->payload, decoded.data())) continue;
+      const HistorySample* begin = decoded.data();
+      const HistorySample* end = begin + header.count;
+      if (it->firstTime < from)
+        begin = std::lower_bound(begin, end, from,
+                                 [](const HistorySample& s, int64_t t) { return s.time < t; });
+      if (it->lastTime > to)
+        end = std::upper_bound(begin, end, to,
+                               [](int64_t t, const HistorySample& s) { return t < s.time; });
+      if (begin != end) fn(begin, std::size_t(end - begin));
+    }
+  }
+
+  template <typename Fn>
+  void ScanAll(Fn fn) const {
+    Scan(INT64_MIN, INT64_MAX, fn);
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // HISTORY_H_
@@ -0,0 +1,355 @@
+/**
+ * History Tool ---
+ * Offline companion to fan_controller for looking at the thermostat history it records.
+ *
+ *   history_tool <file> info                 block/sample counts, time span and bytes per sample
+ *   history_tool <file> dump [from] [to]     samples as CSV, times in seconds since the epoch
+ *   history_tool <file> bench [from] [to]    decode the range repeatedly and report the rate
+ *
+ *   history_tool <prefix> rollups minute|hour|day [from] [to]
+ *                                            saved rollups as CSV, <prefix> as in fan_controller
+ *
+ *   history_tool <prefix> events query [filters]
+ *                                            logged events in order, one per line
+ *   history_tool <prefix> events tail [--lines n] [--follow] [filters]
+ *                                            the last n (10) events, then new ones as they come
+ *     filters: --kind poll|state|decision|command|signal|alert|message, --device <part of name>,
+ *              --from <time>, --to <time>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_log.h"
+#include "history.h"
+#include "rollups.h"
+
+namespace {
+
+int64_t ArgTime(int argc, char* argv[], int index, int64_t fallback) {
+  return argc > index ? std::strtoll(argv[index], nullptr, 10) : fallback;
+}
+
+void Info(const fancontrol::HistoryReader& reader) {
+  std::cout << "Blocks: " << reader.BlockCount() << std::endl
+            << "Samples: " << reader.SampleCount() << std::endl
+            << "From: " << reader.FirstTime() << " To: " << reader.LastTime() << std::endl
+            << "Bytes: " << reader.FileBytes() << " ("
+            << (reader.SampleCount() ? double(reader.FileBytes()) / reader.SampleCount() : 0)
+            << " per sample)" << std::endl;
+}
+
+void Dump(const fancontrol::HistoryReader& reader, int64_t from, int64_t to) {
+  std::cout << "time,temp,target,heat,blower\n";
+  reader.Scan(from, to, [](const fancontrol::HistorySample* samples, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+      const auto& s = samples[i];
+      std::cout << s.time << ',' << s.temp << ',' << s.targetTemp << ',' << s.isHeatOn << ','
+                << int(s.blowerState) << '\n';
+    }
+  });
+}
+
+void Bench(const fancontrol::HistoryReader& reader, int64_t from, int64_t to) {
+  using namespace std::chrono;
+  std::size_t samples = 0;
+  double checksum = 0;
+  const auto startTime(steady_clock::now());
+  auto elapsed = steady_clock::duration::zero();
+  int passes = 0;
+  // Keep going for a second or so to get a stable rate on small files.
+  while (elapsed < seconds(1)) {
+    reader.Scan(from, to, [&](const fancontrol::HistorySample* s, std::size_t count) {
+      samples += count;
+      checksum += s[count - 1].temp;
+    });
+    ++passes;
+    elapsed = steady_clock::now() - startTime;
+  }
+  const double secs = duration<double>(elapsed).count();
+  std::cout << "Decoded " << samples << " samples in " << passes << " passes, " << secs << "s: "
+            << (samples / secs / 1e6) << "M samples/s (checksum " << checksum << ")" << std::endl;
+}
+
+int Rollups(const std::string& prefix, int argc, char* argv[]) {
+  using fancontrol::RollupLevel;
+  const std::string levelName(argc > 3 ? argv[3] : "");
+  RollupLevel level;
+  if (levelName == "minute") {
+    level = RollupLevel::MINUTE;
+  } else if (levelName == "hour") {
+    level = RollupLevel::HOUR;
+  } else if (levelName == "day") {
+    level = RollupLevel::DAY;
+  } else {
+    std::cerr << "Rollup level must be minute, hour or day" << std::endl;
+    return 1;
+  }
+  const int64_t to = ArgTime(argc, argv, 5, std::time(nullptr));
+  const int64_t from = ArgTime(argc, argv, 4, 0);
+
+  std::cout << "start,samples,min_temp,avg_temp,max_temp,heat_on_s,blower_on_s,commands,failed,"
+               "poll_p50_ms,poll_p99_ms,command_p50_ms,command_p99_ms,extended_blower_s,";
+  for (int speed = 1; speed <= fancontrol::k_maxFanSpeed; ++speed) {
+    std::cout << "fan_speed" << speed << "_s,";
+  }
+  std::cout << "blower_wh,extended_blower_wh,fan_wh,kwh\n";
+  for (const auto& r : fancontrol::ReadRollups(prefix, level, from, to)) {
+    std::cout << r.start << ',' << r.samples << ',';
+    if (r.samples) {
+      std::cout << r.minTemp << ',' << r.AvgTemp() << ',' << r.maxTemp << ',';
+    } else {
+      std::cout << ",,,";
+    }
+    std::cout << r.heatOnSeconds << ',' << r.blowerOnSeconds << ',' << r.commands << ','
+              << r.failedCommands << ',' << r.pollLatency.Percentile(50) << ','
+              << r.pollLatency.Percentile(99) << ',' << r.commandLatency.Percentile(50) << ','
+              << r.commandLatency.Percentile(99) << ',' << r.extendedBlowerSeconds << ',';
+    for (int speed = 1; speed <= fancontrol::k_maxFanSpeed; ++speed) {
+      std::cout << r.fanSpeedSeconds[speed] << ',';
+    }
+    std::cout << r.blowerWh << ',' << r.extendedBlowerWh << ',' << r.fanWh << ',' << r.KWh()
+              << '\n';
+  }
+  return 0;
+}
+
+struct EventFilter {
+  int kind = -1;
+  std::string device;
+  // Nanoseconds since the epoch.
+  int64_t from = INT64_MIN;
+  int64_t to = INT64_MAX;
+
+  bool Matches(const fancontrol::LoggedEvent& event) const {
+    return (kind < 0 || int(event.kind) == kind) && event.time >= from && event.time <= to &&
+           (device.empty() || event.device.find(device) != std::string_view::npos);
+  }
+};
+
+// Appends `event` to `out` as a line.
+void FormatEvent(const fancontrol::LoggedEvent& event, std::string& out) {
+  using fancontrol::EventKind;
+  char line[256];
+  int length = std::snprintf(
+      line, sizeof(line), "%lld.%06lld #%llu %s", (long long)(event.time / 1000000000),
+      (long long)(event.time % 1000000000 / 1000), (unsigned long long)event.sequence,
+      EventKindName(event.kind));
+  out.append(line, std::size_t(std::min<int>(length, sizeof(line) - 1)));
+  if (!event.device.empty()) (out += ' ').append(event.device);
+  switch (event.kind) {
+    case EventKind::POLL:
+      length = std::snprintf(line, sizeof(line), " code %d in %d us", event.arg[0], event.arg[1]);
+      break;
+    case EventKind::STATE:
+      length = std::snprintf(line, sizeof(line), " temp %.2f target %.2f heat %d blower %d",
+                             event.value[0], event.value[1], event.arg[0], event.arg[1]);
+      break;
+    case EventKind::DECISION:
+      length = std::snprintf(line, sizeof(line), " %d", event.arg[0]);
+      break;
+    case EventKind::COMMAND:
+      length = std::snprintf(line, sizeof(line), " %d code %d in %d us", event.arg[0],
+                             event.arg[1], event.arg[2]);
+      break;
+    case EventKind::SIGNAL:
+      length = std::snprintf(line, sizeof(line), " %d", event.arg[0]);
+      break;
+    case EventKind::ALERT:
+      length = std::snprintf(line, sizeof(line), " %s: ", event.arg[1] ? "raised" : "cleared");
+      break;
+    case EventKind::MESSAGE:
+      length = std::snprintf(line, sizeof(line), " %d ", event.arg[0]);
+      break;
+  }
+  out.append(line, std::size_t(std::min<int>(length, sizeof(line) - 1)));
+  out.append(event.text);
+  out += '\n';
+}
+
+void Write(std::string& out) {
+  std::fwrite(out.data(), 1, out.size(), stdout);
+  out.clear();
+}
+
+/**
+ * Prints the events matching `filter`, oldest first.  A segment is skipped without reading its
+ * records if the next one was started before `filter.from`, and the scan stops at the first
+ * started after `filter.to`.
+ */
+void QueryEvents(const std::string& prefix, const EventFilter& filter) {
+  const auto segments = fancontrol::EventLogSegments(prefix);
+  std::string out;
+  for (std::size_t i = 0; i < segments.size(); ++i) {
+    if (i + 1 < segments.size()) {
+      const fancontrol::EventSegmentReader next(
+          fancontrol::event_log_detail::SegmentPath(prefix, segments[i + 1]));
+      if (next.IsOpen() && next.Started() < filter.from) continue;
+    }
+    const fancontrol::EventSegmentReader reader(
+        fancontrol::event_log_detail::SegmentPath(prefix, segments[i]));
+    if (!reader.IsOpen()) continue;
+    if (reader.Started() > filter.to) break;
+    reader.Scan(reader.Begin(), [&](const fancontrol::LoggedEvent& event) {
+      if (!filter.Matches(event)) return;
+      FormatEvent(event, out);
+      if (out.size() >= 1 << 16) Write(out);
+    });
+  }
+  Write(out);
+}
+
+// Prints the last `lines` events matching `filter`, then with `follow` waits for more.
+void TailEvents(const std::string& prefix, const EventFilter& filter, const std::size_t lines,
+                const bool follow) {
+  using fancontrol::EventSegmentReader;
+  using fancontrol::event_log_detail::SegmentPath;
+  auto segments = fancontrol::EventLogSegments(prefix);
+  // Newest segments first, until there are enough.
+  std::vector<std::string> found;
+  for (auto it = segments.rbegin(); it != segments.rend() && found.size() < lines; ++it) {
+    const EventSegmentReader reader(SegmentPath(prefix, *it));
+    std::vector<std::string> inSegment;
+    reader.Scan(reader.Begin(), [&](const fancontrol::LoggedEvent& event) {
+      if (!filter.Matches(event)) return;
+      inSegment.emplace_back();
+      FormatEvent(event, inSegment.back());
+    });
+    found.insert(found.begin(), inSegment.begin(), inSegment.end());
+  }
+  std::string out;
+  for (std::size_t i = found.size() > lines ? found.size() - lines : 0; i < found.size(); ++i) {
+    out += found[i];
+  }
+  Write(out);
+  if (!follow) return;
+
+  // Carries on from the end of the newest segment, and into each one started after it.
+  const auto print = [&](const fancontrol::LoggedEvent& event) {
+    if (filter.Matches(event)) FormatEvent(event, out);
+  };
+  std::optional<uint64_t> current;
+  std::unique_ptr<EventSegmentReader> reader;
+  std::size_t offset = 0;
+  if (!segments.empty()) {
+    current = segments.back();
+    reader = std::make_unique<EventSegmentReader>(SegmentPath(prefix, *current));
+    offset = reader->Scan(reader->Begin(), [](const fancontrol::LoggedEvent&) {});
+  }
+  while (true) {
+    if (reader) offset = reader->Scan(offset, print);
+    Write(out);
+    std::fflush(stdout);
+    const auto now = fancontrol::EventLogSegments(prefix);
+    const auto next = current ? std::upper_bound(now.begin(), now.end(), *current) : now.begin();
+    if (next != now.end()) {
+      // Wait until the writer has its header in.
+      auto opened = std::make_unique<EventSegmentReader>(SegmentPath(prefix, *next));
+      if (opened->IsOpen()) {
+        // Nothing more is written to a segment once the next has started.
+        if (reader) reader->Scan(offset, print);
+        reader = std::move(opened);
+        current = *next;
+        offset = reader->Begin();
+        continue;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  }
+}
+
+int Events(const std::string& prefix, int argc, char* argv[]) {
+  const std::string command(argc > 3 ? argv[3] : "");
+  EventFilter filter;
+  std::size_t lines = 10;
+  bool follow = false;
+  for (int i = 4; i < argc; ++i) {
+    const std::string option(argv[i]);
+    const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (option == "--follow" || option == "-f") {
+      follow = true;
+      continue;
+    }
+    if (!value) {
+      std::cerr << "Missing value for " << option << std::endl;
+      return 1;
+    }
+    ++i;
+    if (option == "--kind") {
+      for (int kind = 0; kind < fancontrol::k_eventKinds; ++kind) {
+        if (EventKindName(fancontrol::EventKind(kind)) == std::string(value)) filter.kind = kind;
+      }
+      if (filter.kind < 0) {
+        std::cerr << "Unknown event kind: " << value << std::endl;
+        return 1;
+      }
+    } else if (option == "--device") {
+      filter.device = value;
+    } else if (option == "--from") {
+      filter.from = std::strtoll(value, nullptr, 10) * 1000000000;
+    } else if (option == "--to") {
+      // Through the end of that second.
+      filter.to = std::strtoll(value, nullptr, 10) * 1000000000 + 999999999;
+    } else if (option == "--lines" || option == "-n") {
+      lines = std::size_t(std::strtoul(value, nullptr, 10));
+    } else {
+      std::cerr << "Unknown option: " << option << std::endl;
+      return 1;
+    }
+  }
+  if (command == "query") {
+    QueryEvents(prefix, filter);
+  } else if (command == "tail") {
+    TailEvents(prefix, filter, lines, follow);
+  } else {
+    std::cerr << "Events command must be query or tail" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <history file> info|dump|bench [from] [to]" << std::endl
+              << "       " << argv[0] << " <rollup prefix> rollups minute|hour|day [from] [to]"
+              << std::endl
+              << "       " << argv[0] << " <event log prefix> events query|tail [options]"
+              << std::endl;
+    return 1;
+  }
+  if (std::string(argv[2]) == "rollups") return Rollups(argv[1], argc, argv);
+  if (std::string(argv[2]) == "events") return Events(argv[1], argc, argv);
+
+  fancontrol::HistoryReader reader(argv[1]);
+  if (!reader.IsOpen()) {
+    std::cerr << "Unable to open history file: " << argv[1] << std::endl;
+    return 1;
+  }
+
+  const std::string command(argv[2]);
+  const int64_t from = ArgTime(argc, argv, 3, INT64_MIN);
+  const int64_t to = ArgTime(argc, argv, 4, INT64_MAX);
+  if (command == "info") {
+    Info(reader);
+  } else if (command == "dump") {
+    Dump(reader, from, to);
+  } else if (command == "bench") {
+    Bench(reader, from, to);
+  } else {
+    std::cerr << "Unknown command: " << command << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,203 @@
+/**
+ * Mock Devices ---
+ * Stands in for the Radio Thermostat and the Modern Forms fans on local ports, one per device so
+ * each is rate limited separately, for soak runs of the controller (soak.sh) and trying changes
+ * without touching the house.  Every port serves every device.
+ *
+ *   mock_devices <speedup> <port>...
+ *
+ * The house is the RC model of thermal_model.h with known coefficients (see k_house), run on a
+ * clock `speedup` times faster than real time (match FANCONTROL_SOAK).  The thermostat calls for
+ * heat when the temperature falls half a degree below the setpoint and stops half a degree above,
+ * and the blower warms the house a little when the controller runs it after the heat, so the
+ * cycles respond to the controller and thermal_fit has something real to recover.  It serves
+ * /tstat and the per-field /tstat/{temp,ttemp,tstate,fmode} endpoints, /tstat/program/heat, and
+ * takes {"fmode": n} posted to /tstat.  Every fan is /mf: posting {"fanSpeed": n} sets the speed
+ * and any post is answered with the fan's state.
+ *
+ * Connections are kept alive, as the real devices do, from a single poll() loop.
+ */
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// What thermal_fit should find on a soak's history.  Degrees/hour, 1/hour and degrees, in the
+// order of ThermalModel's fields.  Heat cycles come out at around 40 minutes.
+static constexpr struct {
+  double heatGain, blowerGain, lossRate, ambient;
+} k_house{6.0, 1.5, 0.25, 55.0};
+static constexpr double k_setpoint = 69.0;
+static constexpr double k_swing = 0.5;
+// The house is stepped this often, in simulated seconds, so the thermostat sees each threshold
+// about when it's crossed.
+static constexpr double k_stepSeconds = 5;
+
+struct Devices {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  long speedup = 1;
+  int fmode = 0;
+  int fanSpeed = 1;
+  double simulated = 0;  // seconds the house has been run for
+  double temp = k_setpoint;
+  bool heatOn = false;
+
+  // Runs the house up to now.  Called before answering each request.
+  void Advance() {
+    const double now =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * speedup;
+    for (; simulated + k_stepSeconds <= now; simulated += k_stepSeconds) {
+      if (temp <= k_setpoint - k_swing) heatOn = true;
+      if (temp >= k_setpoint + k_swing) heatOn = false;
+      const double rate = (heatOn ? k_house.heatGain : 0) +
+                          (fmode == 2 && !heatOn ? k_house.blowerGain : 0) +
+                          k_house.lossRate * k_house.ambient;
+      // Held constant over the step, the temperature settles exponentially toward rate / loss.
+      const double settle = rate / k_house.lossRate;
+      temp = settle + (temp - settle) * std::exp(-k_house.lossRate * k_stepSeconds / 3600);
+    }
+  }
+  bool HeatOn() const { return heatOn; }
+  double Temp() const { return temp; }
+};
+
+// The integer after "key": in `body`, if there is one.
+bool JsonInt(const std::string& body, const char* key, int& value) {
+  const std::string quoted = std::string("\"") + key + "\"";
+  const auto at = body.find(quoted);
+  if (at == std::string::npos) return false;
+  const auto colon = body.find(':', at + quoted.size());
+  if (colon == std::string::npos) return false;
+  value = std::atoi(body.c_str() + colon + 1);
+  return true;
+}
+
+// Returns the status and JSON body for one request.
+std::pair<int, std::string> Handle(Devices& devices, const std::string& method,
+                                   const std::string& path, const std::string& body) {
+  char json[256];
+  devices.Advance();
+  const int heat = devices.HeatOn() ? 1 : 0;
+  if (method == "GET" && path == "/tstat") {
+    std::snprintf(json, sizeof(json),
+                  "{\"temp\":%.2f,\"tmode\":1,\"fmode\":%d,\"tstate\":%d,\"t_heat\":%.2f}",
+                  devices.Temp(), devices.fmode, heat, k_setpoint);
+  } else if (method == "GET" && path == "/tstat/temp") {
+    std::snprintf(json, sizeof(json), "{\"temp\":%.2f}", devices.Temp());
+  } else if (method == "GET" && path == "/tstat/ttemp") {
+    std::snprintf(json, sizeof(json), "{\"t_heat\":%.2f}", k_setpoint);
+  } else if (method == "GET" && path == "/tstat/tstate") {
+    std::snprintf(json, sizeof(json), "{\"tstate\":%d}", heat);
+  } else if (method == "GET" && path == "/tstat/fmode") {
+    std::snprintf(json, sizeof(json), "{\"fmode\":%d}", devices.fmode);
+  } else if (method == "GET" && path == "/tstat/program/heat") {
+    std::string program = "{";
+    for (int day = 0; day < 7; ++day) {
+      program += (day ? ",\"" : "\"") + std::to_string(day) + "\":[360,70,480,66,1080,70,1320,62]";
+    }
+    return {200, program + "}"};
+  } else if (method == "POST" && path == "/tstat") {
+    JsonInt(body, "fmode", devices.fmode);
+    std::snprintf(json, sizeof(json), "{\"success\":0}");
+  } else if (method == "POST" && path == "/mf") {
+    JsonInt(body, "fanSpeed", devices.fanSpeed);
+    std::snprintf(json, sizeof(json), "{\"fanOn\":true,\"fanSpeed\":%d}", devices.fanSpeed);
+  } else {
+    return {404, "{}"};
+  }
+  return {200, json};
+}
+
+// Answers every complete request in `buffer`, leaving any partial one.  False if the client
+// should be dropped.
+bool Serve(Devices& devices, const int fd, std::string& buffer) {
+  while (true) {
+    const auto headerEnd = buffer.find("\r\n\r\n");
+    if (headerEnd == std::string::npos) return buffer.size() < 65536;
+    std::size_t length = 0;
+    const auto lengthAt = buffer.find("Content-Length:");
+    if (lengthAt != std::string::npos && lengthAt < headerEnd) {
+      length = std::strtoul(buffer.c_str() + lengthAt + 15, nullptr, 10);
+    }
+    if (buffer.size() < headerEnd + 4 + length) return true;
+    const auto methodEnd = buffer.find(' ');
+    const auto pathEnd = buffer.find(' ', methodEnd + 1);
+    if (methodEnd == std::string::npos || pathEnd == std::string::npos) return false;
+    const auto reply = Handle(devices, buffer.substr(0, methodEnd),
+                              buffer.substr(methodEnd + 1, pathEnd - methodEnd - 1),
+                              buffer.substr(headerEnd + 4, length));
+    buffer.erase(0, headerEnd + 4 + length);
+    const std::string response =
+        "HTTP/1.1 " + std::to_string(reply.first) + (reply.first == 200 ? " OK" : " Not Found") +
+        "\r\nContent-Type: application/json\r\nContent-Length: " +
+        std::to_string(reply.second.size()) + "\r\n\r\n" + reply.second;
+    if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) != ssize_t(response.size()))
+      return false;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <speedup> <port>..." << std::endl;
+    return 1;
+  }
+  Devices devices;
+  devices.speedup = std::max(1L, std::strtol(argv[1], nullptr, 10));
+
+  // The listeners come first in `fds`, then the clients, each with a buffer in `buffers`.
+  std::vector<pollfd> fds;
+  for (int arg = 2; arg < argc; ++arg) {
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    const int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(uint16_t(std::atoi(argv[arg])));
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, 16) != 0) {
+      std::cerr << "Unable to listen on port " << argv[arg] << std::endl;
+      return 1;
+    }
+    fds.push_back({listener, POLLIN, 0});
+  }
+  const std::size_t listeners = fds.size();
+  std::vector<std::string> buffers(listeners);
+  while (poll(fds.data(), fds.size(), -1) >= 0) {
+    for (std::size_t i = 0; i < listeners; ++i) {
+      if (!(fds[i].revents & POLLIN)) continue;
+      const int client = accept(fds[i].fd, nullptr, nullptr);
+      if (client >= 0) {
+        fds.push_back({client, POLLIN, 0});
+        buffers.emplace_back();
+      }
+    }
+    for (std::size_t i = fds.size() - 1; i >= listeners; --i) {
+      if (!fds[i].revents) continue;
+      char chunk[4096];
+      const ssize_t n = recv(fds[i].fd, chunk, sizeof(chunk), 0);
+      if (n > 0) buffers[i].append(chunk, std::size_t(n));
+      if (n <= 0 || !Serve(devices, fds[i].fd, buffers[i])) {
+        close(fds[i].fd);
+        fds.erase(fds.begin() + i);
+        buffers.erase(buffers.begin() + i);
+      }
+    }
+  }
+  return 1;
+}
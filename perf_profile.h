@@ -0,0 +1,229 @@
+/**
+ * Perf Profile ---
+ * Optional self-profiling (fan_controller -p) of the sections that make up most of a poll: parsing
+ * thermostat state, HTTP requests, the fans' Update pass and logging.  Each section accumulates
+ * task-clock, context switches and, where the CPU exposes a PMU, cycles and instructions, read
+ * from perf_event_open counters on our own thread.
+ *
+ * Counters are tried from most to least capable: hardware and software events, then software
+ * events only (VMs often have no PMU), then task-clock excluding kernel time (perf_event_paranoid
+ * 2).  The thread CPU clock and getrusage() stand in for whatever couldn't be opened, so the
+ * summaries are always there, just coarser.
+ *
+ * Sections nest (a fan Update includes its logging) and are reported inclusive.  The counters are
+ * opened on the thread that creates the profiler, and a Scope goes to the profiler of the thread
+ * it's on, if there is one.  So the decision thread and the I/O thread (see pipeline.h) each have
+ * their own: the requests, and the logging done as their answers come in, are profiled on the
+ * latter, where an HTTP requests "call" is one pass of its event loop.
+ */
+#ifndef PERF_PROFILE_H_
+#define PERF_PROFILE_H_
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fancontrol {
+
+enum class ProfileSection { PARSE_STATE, HTTP_REQUEST, FAN_UPDATE, LOGGING, COUNT };
+
+inline const char* ProfileSectionName(const ProfileSection s) {
+  static const char* const names[] = {"ParseState", "HTTP requests", "fan Update", "logging"};
+  return names[int(s)];
+}
+
+class PerfProfiler final {
+ public:
+  enum Counter { TASK_CLOCK, CONTEXT_SWITCHES, CYCLES, INSTRUCTIONS, COUNTERS };
+  struct Sample {
+    uint64_t values[COUNTERS] = {};
+  };
+
+ private:
+  struct Section {
+    uint64_t calls = 0;
+    Sample total;
+  };
+
+  int groupFd = -1;
+  std::vector<int> fds;
+  // Which counter each value in a group read belongs to, in order.
+  std::vector<Counter> groupCounters;
+  bool have[COUNTERS] = {};
+  bool excludeKernel = false;
+  // Added to on the profiled thread, reported from any.
+  mutable std::mutex lock;
+  Section sections[int(ProfileSection::COUNT)];
+
+  static PerfProfiler*& ForThisThread() {
+    thread_local PerfProfiler* profiler = nullptr;
+    return profiler;
+  }
+
+  static int Open(const uint32_t type, const uint64_t config, const int groupFd,
+                  const bool excludeKernel) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = excludeKernel;
+    attr.exclude_hv = 1;
+    return int(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC));
+  }
+
+  void Close() {
+    for (const int fd : fds) close(fd);
+    fds.clear();
+    groupCounters.clear();
+    std::fill(std::begin(have), std::end(have), false);
+    groupFd = -1;
+  }
+
+  // Opens task-clock as the group leader, then whichever other counters the kernel allows.
+  bool OpenGroup(const bool withHardware, const bool kernel) {
+    Close();
+    excludeKernel = !kernel;
+    groupFd = Open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1, excludeKernel);
+    if (groupFd < 0) return false;
+    fds.push_back(groupFd);
+    groupCounters.push_back(TASK_CLOCK);
+    have[TASK_CLOCK] = true;
+    struct {
+      uint32_t type;
+      uint64_t config;
+      Counter counter;
+    } const members[] = {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, CONTEXT_SWITCHES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, INSTRUCTIONS},
+    };
+    for (const auto& m : members) {
+      if (m.type == PERF_TYPE_HARDWARE && !withHardware) continue;
+      // Switches happen in the kernel, so they'd all be excluded; getrusage() has them.
+      if (m.counter == CONTEXT_SWITCHES && excludeKernel) continue;
+      const int fd = Open(m.type, m.config, groupFd, excludeKernel);
+      if (fd < 0) {
+        if (m.type == PERF_TYPE_HARDWARE) return false;
+        continue;
+      }
+      fds.push_back(fd);
+      groupCounters.push_back(m.counter);
+      have[m.counter] = true;
+    }
+    return true;
+  }
+
+ public:
+  // Profiles the calling thread from now on.
+  PerfProfiler() {
+    ForThisThread() = this;
+    if (OpenGroup(true, true) || OpenGroup(false, true) || OpenGroup(false, false)) return;
+    Close();
+  }
+  ~PerfProfiler() {
+    if (ForThisThread() == this) ForThisThread() = nullptr;
+    Close();
+  }
+  PerfProfiler(const PerfProfiler&) = delete;
+  PerfProfiler& operator=(const PerfProfiler&) = delete;
+
+  // What the counters are, for the summary.
+  std::string Source() const {
+    if (groupFd < 0) return "thread CPU clock and getrusage (perf_event_open not permitted)";
+    std::string source = "perf_event_open";
+    if (excludeKernel) source += ", user time only";
+    if (!have[CYCLES]) source += ", no PMU";
+    return source;
+  }
+
+  Sample Read() const {
+    Sample sample;
+    uint64_t buf[1 + COUNTERS];
+    const bool counted = groupFd >= 0 && read(groupFd, buf, sizeof(buf)) > 0;
+    if (counted) {
+      for (uint64_t i = 0; i < buf[0] && i < groupCounters.size(); ++i)
+        sample.values[groupCounters[i]] = buf[1 + i];
+    }
+    if (!counted || !have[TASK_CLOCK]) {
+      timespec ts;
+      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+      sample.values[TASK_CLOCK] = uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+    if (!counted || !have[CONTEXT_SWITCHES]) {
+      rusage r;
+      getrusage(RUSAGE_THREAD, &r);
+      sample.values[CONTEXT_SWITCHES] = uint64_t(r.ru_nvcsw + r.ru_nivcsw);
+    }
+    return sample;
+  }
+
+  void Add(const ProfileSection s, const Sample& start, const Sample& end) {
+    const std::lock_guard<std::mutex> guard(lock);
+    Section& section = sections[int(s)];
+    ++section.calls;
+    for (int c = 0; c < COUNTERS; ++c) section.total.values[c] += end.values[c] - start.values[c];
+  }
+
+  // Profiles one section; does nothing on a thread that isn't being profiled.
+  class Scope final {
+    PerfProfiler* const profiler;
+    const ProfileSection section;
+    const Sample start;
+
+   public:
+    explicit Scope(const ProfileSection section)
+        : profiler(ForThisThread()),
+          section(section),
+          start(this->profiler ? this->profiler->Read() : Sample()) {}
+    ~Scope() {
+      if (profiler) profiler->Add(section, start, profiler->Read());
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+  };
+
+  // One line per section that ran: calls, then per call averages.
+  std::vector<std::string> Report() const {
+    const std::lock_guard<std::mutex> guard(lock);
+    const bool haveHardware = have[CYCLES] && have[INSTRUCTIONS];
+    std::vector<std::string> lines;
+    char line[256];
+    for (int s = 0; s < int(ProfileSection::COUNT); ++s) {
+      const Section& section = sections[s];
+      if (!section.calls) continue;
+      const double calls = double(section.calls);
+      const uint64_t* v = section.total.values;
+      int length = std::snprintf(
+          line, sizeof(line), "%s: %lu calls, %.1f us task-clock, %.2f context switches",
+          ProfileSectionName(ProfileSection(s)), (unsigned long)section.calls,
+          v[TASK_CLOCK] / calls / 1e3, v[CONTEXT_SWITCHES] / calls);
+      if (haveHardware) {
+        length += std::snprintf(line + length, sizeof(line) - length,
+                                ", %.0f cycles, %.0f instructions (IPC %.2f)", v[CYCLES] / calls,
+                                v[INSTRUCTIONS] / calls,
+                                v[CYCLES] ? double(v[INSTRUCTIONS]) / v[CYCLES] : 0.0);
+      }
+      std::snprintf(line + length, sizeof(line) - length, " per call");
+      lines.push_back(line);
+    }
+    return lines;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // PERF_PROFILE_H_
@@ -0,0 +1,297 @@
+/**
+ * I/O Pipeline ---
+ * Splits the controller into two stages so that waiting on the network never holds up decisions.
+ * An I/O thread owns every device connection: it runs the device workflows (see workflow.h) on its
+ * event loop, and once it has started nothing else touches a libcurl handle.  The decision thread
+ * (main()) runs the thermostat and fan logic.  It submits workflows, like a poll or a group of fan
+ * commands, through one ring and collects them back, finished and with their responses parsed,
+ * through the other.  A fan that doesn't answer ties up only its own requests.
+ *
+ * Each ring has one producer and one consumer (see spsc_ring.h).  The I/O thread is woken for new
+ * work with curl_multi_wakeup(), so it sleeps in the same poll as its requests.  The decision
+ * thread is woken through an eventfd when it's waiting for something in particular, and otherwise
+ * collects whatever came back the next time it looks.  A workflow belongs to the I/O thread from
+ * Submit() until it's collected, and the decision thread mustn't look at it in between.
+ *
+ * The I/O thread keeps its own CPU time and context switches, as the resource usage figures
+ * measured on the decision thread only see it waiting (see resource_usage.h).  When profiling, it
+ * also has a profiler of its own, and each pass of its loop is profiled as HTTP requests (see
+ * perf_profile.h).
+ *
+ * For a command decided from a response (a fan change decided from a thermostat poll), the time
+ * from the I/O thread finishing the response to it starting the command is measured.  That covers
+ * both hops across the rings and the decision between them, and the percentiles over recent
+ * commands go in the hourly report.
+ */
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "perf_profile.h"
+#include "resource_usage.h"
+#include "spsc_ring.h"
+#include "workflow.h"
+
+namespace fancontrol {
+
+class IoPipeline final {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+ private:
+  // Far more than are ever in flight: a poll, a dispatch group and a few discoveries.
+  static constexpr std::size_t k_ringSize = 64;
+  // Latencies of this many of the most recent commands make up the distribution.
+  static constexpr std::size_t k_latencySamples = 1024;
+
+  struct Message {
+    Workflow* workflow;
+    // Set by the I/O thread.
+    Clock::time_point started;
+    Clock::time_point finished;
+  };
+  struct Pending {
+    std::function<void()> done;
+    // Set if the pipeline owns the workflow.
+    std::unique_ptr<Workflow> owned;
+    std::optional<Clock::time_point> decidedFrom;
+  };
+
+  EventLoop loop;
+  SpscRing<Message, k_ringSize> submitted;
+  SpscRing<Message, k_ringSize> finished;
+  const int doorbell;
+  std::atomic<bool> stopping{false};
+  const bool profile;
+  // Made on the I/O thread, so it profiles that thread, and published with `profiling`.
+  std::optional<PerfProfiler> profiler;
+  std::atomic<bool> profiling{false};
+
+  // I/O thread only.  Workflows it's running, and finished ones the ring had no room for yet.
+  std::map<Workflow*, Message> running;
+  std::deque<Message> unsent;
+  // Written by the I/O thread after each pass of its loop, read by IoUsage().
+  std::atomic<uint64_t> ioCpuNanos{0};
+  std::atomic<uint64_t> ioContextSwitches{0};
+
+  // Decision thread only.
+  std::map<const Workflow*, Pending> pending;
+  const Workflow* awaited = nullptr;
+  Clock::time_point lastResponse;
+  uint64_t collected = 0;
+  uint64_t commands = 0;
+  uint64_t stalls = 0;
+  std::vector<uint32_t> latencyMicros;
+  std::size_t nextLatency = 0;
+
+  // Declared last so everything it uses is there first.
+  std::thread io;
+
+  void Serve() {
+    if (profile) {
+      profiler.emplace();
+      profiling.store(true, std::memory_order_release);
+    }
+    loop.OnFinish([this](Workflow& workflow) {
+      const auto found = running.find(&workflow);
+      Message message = found->second;
+      running.erase(found);
+      message.finished = Clock::now();
+      unsent.push_back(message);
+    });
+    while (!stopping.load(std::memory_order_acquire)) {
+      const PerfProfiler::Scope scope(ProfileSection::HTTP_REQUEST);
+      Message message;
+      while (submitted.Pop(message)) {
+        message.started = Clock::now();
+        running[message.workflow] = message;
+        loop.Start(*message.workflow);
+      }
+      loop.RunReady();
+      const bool any = !unsent.empty();
+      while (!unsent.empty() && finished.Push(unsent.front())) unsent.pop_front();
+      if (any) Ring();
+      ioCpuNanos.store(ResourceUsage::ThreadCpuNanos(), std::memory_order_relaxed);
+      ioContextSwitches.store(ResourceUsage::ThreadContextSwitches(), std::memory_order_relaxed);
+      // With some left over, try again shortly rather than waiting for a request.
+      loop.Poll(unsent.empty() ? Clock::time_point::max()
+                               : Clock::now() + std::chrono::milliseconds(1));
+    }
+  }
+
+  void Ring() {
+    const uint64_t one = 1;
+    // Only fails if the count would overflow, when it's set anyway.
+    [[maybe_unused]] const ssize_t written = write(doorbell, &one, sizeof(one));
+  }
+
+  void RecordLatency(const Clock::duration latency) {
+    ++commands;
+    const auto micros = uint32_t(std::min<int64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(latency).count(), UINT32_MAX));
+    if (latencyMicros.size() < k_latencySamples) {
+      latencyMicros.push_back(micros);
+    } else {
+      latencyMicros[nextLatency] = micros;
+      nextLatency = (nextLatency + 1) % k_latencySamples;
+    }
+  }
+
+  void Enqueue(Workflow& workflow, Pending entry) {
+    pending[&workflow] = std::move(entry);
+    while (!submitted.Push({&workflow, {}, {}})) {
+      ++stalls;
+      std::this_thread::yield();
+    }
+    loop.Wakeup();
+  }
+
+ public:
+  // With `profile`, the I/O thread profiles itself (see perf_profile.h).
+  explicit IoPipeline(const bool profile = false)
+      : doorbell(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        profile(profile),
+        io([this]() { Serve(); }) {
+    // Only Collect() on the caller's thread records latencies, so this can't race the I/O thread.
+    latencyMicros.reserve(k_latencySamples);
+  }
+  ~IoPipeline() {
+    Stop();
+    if (doorbell >= 0) close(doorbell);
+  }
+  IoPipeline(const IoPipeline&) = delete;
+  IoPipeline& operator=(const IoPipeline&) = delete;
+
+  /**
+   * Stops the I/O thread.  Workflows it hasn't finished are left where they are, with their
+   * requests abandoned when the pipeline goes, so the ones the pipeline doesn't own must outlive
+   * it.  Nothing may be submitted after.
+   */
+  void Stop() {
+    if (!io.joinable()) return;
+    stopping.store(true, std::memory_order_release);
+    loop.Wakeup();
+    io.join();
+  }
+
+  /**
+   * Hands `workflow` to the I/O thread, which starts it straight away.  `done` runs on this thread
+   * once it's collected.  A command decided from a response gives the time that response finished
+   * (LastResponse()) as `decidedFrom`, for the latency.
+   */
+  void Submit(Workflow& workflow, std::function<void()> done = nullptr,
+              const std::optional<Clock::time_point> decidedFrom = std::nullopt) {
+    Enqueue(workflow, {std::move(done), nullptr, decidedFrom});
+  }
+  // As above, for a workflow the pipeline keeps until it's collected.
+  void Submit(std::unique_ptr<Workflow> workflow, std::function<void()> done = nullptr,
+              const std::optional<Clock::time_point> decidedFrom = std::nullopt) {
+    Workflow& submittedWorkflow = *workflow;
+    Enqueue(submittedWorkflow, {std::move(done), std::move(workflow), decidedFrom});
+  }
+
+  // Takes back whatever the I/O thread has finished, running each one's `done`, without waiting.
+  void Collect() {
+    Message message;
+    while (finished.Pop(message)) {
+      const auto found = pending.find(message.workflow);
+      if (found == pending.end()) continue;
+      Pending entry = std::move(found->second);
+      pending.erase(found);
+      ++collected;
+      if (entry.decidedFrom) RecordLatency(message.started - *entry.decidedFrom);
+      if (message.workflow == awaited) lastResponse = message.finished;
+      if (entry.done) entry.done();
+    }
+  }
+
+  // Collects until `condition()` holds or `deadline` has passed.  Returns true for the former.
+  bool WaitUntil(const std::function<bool()>& condition, const Clock::time_point deadline) {
+    while (true) {
+      Collect();
+      if (condition()) return true;
+      const auto now = Clock::now();
+      if (now >= deadline) return false;
+      const auto timeout = std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+      pollfd ring{doorbell, POLLIN, 0};
+      if (poll(&ring, 1, int(std::min<int64_t>(timeout, INT_MAX))) > 0) {
+        // Resets it.  The ring is checked again either way.
+        uint64_t rings;
+        [[maybe_unused]] const ssize_t got = read(doorbell, &rings, sizeof(rings));
+      }
+    }
+  }
+
+  // Collects until `workflow` is back or `deadline` has passed.  Returns true for the former.
+  bool Wait(const Workflow& workflow, const Clock::time_point deadline) {
+    awaited = &workflow;
+    const bool back = WaitUntil([&]() { return !pending.count(&workflow); }, deadline);
+    awaited = nullptr;
+    return back;
+  }
+
+  // Submits `workflow` and waits for it, for callers that want the outcome now.
+  void Run(Workflow& workflow) {
+    Submit(workflow);
+    Wait(workflow, Clock::time_point::max());
+  }
+
+  struct Usage {
+    uint64_t workflows;
+    uint64_t cpuNanos;
+    uint64_t contextSwitches;
+  };
+  // The workflows collected so far, and the I/O thread's CPU time and context switches running
+  // them, as of its last pass.
+  Usage IoUsage() const {
+    return {collected, ioCpuNanos.load(std::memory_order_relaxed),
+            ioContextSwitches.load(std::memory_order_relaxed)};
+  }
+
+  // The I/O thread's profile, if it's profiling itself.
+  std::vector<std::string> ProfileReport() const {
+    if (!profiling.load(std::memory_order_acquire)) return {};
+    return profiler->Report();
+  }
+
+  // When the I/O thread finished the last workflow Wait() got back, like the poll just made.
+  Clock::time_point LastResponse() const { return lastResponse; }
+
+  std::string Report() const {
+    std::vector<uint32_t> sorted(latencyMicros);
+    std::sort(sorted.begin(), sorted.end());
+    const auto percentile = [&sorted](const double p) {
+      return sorted.empty() ? 0u : sorted[std::size_t(p * (sorted.size() - 1))];
+    };
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "Pipeline: %lu workflows, %lu commands, response to command p50 %u us, p90 %u "
+                  "us, max %u us, %lu stalls on a full ring",
+                  (unsigned long)collected, (unsigned long)commands, percentile(0.5),
+                  percentile(0.9), percentile(1), (unsigned long)stalls);
+    return line;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // PIPELINE_H_
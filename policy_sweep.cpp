@@ -0,0 +1,347 @@
+/**
+ * Policy Sweep ---
+ * Replays recorded thermostat history through the fan policies (fan_policy.h) for many parameter
+ * combinations, to tune the delays and fan speeds without trial-and-error recompiles.
+ *
+ *   policy_sweep <history file> [--random N] [--threads N] [--fans N] [--model F] [--swing S]
+ *
+ * By default a grid around the current settings is searched; --random evaluates N random points
+ * in the same ranges instead.  Each combination is scored on:
+ *
+ *   - blower hours: time the blower runs, for heat or because we turned it on
+ *   - fan speed hours: time each ceiling fan runs above the base speed, times how far above
+ *   - commands: blower and ceiling fan commands sent (each fan counts separately)
+ *   - unmixed degree hours: |temp - target| integrated over time the blower is off
+ *   - unstirred degree hours: |temp - target| integrated over time, less the share the ceiling fans
+ *     stir by their speed (none at the base speed, fully three steps above it)
+ *
+ * The recorded temps don't respond to the replayed policy, so the last two are proxies for how
+ * well the warm air gets moved around, through the ducts and within the room, not a prediction of
+ * the temperature.  The blower and ceiling fans are scored apart so that each fan parameter moves
+ * a score of its own: a heat cycle has the blower on throughout, whatever the ceiling fans do.
+ *
+ * With --model (from thermal_fit) the house is simulated instead: the temperature follows the
+ * model, the thermostat calls for heat when it falls `swing` below the recorded setpoint and stops
+ * `swing` above it, and the unmixed degree hours become the RMS distance of the simulated
+ * temperature from the setpoint.  Only the setpoints and times are taken from the recording then.
+ *
+ * The replay follows the controller's timing where the recording allows: a transition is taken
+ * to have happened halfway between the samples that bracket it, and a ceiling fan change that
+ * falls due between samples is made at its due time rather than at the next sample.  It doesn't
+ * model the fast polling around a predicted heat call, failed commands or the dispatch window, so
+ * the scores are for comparing candidates rather than predicting the live controller's figures.
+ *
+ * All five are to be minimized, and they trade off against each other, so the output is the
+ * Pareto front: every combination no other combination beats on all five.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fan_policy.h"
+#include "history.h"
+#include "thermal_model.h"
+
+namespace {
+
+using fancontrol::HistorySample;
+using fancontrol::PolicyParams;
+using std::chrono::seconds;
+
+// Gaps longer than this mean the controller wasn't running; don't score them.
+static const int64_t k_maxSampleGap = 5 * 60;
+// The slowest ceiling fan speed; the fans don't help mixing at this speed.
+static const int k_baseFanSpeed = 1;
+
+struct Score {
+  double blowerHours;
+  double fanSpeedHours;
+  uint64_t commands;
+  double instability;  // unmixed degree hours, or RMS degrees from the setpoint when simulating
+  double unstirred;    // unstirred degree hours
+
+  bool Dominates(const Score& other) const {
+    return blowerHours <= other.blowerHours && fanSpeedHours <= other.fanSpeedHours &&
+           commands <= other.commands && instability <= other.instability &&
+           unstirred <= other.unstirred &&
+           (blowerHours < other.blowerHours || fanSpeedHours < other.fanSpeedHours ||
+            commands < other.commands || instability < other.instability ||
+            unstirred < other.unstirred);
+  }
+};
+
+struct Result {
+  PolicyParams params;
+  Score score;
+};
+
+// Closed loop stand-in for the house and thermostat, see --model.
+struct Simulation {
+  fancontrol::ThermalModel model;
+  double swing;
+};
+
+// How much of the room's air the ceiling fans stir at `speed`, from 0 to 1.
+double CeilingFanMixing(const int speed) {
+  return std::min(1.0, std::max(0, speed - k_baseFanSpeed) / 3.0);
+}
+
+// Plays the samples through the policies as main() does at each poll, and between polls as
+// RunDueFanChanges() does (see the file comment for what isn't modeled).
+Score Replay(const std::vector<HistorySample>& samples, const PolicyParams& params,
+             const int fanCount, const Simulation* simulation) {
+  Score score{0, 0, 0, 0, 0};
+  if (samples.empty()) return score;
+
+  fancontrol::CeilingFanPolicy fanPolicy;
+  fancontrol::BlowerPolicy blowerPolicy;
+  // Like Thermostat, unset until the first transition.
+  std::optional<int64_t> lastTransition;
+  int blowerMode = samples.front().blowerState;
+  int fanSpeed = params.heatOffFanSpeed;
+  double blowerSeconds = 0;
+  double fanSpeedSeconds = 0;
+  double unmixedDegreeSeconds = 0;
+  double unstirredDegreeSeconds = 0;
+  double squaredErrorSeconds = 0;
+  double scoredSeconds = 0;
+  double simTemp = samples.front().temp;
+  bool heatOn = samples.front().isHeatOn;
+
+  for (std::size_t i = 0; i < samples.size(); ++i) {
+    HistorySample s = samples[i];
+    bool stateChanged;
+    if (simulation) {
+      const bool wasHeatOn = heatOn;
+      if (simTemp <= s.targetTemp - simulation->swing) heatOn = true;
+      if (simTemp >= s.targetTemp + simulation->swing) heatOn = false;
+      stateChanged = i > 0 && heatOn != wasHeatOn;
+      s.temp = float(simTemp);
+      s.isHeatOn = heatOn;
+    } else {
+      stateChanged = i > 0 && s.isHeatOn != samples[i - 1].isHeatOn;
+    }
+    // The furnace changed somewhere since the last sample; like Thermostat, take halfway.
+    if (stateChanged) lastTransition = s.time - (s.time - samples[i - 1].time) / 2;
+    fancontrol::PolicyInput input{stateChanged, s.isHeatOn, std::nullopt, blowerMode};
+    if (lastTransition) input.timeSinceTransition = seconds(s.time - *lastTransition);
+
+    if (const auto speed = fanPolicy.Decide(input, params)) {
+      fanSpeed = *speed;
+      fanPolicy.Commanded(true);
+      score.commands += fanCount;
+    }
+    if (const auto mode = blowerPolicy.Decide(input, params)) {
+      blowerMode = *mode;
+      ++score.commands;
+    }
+
+    if (i + 1 == samples.size()) break;
+    const int64_t dt = samples[i + 1].time - s.time;
+    const bool blowerOn = s.isHeatOn || blowerMode == fancontrol::BLOWER_ON;
+    if (simulation) {
+      simTemp = simulation->model.Step(simTemp, s.isHeatOn, blowerOn,
+                                       double(std::max<int64_t>(dt, 0)));
+    }
+    if (dt <= 0 || dt > k_maxSampleGap) continue;
+
+    // A fan change falling due before the next sample goes out on time, splitting the interval.
+    int64_t changeAt = dt;
+    int changedSpeed = fanSpeed;
+    if (const auto due = fanPolicy.TimeUntilDue(input, params)) {
+      const auto dueSeconds = std::chrono::ceil<seconds>(*due).count();
+      fancontrol::PolicyInput atDue = input;
+      atDue.stateChanged = false;
+      // Decide() wants strictly past the delay, as it is by the time the controller wakes for it.
+      // There's only something due once a transition has been seen.
+      *atDue.timeSinceTransition += *due + std::chrono::nanoseconds(1);
+      if (dueSeconds < dt) {
+        if (const auto speed = fanPolicy.Decide(atDue, params)) {
+          changeAt = dueSeconds;
+          changedSpeed = *speed;
+          fanPolicy.Commanded(true);
+          score.commands += fanCount;
+        }
+      }
+    }
+
+    const double offBy = std::fabs(s.temp - s.targetTemp);
+    const auto addFanTime = [&](const int speed, const double secs) {
+      fanSpeedSeconds += std::max(0, speed - k_baseFanSpeed) * secs * fanCount;
+      unstirredDegreeSeconds += offBy * secs * (1.0 - CeilingFanMixing(speed));
+    };
+    addFanTime(fanSpeed, double(changeAt));
+    addFanTime(changedSpeed, double(dt - changeAt));
+    fanSpeed = changedSpeed;
+
+    if (blowerOn) {
+      blowerSeconds += dt;
+    } else {
+      unmixedDegreeSeconds += offBy * dt;
+    }
+    squaredErrorSeconds += double(s.temp - s.targetTemp) * (s.temp - s.targetTemp) * dt;
+    scoredSeconds += dt;
+  }
+  score.blowerHours = blowerSeconds / 3600;
+  score.fanSpeedHours = fanSpeedSeconds / 3600;
+  score.instability =
+      simulation ? std::sqrt(squaredErrorSeconds / std::max(1.0, scoredSeconds))
+                 : unmixedDegreeSeconds / 3600;
+  score.unstirred = unstirredDegreeSeconds / 3600;
+  return score;
+}
+
+// Candidate ranges, in seconds and fan speeds.  The current settings sit on the grid.
+struct Range {
+  int low, high, step;
+};
+static const Range k_onDelay{0, 300, 30};
+static const Range k_offDelay{0, 600, 60};
+static const Range k_blowerRun{0, 900, 60};
+static const Range k_heatOnSpeed{2, 4, 1};
+static const Range k_heatOffSpeed{k_baseFanSpeed, 2, 1};
+
+std::vector<PolicyParams> GridCandidates() {
+  std::vector<PolicyParams> candidates;
+  for (int on = k_onDelay.low; on <= k_onDelay.high; on += k_onDelay.step)
+    for (int off = k_offDelay.low; off <= k_offDelay.high; off += k_offDelay.step)
+      for (int run = k_blowerRun.low; run <= k_blowerRun.high; run += k_blowerRun.step)
+        for (int speed = k_heatOnSpeed.low; speed <= k_heatOnSpeed.high; ++speed)
+          for (int offSpeed = k_heatOffSpeed.low; offSpeed <= k_heatOffSpeed.high; ++offSpeed)
+            candidates.push_back({seconds(on), seconds(off), seconds(run), speed, offSpeed});
+  return candidates;
+}
+
+std::vector<PolicyParams> RandomCandidates(const int count) {
+  std::mt19937 rng(12345);
+  auto pick = [&rng](const Range& r) {
+    return std::uniform_int_distribution<int>(r.low, r.high)(rng);
+  };
+  std::vector<PolicyParams> candidates;
+  for (int i = 0; i < count; ++i)
+    candidates.push_back({seconds(pick(k_onDelay)), seconds(pick(k_offDelay)),
+                          seconds(pick(k_blowerRun)), pick(k_heatOnSpeed),
+                          pick(k_heatOffSpeed)});
+  return candidates;
+}
+
+std::vector<Result> ParetoFront(const std::vector<Result>& results) {
+  std::vector<Result> front;
+  for (const auto& candidate : results) {
+    const bool dominated = std::any_of(results.begin(), results.end(), [&](const Result& other) {
+      return other.score.Dominates(candidate.score);
+    });
+    if (!dominated) front.push_back(candidate);
+  }
+  std::sort(front.begin(), front.end(), [](const Result& a, const Result& b) {
+    return a.score.blowerHours < b.score.blowerHours;
+  });
+  return front;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " <history file> [--random N] [--threads N] [--fans N] [--model F] [--swing S]"
+              << std::endl;
+    return 1;
+  }
+  int randomCount = 0;
+  int threadCount = std::max(1u, std::thread::hardware_concurrency());
+  int fanCount = 3;
+  std::string modelPath;
+  double swing = 0.5;
+  for (int i = 2; i < argc; i += 2) {
+    const std::string option(argv[i]);
+    if (i + 1 == argc) {
+      std::cerr << "Missing value for " << option << std::endl;
+      return 1;
+    }
+    const int value = std::atoi(argv[i + 1]);
+    if (option == "--model") {
+      modelPath = argv[i + 1];
+    } else if (option == "--swing") {
+      swing = std::atof(argv[i + 1]);
+    } else if (option == "--random") {
+      randomCount = value;
+    } else if (option == "--threads") {
+      threadCount = std::max(1, value);
+    } else if (option == "--fans") {
+      fanCount = value;
+    } else {
+      std::cerr << "Unknown option: " << option << std::endl;
+      return 1;
+    }
+  }
+
+  std::optional<Simulation> simulation;
+  if (!modelPath.empty()) {
+    const auto model = fancontrol::ThermalModel::Load(modelPath);
+    if (!model) {
+      std::cerr << "Unable to load thermal model: " << modelPath << std::endl;
+      return 1;
+    }
+    simulation = Simulation{*model, swing};
+  }
+
+  std::vector<HistorySample> samples;
+  {
+    fancontrol::HistoryReader reader(argv[1]);
+    if (!reader.IsOpen()) {
+      std::cerr << "Unable to open history file: " << argv[1] << std::endl;
+      return 1;
+    }
+    samples.reserve(reader.SampleCount());
+    reader.ScanAll([&samples](const HistorySample* s, std::size_t count) {
+      samples.insert(samples.end(), s, s + count);
+    });
+  }
+
+  const std::vector<PolicyParams> candidates =
+      randomCount > 0 ? RandomCandidates(randomCount) : GridCandidates();
+  std::vector<Result> results(candidates.size());
+
+  using namespace std::chrono;
+  const auto startTime(steady_clock::now());
+  // Each replay is independent; threads just take the next unclaimed candidate.
+  std::atomic<std::size_t> next(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threadCount; ++t) {
+    workers.emplace_back([&]() {
+      for (std::size_t i = next++; i < candidates.size(); i = next++) {
+        results[i] = {candidates[i], Replay(samples, candidates[i], fanCount,
+                                            simulation ? &*simulation : nullptr)};
+      }
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  const double secs = duration<double>(steady_clock::now() - startTime).count();
+
+  std::cerr << "Replayed " << samples.size() << " samples x " << candidates.size()
+            << " combinations on " << threadCount << " threads in " << secs << "s" << std::endl;
+
+  std::cout << "fan_on_delay_s,fan_off_delay_s,blower_run_s,heat_on_fan_speed,heat_off_fan_speed,"
+               "blower_hours,fan_speed_hours,commands,"
+            << (simulation ? "temp_rms_error" : "unmixed_degree_hours")
+            << ",unstirred_degree_hours\n";
+  for (const auto& r : ParetoFront(results)) {
+    std::cout << r.params.ceilingFanOnDelay.count() << ',' << r.params.ceilingFanOffDelay.count()
+              << ',' << r.params.runBlowerFanAfterHeatOff.count() << ',' << r.params.heatOnFanSpeed
+              << ',' << r.params.heatOffFanSpeed << ',' << r.score.blowerHours << ','
+              << r.score.fanSpeedHours << ',' << r.score.commands << ',' << r.score.instability
+              << ',' << r.score.unstirred << '\n';
+  }
+  return 0;
+}
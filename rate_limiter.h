@@ -0,0 +1,246 @@
+/**
+ * Rate Limiter ---
+ * Token buckets on the requests we send, one per device and one shared by all of them.  The
+ * Modern Forms fans get unresponsive when hit with bursts (see CeilingFan::Reboot()), and a
+ * command that keeps failing is retried every poll, so each device gets a small burst and a slow
+ * refill, and the global bucket caps the total.
+ *
+ * A request takes a token from its device's bucket and the global one.  When either is empty it
+ * waits, up to a limit, and waiting requests are served highest priority first as tokens come
+ * back (oldest first within a priority), whether they block a thread or are workflows retrying on
+ * a timer.  One that waits too long is dropped and counted, and the
+ * caller treats it like a request that failed.  Requests for different devices don't queue
+ * behind each other unless the global bucket is what's short.
+ */
+#ifndef RATE_LIMITER_H_
+#define RATE_LIMITER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace fancontrol {
+
+struct RateLimit {
+  // Requests that may go back to back after a quiet spell.
+  int burst;
+  // One more request is allowed each interval.
+  std::chrono::steady_clock::duration interval;
+};
+
+enum class RequestPriority { HIGH, NORMAL, LOW };
+
+class TokenBucket final {
+  using Clock = std::chrono::steady_clock;
+  RateLimit limit;
+  double tokens;
+  Clock::time_point last;
+
+ public:
+  explicit TokenBucket(const RateLimit& limit, const Clock::time_point now = Clock::now())
+      : limit(limit), tokens(limit.burst), last(now) {}
+
+  void Refill(const Clock::time_point now) {
+    if (now <= last) return;
+    tokens = std::min<double>(limit.burst, tokens + double((now - last).count()) /
+                                                        double(limit.interval.count()));
+    last = now;
+  }
+  bool Available() const { return tokens >= 1; }
+  void Take() { tokens -= 1; }
+  // When the next whole token will be there, as of the last Refill().
+  Clock::time_point NextToken() const {
+    if (Available()) return last;
+    return last + std::chrono::duration_cast<Clock::duration>(limit.interval * (1 - tokens));
+  }
+};
+
+class RequestLimiter final {
+  using Clock = std::chrono::steady_clock;
+
+  struct Device {
+    // Unset for a key that wasn't added, which is only limited globally.
+    std::optional<TokenBucket> bucket;
+    uint64_t requests = 0;
+    uint64_t delayed = 0;
+    uint64_t dropped = 0;
+    Clock::duration delay{};
+  };
+  struct Waiter {
+    RequestPriority priority;
+    uint64_t sequence;
+    Device* device;
+    bool operator<(const Waiter& other) const {
+      return std::tie(priority, sequence) < std::tie(other.priority, other.sequence);
+    }
+  };
+
+  mutable std::mutex lock;
+  std::condition_variable tokensReturned;
+  TokenBucket global;
+  std::map<std::string, Device> devices;
+  std::set<Waiter> waiting;
+  uint64_t nextSequence = 0;
+
+  void Refill(const Clock::time_point now) {
+    global.Refill(now);
+    for (auto& device : devices) {
+      if (device.second.bucket) device.second.bucket->Refill(now);
+    }
+  }
+
+  // The waiter that gets the next tokens, if one can go now.
+  std::optional<uint64_t> Next() const {
+    if (!global.Available()) return std::nullopt;
+    for (const Waiter& waiter : waiting) {
+      if (!waiter.device->bucket || waiter.device->bucket->Available()) return waiter.sequence;
+    }
+    return std::nullopt;
+  }
+
+  void Leave(const uint64_t sequence) {
+    const auto it = std::find_if(waiting.begin(), waiting.end(), [sequence](const Waiter& waiter) {
+      return waiter.sequence == sequence;
+    });
+    if (it != waiting.end()) waiting.erase(it);
+  }
+
+  // When a token any waiter needs will next come back.
+  Clock::time_point NextToken() const {
+    auto next = Clock::time_point::max();
+    for (const Waiter& waiter : waiting) {
+      const auto& bucket = waiter.device->bucket;
+      next = std::min(next, bucket ? std::max(global.NextToken(), bucket->NextToken())
+                                   : global.NextToken());
+    }
+    return next;
+  }
+
+ public:
+  explicit RequestLimiter(const RateLimit& globalLimit) : global(globalLimit) {}
+  RequestLimiter(const RequestLimiter&) = delete;
+  RequestLimiter& operator=(const RequestLimiter&) = delete;
+
+  void AddDevice(const std::string& key, const RateLimit& limit) {
+    const std::lock_guard<std::mutex> guard(lock);
+    devices[key].bucket.emplace(limit);
+  }
+
+  /**
+   * Blocks until the request may go, or for at most `maxWait`.  Returns false if it should be
+   * dropped instead.
+   */
+  bool Acquire(const std::string& key, const RequestPriority priority,
+               const Clock::duration maxWait) {
+    std::unique_lock<std::mutex> guard(lock);
+    const auto start = Clock::now();
+    const auto deadline = start + maxWait;
+    Device& device = devices[key];
+    ++device.requests;
+    const Waiter self{priority, nextSequence++, &device};
+    waiting.insert(self);
+    while (true) {
+      const auto now = Clock::now();
+      Refill(now);
+      if (Next() == self.sequence) {
+        waiting.erase(self);
+        global.Take();
+        if (device.bucket) device.bucket->Take();
+        if (now > start + std::chrono::milliseconds(1)) {
+          ++device.delayed;
+          device.delay += now - start;
+        }
+        // Someone else may be able to go too.
+        tokensReturned.notify_all();
+        return true;
+      }
+      if (now >= deadline) {
+        waiting.erase(self);
+        ++device.dropped;
+        tokensReturned.notify_all();
+        return false;
+      }
+      tokensReturned.wait_until(guard, std::min(deadline, NextToken()));
+    }
+  }
+
+  /**
+   * Acquire() for a caller that mustn't block, like a workflow (see workflow.h).  Takes the tokens
+   * and returns true if the request may go now.  Otherwise it joins the same queue as blocked
+   * requests under `ticket`, and should try again at `retryAt` with the ticket it was given; it
+   * goes once it's at the head of the queue for tokens there are.  `since` is when it first
+   * tried.  A caller that gives up, or goes away while it holds a ticket, says so with Dropped().
+   */
+  bool TryAcquire(const std::string& key, const RequestPriority priority,
+                  const Clock::time_point since, std::optional<uint64_t>& ticket,
+                  Clock::time_point& retryAt) {
+    const std::lock_guard<std::mutex> guard(lock);
+    const auto now = Clock::now();
+    Refill(now);
+    Device& device = devices[key];
+    if (!ticket) {
+      ++device.requests;
+      ticket = nextSequence++;
+      waiting.insert({priority, *ticket, &device});
+    }
+    if (Next() == *ticket) {
+      Leave(*ticket);
+      ticket.reset();
+      global.Take();
+      if (device.bucket) device.bucket->Take();
+      if (now > since + std::chrono::milliseconds(1)) {
+        ++device.delayed;
+        device.delay += now - since;
+      }
+      tokensReturned.notify_all();
+      return true;
+    }
+    retryAt = device.bucket ? std::max(global.NextToken(), device.bucket->NextToken())
+                            : global.NextToken();
+    // A request ahead takes the tokens there are; try again once it has.
+    retryAt = std::max(retryAt, now + std::chrono::milliseconds(1));
+    return false;
+  }
+  void Dropped(const std::string& key, std::optional<uint64_t>& ticket) {
+    const std::lock_guard<std::mutex> guard(lock);
+    Device& device = devices[key];
+    if (ticket) {
+      Leave(*ticket);
+      ticket.reset();
+      tokensReturned.notify_all();
+    } else {
+      ++device.requests;
+    }
+    ++device.dropped;
+  }
+
+  // One line per limited device that has had requests held back or dropped.
+  std::vector<std::string> Report() const {
+    const std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::string> lines;
+    char line[256];
+    for (const auto& [key, device] : devices) {
+      if (!device.delayed && !device.dropped) continue;
+      std::snprintf(line, sizeof(line),
+                    "Rate limit %s: %lu requests, %lu delayed (%.1f s in all), %lu dropped",
+                    key.c_str(), (unsigned long)device.requests, (unsigned long)device.delayed,
+                    std::chrono::duration<double>(device.delay).count(),
+                    (unsigned long)device.dropped);
+      lines.push_back(line);
+    }
+    return lines;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // RATE_LIMITER_H_
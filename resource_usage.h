@@ -0,0 +1,248 @@
+/**
+ * Resource Usage ---
+ * The controller's own cost: CPU time, context switches, page faults and peak RSS from
+ * getrusage() at each tick of the main loop, timer wakeups, and per subsystem the CPU time,
+ * context switches and file syscalls spent in it.  Totals are scaled to a day of operation, which
+ * is the number that matters for something that runs forever, so changes to the loop can be
+ * compared by cost.
+ *
+ * The subsystems of the main loop are measured on its thread, so waiting there for a device costs
+ * them nothing.  Device I/O runs on a thread of its own (see pipeline.h), which counts its own CPU
+ * time and context switches; they're reported as one more subsystem, without file syscalls.
+ *
+ * There's no cheap unprivileged syscall counter, so syscalls come from the kernel's I/O
+ * accounting for the thread that constructs ResourceUsage (/proc/thread-self/io), which must be
+ * the one that measures subsystems; the process-wide file would also count the I/O thread's
+ * doorbell and log writes.  It counts the read and write families on files, pipes and
+ * terminals, but not socket send/recv; network cost shows up as context switches here (each wait
+ * for a device is one) and as bytes per device in the connection pool statistics.  If the kernel
+ * doesn't provide the file (before Linux 3.17, or without task I/O accounting), syscalls aren't
+ * reported.
+ *
+ * The report ends with what the process holds right now (resident memory, descriptors, sockets
+ * and heap in use), which should stay flat however long the controller runs; soak.sh checks it.
+ * Resident memory is also given without file-backed pages, which grow as the event log's mapped
+ * segments fill (see event_log.h) and are dropped as they're rotated, so the anonymous part is
+ * the one that shows a leak.
+ */
+#ifndef RESOURCE_USAGE_H_
+#define RESOURCE_USAGE_H_
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace fancontrol {
+
+enum class Subsystem { POLL, FANS, HISTORY, ROLLUPS, SCHEDULE, DEVICE_IO, COUNT };
+
+inline const char* SubsystemName(const Subsystem s) {
+  static const char* const names[] = {"poll",    "fans",     "history",
+                                      "rollups", "schedule", "device I/O"};
+  return names[int(s)];
+}
+
+class ResourceUsage final {
+  struct Section {
+    uint64_t calls = 0;
+    uint64_t cpuNanos = 0;
+    uint64_t contextSwitches = 0;
+    uint64_t syscalls = 0;
+    // Counted by a thread of its own (see SetThreadTotals()), with no syscalls.
+    bool ownThread = false;
+  };
+
+  const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+  rusage start;
+  rusage last;
+  uint64_t ticks = 0;
+  uint64_t wakeups = 0;
+  uint64_t maxTickCpuMicros = 0;
+  Section sections[int(Subsystem::COUNT)];
+  int ioFd;
+
+  static uint64_t Micros(const timeval& tv) { return uint64_t(tv.tv_sec) * 1000000 + tv.tv_usec; }
+
+  // File read and write syscalls made so far by the constructing thread, or 0 without I/O
+  // accounting.
+  uint64_t Syscalls() const {
+    if (ioFd < 0) return 0;
+    char buf[512];
+    const ssize_t n = pread(ioFd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return 0;
+    buf[n] = '\0';
+    uint64_t total = 0;
+    for (const char* key : {"syscr: ", "syscw: "}) {
+      if (const char* field = std::strstr(buf, key)) total += std::strtoull(field + 7, nullptr, 10);
+    }
+    return total;
+  }
+
+ public:
+  // The calling thread's totals so far.
+  static uint64_t ThreadContextSwitches() {
+    rusage r;
+    getrusage(RUSAGE_THREAD, &r);
+    return uint64_t(r.ru_nvcsw + r.ru_nivcsw);
+  }
+
+  static uint64_t ThreadCpuNanos() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  ResourceUsage() : ioFd(open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC)) {
+    getrusage(RUSAGE_SELF, &start);
+    last = start;
+  }
+  ~ResourceUsage() {
+    if (ioFd >= 0) close(ioFd);
+  }
+  ResourceUsage(const ResourceUsage&) = delete;
+  ResourceUsage& operator=(const ResourceUsage&) = delete;
+
+  // Charges what happens between construction and destruction to a subsystem.
+  class Scope final {
+    ResourceUsage& usage;
+    Section& section;
+    const uint64_t cpuStart;
+    const uint64_t switchStart;
+    const uint64_t syscallStart;
+
+   public:
+    Scope(ResourceUsage& usage, const Subsystem s)
+        : usage(usage),
+          section(usage.sections[int(s)]),
+          cpuStart(ThreadCpuNanos()),
+          switchStart(ThreadContextSwitches()),
+          syscallStart(usage.Syscalls()) {}
+    ~Scope() {
+      const uint64_t syscallEnd = usage.Syscalls();
+      // The read of the starting count is itself counted.
+      if (syscallEnd > syscallStart) section.syscalls += syscallEnd - syscallStart - 1;
+      section.contextSwitches += ThreadContextSwitches() - switchStart;
+      section.cpuNanos += ThreadCpuNanos() - cpuStart;
+      ++section.calls;
+    }
+  };
+  Scope Measure(const Subsystem s) { return Scope(*this, s); }
+
+  // For a subsystem on a thread of its own, which counts for itself: its totals so far, replacing
+  // any set before.
+  void SetThreadTotals(const Subsystem s, const uint64_t calls, const uint64_t cpuNanos,
+                       const uint64_t contextSwitches) {
+    Section& section = sections[int(s)];
+    section.calls = calls;
+    section.cpuNanos = cpuNanos;
+    section.contextSwitches = contextSwitches;
+    section.ownThread = true;
+  }
+
+  struct Footprint {
+    long rssKb = 0;
+    // Resident and not backed by a file: the heap, stacks and other private memory.
+    long anonRssKb = 0;
+    int fds = 0;
+    int sockets = 0;
+    // Bytes allocated and not yet freed, or 0 where the C library can't say.
+    std::size_t heapBytes = 0;
+  };
+
+  static Footprint Current() {
+    Footprint footprint;
+    if (FILE* statm = std::fopen("/proc/self/statm", "r")) {
+      long pages = 0;
+      long shared = 0;
+      if (std::fscanf(statm, "%*s %ld %ld", &pages, &shared) == 2) {
+        footprint.rssKb = pages * (getpagesize() / 1024);
+        footprint.anonRssKb = (pages - shared) * (getpagesize() / 1024);
+      }
+      std::fclose(statm);
+    }
+    if (DIR* dir = opendir("/proc/self/fd")) {
+      const int self = dirfd(dir);
+      while (const dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] == '.' || std::atoi(entry->d_name) == self) continue;
+        ++footprint.fds;
+        char target[64];
+        const ssize_t n = readlinkat(self, entry->d_name, target, sizeof(target) - 1);
+        if (n > 0 && std::strncmp(target, "socket:", 7) == 0) ++footprint.sockets;
+      }
+      closedir(dir);
+    }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    footprint.heapBytes = mallinfo2().uordblks;
+#endif
+    return footprint;
+  }
+
+  // Once per pass of the main loop.
+  void Tick() {
+    rusage now;
+    getrusage(RUSAGE_SELF, &now);
+    const uint64_t cpu = Micros(now.ru_utime) + Micros(now.ru_stime) - Micros(last.ru_utime) -
+                         Micros(last.ru_stime);
+    if (cpu > maxTickCpuMicros) maxTickCpuMicros = cpu;
+    last = now;
+    ++ticks;
+  }
+
+  // Each time the process wakes from a timed sleep.
+  void Wakeup() { ++wakeups; }
+
+  // One line per subsystem after an overall line, with counts scaled to a day.
+  std::vector<std::string> Report() const {
+    const double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    const double perDay = seconds > 0 ? 86400 / seconds : 0;
+    const bool haveSyscalls = ioFd >= 0;
+    std::vector<std::string> lines;
+    char line[256];
+    std::snprintf(
+        line, sizeof(line),
+        "Per day: %.1f s user + %.1f s system CPU, %.0f ticks (max %.1f ms CPU), %.0f wakeups, "
+        "%.0f voluntary / %.0f involuntary context switches, %.0f page faults; peak RSS %ld kB",
+        (Micros(last.ru_utime) - Micros(start.ru_utime)) / 1e6 * perDay,
+        (Micros(last.ru_stime) - Micros(start.ru_stime)) / 1e6 * perDay, ticks * perDay,
+        maxTickCpuMicros / 1e3, wakeups * perDay, (last.ru_nvcsw - start.ru_nvcsw) * perDay,
+        (last.ru_nivcsw - start.ru_nivcsw) * perDay,
+        (last.ru_minflt - start.ru_minflt + last.ru_majflt - start.ru_majflt) * perDay,
+        last.ru_maxrss);
+    lines.push_back(line);
+    for (int s = 0; s < int(Subsystem::COUNT); ++s) {
+      const Section& section = sections[s];
+      int length = std::snprintf(
+          line, sizeof(line), "  %s: %.0f calls, %.2f s CPU, %.0f context switches",
+          SubsystemName(Subsystem(s)), section.calls * perDay, section.cpuNanos / 1e9 * perDay,
+          section.contextSwitches * perDay);
+      if (haveSyscalls && !section.ownThread) {
+        length += std::snprintf(line + length, sizeof(line) - length, ", %.0f file syscalls",
+                                section.syscalls * perDay);
+      }
+      std::snprintf(line + length, sizeof(line) - length, " per day");
+      lines.push_back(line);
+    }
+    const Footprint now = Current();
+    std::snprintf(line, sizeof(line),
+                  "Now: RSS %ld kB (%ld kB anonymous), %d fds (%d sockets), heap %zu bytes",
+                  now.rssKb, now.anonRssKb, now.fds, now.sockets, now.heapBytes);
+    lines.push_back(line);
+    return lines;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // RESOURCE_USAGE_H_
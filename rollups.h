@@ -0,0 +1,299 @@
+/**
+ * Controller rollups ---
+ * Minute, hour and day aggregates of the controller's data, kept up to date as each poll completes
+ * so questions like "how long did the blower run yesterday" are answered from one record instead
+ * of a scan of the raw history.
+ *
+ * Each level lives in its own file of fixed-size slots used as a ring, with the slot for a period
+ * at (start / period) % capacity.  The open period's record is rewritten in place after each
+ * update, so readers always see current numbers, and on restart we pick the open period back up.
+ * Periods are aligned to UTC.
+ *
+ * Records are written as-is, so a change to their layout bumps k_rollupVersion, which is in the
+ * file names: files in an older layout are left alone rather than misread, and the new ones start
+ * empty.  Each record also carries a magic number, and one without it reads as an unused slot.
+ *
+ * Each record also keeps what the fans cost to run: the blower seconds owed to running it past the
+ * heat (see BlowerPolicy), the ceiling fan seconds at each speed (summed over the fans), and the
+ * watt hours of each from the wattages in effect at the time.  Like the heat and blower seconds,
+ * these are credited from one sample to the next, so a day's total is there as soon as it ends.
+ */
+#ifndef ROLLUPS_H_
+#define ROLLUPS_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "fan_policy.h"
+
+namespace fancontrol {
+
+// Latencies are bucketed by powers of two: bucket 0 is < 2ms, bucket i is [2^i, 2^(i+1)) ms.
+static const int k_latencyBuckets = 16;
+
+struct LatencyHistogram {
+  uint32_t buckets[k_latencyBuckets];
+
+  void Add(const uint32_t ms) {
+    int bucket = 0;
+    for (uint32_t v = ms >> 1; v && bucket < k_latencyBuckets - 1; v >>= 1) ++bucket;
+    ++buckets[bucket];
+  }
+
+  uint32_t Count() const {
+    uint32_t total = 0;
+    for (const auto b : buckets) total += b;
+    return total;
+  }
+
+  // Upper bound (ms) of the bucket holding the given percentile (0-100), or 0 if empty.
+  uint32_t Percentile(const double p) const {
+    const uint32_t total = Count();
+    if (!total) return 0;
+    const double target = total * p / 100.0;
+    uint32_t seen = 0;
+    for (int i = 0; i < k_latencyBuckets; ++i) {
+      seen += buckets[i];
+      if (seen >= target) return 2u << i;
+    }
+    return 2u << (k_latencyBuckets - 1);
+  }
+};
+
+// What's drawing power from one sample to the next.
+struct Loads {
+  // The blower is on only because we're running it past the heat.
+  bool blowerExtended = false;
+  // How many ceiling fans are at each speed.
+  uint8_t fansAtSpeed[k_maxFanSpeed + 1] = {};
+  // The blower's draw while it's on, and the ceiling fans' together, in watts.
+  float blowerWatts = 0;
+  float fanWatts = 0;
+};
+
+// In the file names; bump it with any change to the layout of Rollup.
+static const int k_rollupVersion = 2;
+
+struct Rollup {
+  static constexpr uint32_t k_magic = 0x32524346;  // "FCR2"
+
+  int64_t start;  // seconds since the epoch; 0 marks an unused slot
+  uint32_t magic;
+  // Zero.  Keeps sumTemp aligned without padding the compiler would leave uninitialized.
+  uint32_t reserved;
+  uint32_t period;
+  uint32_t samples;
+  float minTemp;
+  float maxTemp;
+  double sumTemp;
+  uint32_t heatOnSeconds;
+  uint32_t blowerOnSeconds;
+  uint32_t commands;
+  uint32_t failedCommands;
+  LatencyHistogram pollLatency;
+  LatencyHistogram commandLatency;
+  uint32_t extendedBlowerSeconds;
+  // Fan-seconds: two fans at speed 1 for a minute is 120 s at speed 1.
+  uint32_t fanSpeedSeconds[k_maxFanSpeed + 1];
+  double blowerWh;
+  double extendedBlowerWh;
+  double fanWh;
+
+  float AvgTemp() const { return samples ? float(sumTemp / samples) : 0; }
+  double KWh() const { return (blowerWh + fanWh) / 1000; }
+  // Whether this slot holds the record for the period starting at `periodStart`.
+  bool Holds(const int64_t periodStart) const {
+    return magic == k_magic && start == periodStart;
+  }
+};
+static_assert(sizeof(Rollup) == 240, "Rollup is written to disk as-is");
+
+enum class RollupLevel { MINUTE = 0, HOUR = 1, DAY = 2 };
+
+inline const char* RollupLevelName(const RollupLevel level) {
+  switch (level) {
+    case RollupLevel::MINUTE:
+      return "minute";
+    case RollupLevel::HOUR:
+      return "hour";
+    case RollupLevel::DAY:
+      return "day";
+  }
+  return "";
+}
+
+namespace rollup_detail {
+
+struct LevelConfig {
+  uint32_t period;    // seconds
+  uint32_t capacity;  // slots in the ring
+};
+// A week of minutes, two years of hours and ten years of days; about 7.5 MB in total.
+static const LevelConfig k_levels[] = {{60, 7 * 24 * 60}, {3600, 2 * 366 * 24}, {86400, 3660}};
+
+inline std::string LevelPath(const std::string& prefix, const RollupLevel level) {
+  return prefix + "_" + RollupLevelName(level) + "_v" + std::to_string(k_rollupVersion) + ".bin";
+}
+
+inline off_t SlotOffset(const LevelConfig& config, const int64_t start) {
+  return off_t((start / config.period) % config.capacity) * off_t(sizeof(Rollup));
+}
+
+}  // namespace rollup_detail
+
+/**
+ * Maintains the three rollup levels.  The Add* calls only touch the open records; Persist() writes
+ * them out and should be called once per poll.
+ */
+class RollupRecorder final {
+  // Gaps longer than this mean we weren't running, so don't credit the heat or blower with them.
+  static const int64_t k_maxSampleGap = 5 * 60;
+
+  struct Level {
+    rollup_detail::LevelConfig config;
+    int fd;
+    Rollup current;
+  };
+  Level levels[3];
+  int64_t lastSampleTime;
+  bool lastHeatOn;
+  bool lastBlowerOn;
+  Loads lastLoads;
+
+  // Moves the level to the period containing `time`, loading a previously saved record for it.
+  void Roll(Level& level, const int64_t time) {
+    const int64_t start = time - time % level.config.period;
+    if (level.current.start == start) return;
+    if (level.current.start) Write(level);
+    Rollup saved{};
+    if (level.fd >= 0 &&
+        pread(level.fd, &saved, sizeof(saved), rollup_detail::SlotOffset(level.config, start)) ==
+            ssize_t(sizeof(saved)) &&
+        saved.Holds(start)) {
+      level.current = saved;
+      return;
+    }
+    level.current = Rollup{};
+    level.current.start = start;
+    level.current.magic = Rollup::k_magic;
+    level.current.period = level.config.period;
+    level.current.minTemp = std::numeric_limits<float>::max();
+    level.current.maxTemp = std::numeric_limits<float>::lowest();
+  }
+
+  bool Write(const Level& level) {
+    if (level.fd < 0 || !level.current.start) return false;
+    return pwrite(level.fd, &level.current, sizeof(level.current),
+                  rollup_detail::SlotOffset(level.config, level.current.start)) ==
+           ssize_t(sizeof(level.current));
+  }
+
+ public:
+  explicit RollupRecorder(const std::string& pathPrefix)
+      : lastSampleTime(0), lastHeatOn(false), lastBlowerOn(false) {
+    for (int i = 0; i < 3; ++i) {
+      levels[i].config = rollup_detail::k_levels[i];
+      levels[i].fd = ::open(rollup_detail::LevelPath(pathPrefix, RollupLevel(i)).c_str(),
+                            O_RDWR | O_CREAT, 0644);
+      levels[i].current = Rollup{};
+    }
+  }
+  ~RollupRecorder() {
+    Persist();
+    for (auto& level : levels)
+      if (level.fd >= 0) ::close(level.fd);
+  }
+  RollupRecorder(const RollupRecorder&) = delete;
+  RollupRecorder& operator=(const RollupRecorder&) = delete;
+
+  bool IsOpen() const { return levels[0].fd >= 0 && levels[1].fd >= 0 && levels[2].fd >= 0; }
+
+  // Records a thermostat sample, and what the fans are drawing as of it.  The time since the
+  // previous sample is credited to the heat, blower and fans according to the previous sample.
+  void AddSample(const int64_t time, const float temp, const bool heatOn, const bool blowerOn,
+                 const Loads& loads = {}) {
+    const int64_t gap = lastSampleTime ? time - lastSampleTime : 0;
+    const uint32_t credit = gap > 0 && gap <= k_maxSampleGap ? uint32_t(gap) : 0;
+    const double hours = credit / 3600.0;
+    const bool extended = lastBlowerOn && !lastHeatOn && lastLoads.blowerExtended;
+    for (auto& level : levels) {
+      Roll(level, time);
+      Rollup& r = level.current;
+      ++r.samples;
+      r.minTemp = std::min(r.minTemp, temp);
+      r.maxTemp = std::max(r.maxTemp, temp);
+      r.sumTemp += temp;
+      if (lastHeatOn) r.heatOnSeconds += credit;
+      if (lastBlowerOn) r.blowerOnSeconds += credit;
+      if (extended) r.extendedBlowerSeconds += credit;
+      for (int speed = 0; speed <= k_maxFanSpeed; ++speed) {
+        r.fanSpeedSeconds[speed] += credit * lastLoads.fansAtSpeed[speed];
+      }
+      if (lastBlowerOn) r.blowerWh += lastLoads.blowerWatts * hours;
+      if (extended) r.extendedBlowerWh += lastLoads.blowerWatts * hours;
+      r.fanWh += lastLoads.fanWatts * hours;
+    }
+    lastSampleTime = time;
+    lastHeatOn = heatOn;
+    lastBlowerOn = blowerOn;
+    lastLoads = loads;
+  }
+
+  void AddPoll(const int64_t time, const uint32_t latencyMs) {
+    for (auto& level : levels) {
+      Roll(level, time);
+      level.current.pollLatency.Add(latencyMs);
+    }
+  }
+
+  void AddCommand(const int64_t time, const uint32_t latencyMs, const bool ok) {
+    for (auto& level : levels) {
+      Roll(level, time);
+      ++level.current.commands;
+      if (!ok) ++level.current.failedCommands;
+      level.current.commandLatency.Add(latencyMs);
+    }
+  }
+
+  // Returns false if any level couldn't be written; the next call rewrites the same slots.
+  bool Persist() {
+    bool ok = true;
+    for (const auto& level : levels) ok = Write(level) && ok;
+    return ok;
+  }
+
+  const Rollup& Current(const RollupLevel level) const { return levels[int(level)].current; }
+};
+
+/**
+ * Returns the saved rollups of one level whose period starts in [from, to], oldest first.  Spans
+ * longer than the level's ring are clipped to the most recent `capacity` periods before `to`.
+ */
+inline std::vector<Rollup> ReadRollups(const std::string& pathPrefix, const RollupLevel level,
+                                       int64_t from, const int64_t to) {
+  const auto& config = rollup_detail::k_levels[int(level)];
+  std::vector<Rollup> result;
+  const int fd = ::open(rollup_detail::LevelPath(pathPrefix, level).c_str(), O_RDONLY);
+  if (fd < 0) return result;
+  from = std::max<int64_t>({from, 0, to - int64_t(config.period) * (config.capacity - 1)});
+  std::vector<Rollup> slots(config.capacity);
+  const ssize_t bytes = pread(fd, slots.data(), slots.size() * sizeof(Rollup), 0);
+  ::close(fd);
+  const std::size_t filled = bytes > 0 ? std::size_t(bytes) / sizeof(Rollup) : 0;
+  for (int64_t start = from - from % config.period; start <= to; start += config.period) {
+    const std::size_t slot = (start / config.period) % config.capacity;
+    if (slot < filled && slots[slot].Holds(start) && start >= from) result.push_back(slots[slot]);
+  }
+  return result;
+}
+
+}  // namespace fancontrol
+
+#endif  // ROLLUPS_H_
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Soak Test ---
+# Runs the controller against mock devices (mock_devices.cpp) for simulated days at accelerated
+# time and fails if its memory, descriptors, sockets or heap keep growing.  Memory is the anonymous
+# part of RSS: the event log's mapped segments are file-backed, and grow until they're rotated.
+# glibc's per-thread cache is turned off, as the chunks it holds count as heap in use and it fills
+# slowly over days as rarely used sizes are freed.
+#
+#   ./soak.sh [days]
+#
+# The soak build (FANCONTROL_SOAK) runs its clocks SPEEDUP times faster than real time, 1000 by
+# default, so the default 90 days take a little over two hours.  The resource statistics it logs
+# every simulated hour end with what the process holds at that moment; those samples are saved to
+# $OUT/soak.csv.  After the first simulated day (startup, the first rollups) the rest are split in
+# four, and a value whose peak rises in every quarter is reported as growth.  CXX and CXXFLAGS are
+# passed through.
+set -e
+
+CXX=${CXX:-g++}
+OUT=${OUT:-soak_build}
+SPEEDUP=${SPEEDUP:-1000}
+DAYS=${1:-90}
+PORTS="18073 18075 18076 18077"  # k_thermostatUrl and k_fanUrls in the soak build
+
+mkdir -p "$OUT"
+$CXX $CXXFLAGS -O2 -DFANCONTROL_SOAK="$SPEEDUP" fan_controller.cpp -o "$OUT/fan_controller_soak" \
+  -std=c++17 -lcurl -pthread
+$CXX $CXXFLAGS -O2 mock_devices.cpp -o "$OUT/mock_devices" -std=c++17
+
+cd "$OUT"
+rm -f fancontrol_history.bin fancontrol_rollup_*.bin soak.log
+./mock_devices "$SPEEDUP" $PORTS &
+mock=$!
+trap 'kill "$mock" 2> /dev/null' EXIT
+GLIBC_TUNABLES=${GLIBC_TUNABLES:+$GLIBC_TUNABLES:}glibc.malloc.tcache_count=0 \
+  ./fan_controller_soak > /dev/null 2> soak.log &
+controller=$!
+seconds=$(awk -v days="$DAYS" -v speedup="$SPEEDUP" 'BEGIN { print int(days * 86400 / speedup) }')
+echo "Soaking for $DAYS simulated days ($seconds s)"
+sleep "$seconds"
+kill -TERM "$controller"
+wait "$controller" || true
+
+echo "hour,anon_rss_kb,fds,sockets,heap_bytes" > soak.csv
+sed -n 's/.*Now: RSS [0-9]* kB (\([0-9]*\) kB anonymous), \([0-9]*\) fds (\([0-9]*\) sockets), '\
+'heap \([0-9]*\) bytes.*/\1,\2,\3,\4/p' soak.log | awk '{ print NR "," $0 }' >> soak.csv
+
+awk -F, 'NR > 1 { hour[NR - 1] = $1; for (c = 2; c <= 5; ++c) value[NR - 1, c] = $c; n = NR - 1 }
+END {
+  split("anon_rss_kb fds sockets heap_bytes", names, " ")
+  if (n < 24 + 8) { print "Too few hourly samples (" n ") to judge growth"; exit 1 }
+  failed = 0
+  for (c = 2; c <= 5; ++c) {
+    for (q = 0; q < 4; ++q) peak[q] = -1
+    for (i = 25; i <= n; ++i) {
+      q = int((i - 25) * 4 / (n - 24))
+      if (value[i, c] > peak[q]) peak[q] = value[i, c]
+    }
+    grows = peak[0] < peak[1] && peak[1] < peak[2] && peak[2] < peak[3]
+    printf "  %s: %d at hour 1, quarterly peaks %d %d %d %d%s\n", names[c - 1], value[1, c],
+           peak[0], peak[1], peak[2], peak[3], grows ? "  GROWING" : ""
+    failed += grows
+  }
+  if (failed) { print "FAIL: steady growth over " n " simulated hours"; exit 1 }
+  print "PASS: " n " simulated hours"
+}' soak.csv
@@ -0,0 +1,70 @@
+/**
+ * SPSC Ring ---
+ * A bounded lock-free queue between exactly one producer thread and one consumer thread, which is
+ * how the decision and I/O threads hand workflows to each other (see pipeline.h).
+ *
+ * Each side writes only its own index and reads the other's, so a push or a pop is a load and a
+ * release store, with no locks and no read-modify-write.  The two indices are on cache lines of
+ * their own, and each side keeps a copy of the other's index on its own line, rereading the real
+ * one only when the ring looks full (or empty) from the copy.  So in steady state neither thread
+ * touches a line the other is writing, and the line with the other's index moves across at most
+ * once per batch rather than on every item.
+ */
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <atomic>
+#include <cstddef>
+
+namespace fancontrol {
+
+// Keeps data written by different threads apart.  64 bytes on every CPU we run on.
+static constexpr std::size_t k_cacheLineSize = 64;
+
+template <typename T, std::size_t Capacity>
+class SpscRing final {
+  static_assert(Capacity && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+  static constexpr std::size_t k_mask = Capacity - 1;
+
+  // Both count up forever and are masked into `slots`.  The next slot to pop, and the consumer's
+  // copy of `tail`.
+  alignas(k_cacheLineSize) std::atomic<std::size_t> head{0};
+  std::size_t tailSeen = 0;
+  // The next slot to push, and the producer's copy of `head`.
+  alignas(k_cacheLineSize) std::atomic<std::size_t> tail{0};
+  std::size_t headSeen = 0;
+  alignas(k_cacheLineSize) T slots[Capacity];
+
+ public:
+  SpscRing() = default;
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  // Producer only.  Returns false, leaving the ring as it was, if it's full.
+  bool Push(const T& item) {
+    const std::size_t next = tail.load(std::memory_order_relaxed);
+    if (next - headSeen == Capacity) {
+      headSeen = head.load(std::memory_order_acquire);
+      if (next - headSeen == Capacity) return false;
+    }
+    slots[next & k_mask] = item;
+    tail.store(next + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only.  Returns false if it's empty.
+  bool Pop(T& item) {
+    const std::size_t next = head.load(std::memory_order_relaxed);
+    if (next == tailSeen) {
+      tailSeen = tail.load(std::memory_order_acquire);
+      if (next == tailSeen) return false;
+    }
+    item = slots[next & k_mask];
+    head.store(next + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // SPSC_RING_H_
@@ -0,0 +1,145 @@
+/**
+ * Hot Standby ---
+ * A second controller can run as a standby and take over when the active one goes away, so a
+ * crash or a killed process doesn't leave the blower latched on with nobody to put it back.
+ *
+ * Which one is active is decided by a lease: an exclusive flock() on a file both share, taken by
+ * whichever starts first and held for as long as it runs.  The kernel drops it the moment its
+ * holder exits, however that happens, and the standby tries for it every second or so.  Both must
+ * see the same file, so they share a host (or a filesystem whose locks work across hosts).
+ *
+ * After every poll the active controller saves what it knows that the devices can't tell us to a
+ * snapshot: the last thermostat state, when the furnace last turned on or off, whether each fan
+ * has been set since, and the blower mode it latched.  The standby reads the snapshot as it waits
+ * and keeps the last good one, so on takeover a pending fan change or blower run carries on from
+ * where it was.  It's written to a temporary file and renamed into place, so a reader never sees
+ * half of one, and it carries a checksum; one the dying controller left damaged fails it, and the
+ * standby goes on from the last good one it read instead.
+ */
+#ifndef STANDBY_H_
+#define STANDBY_H_
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+
+namespace fancontrol {
+
+class Lease final {
+  // Atomic so a signal handler can give it up (see Abandon()).
+  std::atomic<int> fd;
+  std::atomic<bool> abandoned{false};
+  bool held = false;
+
+  // Only the lock matters, so a failure here is ignored.
+  static bool NotePid(const int descriptor) {
+    char pid[24];
+    const int length = std::snprintf(pid, sizeof(pid), "%ld\n", long(getpid()));
+    return ftruncate(descriptor, 0) == 0 &&
+           pwrite(descriptor, pid, std::size_t(length), 0) == length;
+  }
+
+ public:
+  explicit Lease(const std::string& path)
+      : fd(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) {}
+  ~Lease() {
+    const int descriptor = fd.exchange(-1);
+    if (descriptor >= 0) close(descriptor);
+  }
+  Lease(const Lease&) = delete;
+  Lease& operator=(const Lease&) = delete;
+
+  bool IsOpen() const { return fd.load() >= 0; }
+
+  // Takes the lease if nobody holds it.  True if we hold it now.  The holder's pid is left in the
+  // file for anyone wondering which process is active.
+  bool TryAcquire() {
+    if (held) return true;
+    const int descriptor = fd.load();
+    if (descriptor < 0 || flock(descriptor, LOCK_EX | LOCK_NB) != 0) return false;
+    held = true;
+    NotePid(descriptor);
+    return true;
+  }
+
+  // Lets the standby take over.  Only close() is used, so this is safe in a signal handler.
+  void Abandon() {
+    const int descriptor = fd.exchange(-1);
+    if (descriptor >= 0) close(descriptor);
+    abandoned = true;
+  }
+  bool Abandoned() const { return abandoned; }
+};
+
+struct ControllerSnapshot {
+  static constexpr uint32_t k_magic = 0x32534346;  // "FCS2"
+  static constexpr uint32_t k_maxFans = 8;
+  static constexpr int64_t k_noTransition = INT64_MIN;
+
+  uint32_t magic = k_magic;
+  uint32_t fanCount = 0;
+  // Seconds since the epoch, as of the poll it was saved after.
+  int64_t written = 0;
+  // Or k_noTransition if the furnace hadn't been seen to turn on or off.
+  int64_t lastTransition = k_noTransition;
+  float temp = 0;
+  float targetTemp = 0;
+  int32_t hasState = 0;
+  int32_t isHeatOn = 0;
+  int32_t blowerState = -1;
+  // The process that saved it.
+  int32_t writer = 0;
+  // Each fan's Fan::SaveState(), in order.
+  int32_t fanState[k_maxFans] = {};
+  // Of the rest, taken with this 0 (see Checksum()).
+  uint32_t checksum = 0;
+  uint32_t reserved = 0;
+
+  // FNV-1a over the snapshot with `checksum` 0.
+  uint32_t Checksum() const {
+    ControllerSnapshot copy = *this;
+    copy.checksum = 0;
+    const auto* bytes = reinterpret_cast<const unsigned char*>(&copy);
+    uint32_t hash = 2166136261u;
+    for (std::size_t i = 0; i < sizeof(copy); ++i) hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+  }
+};
+static_assert(sizeof(ControllerSnapshot) == 88, "ControllerSnapshot is written to disk as-is");
+
+// Replaces `path` with `snapshot`.  Returns false if it couldn't be written.
+inline bool SaveSnapshot(const std::string& path, ControllerSnapshot snapshot) {
+  const std::string temp = path + ".tmp";
+  const int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+  snapshot.checksum = snapshot.Checksum();
+  const bool written = write(fd, &snapshot, sizeof(snapshot)) == ssize_t(sizeof(snapshot));
+  close(fd);
+  return written && std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+// The snapshot at `path`, if there is a whole one that checks out.
+inline std::optional<ControllerSnapshot> LoadSnapshot(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return std::nullopt;
+  ControllerSnapshot snapshot;
+  const bool whole = read(fd, &snapshot, sizeof(snapshot)) == ssize_t(sizeof(snapshot));
+  close(fd);
+  if (!whole || snapshot.magic != ControllerSnapshot::k_magic ||
+      snapshot.fanCount > ControllerSnapshot::k_maxFans ||
+      snapshot.checksum != snapshot.Checksum()) {
+    return std::nullopt;
+  }
+  return snapshot;
+}
+
+}  // namespace fancontrol
+
+#endif  // STANDBY_H_
@@ -0,0 +1,312 @@
+/**
+ * Tests ---
+ * Checks of the pieces that can run without devices.  Prints each failure and exits non-zero if
+ * there were any.
+ *
+ *   g++ tests.cpp -o tests -lcurl -pthread -std=c++17 && ./tests
+ */
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "event_log.h"
+#include "fan_policy.h"
+#include "heat_predictor.h"
+#include "history.h"
+#include "rate_limiter.h"
+#include "standby.h"
+#include "workflow.h"
+
+namespace {
+
+using fancontrol::EventLoop;
+using fancontrol::RequestPriority;
+using fancontrol::Workflow;
+
+int failures = 0;
+
+#define CHECK(condition)                                                               \
+  do {                                                                                 \
+    if (!(condition)) {                                                                \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": failed: " #condition << std::endl; \
+      ++failures;                                                                      \
+    }                                                                                  \
+  } while (false)
+
+/** Rate Limiter --- */
+
+// Takes a token the way DeviceRequest does, and notes its name when it gets one.
+class Throttled final : public Workflow {
+  fancontrol::RequestLimiter& limiter;
+  const RequestPriority priority;
+  const std::string name;
+  std::vector<std::string>& order;
+  EventLoop::Clock::time_point start;
+  EventLoop::Clock::time_point retryAt;
+  std::optional<uint64_t> ticket;
+
+ public:
+  Throttled(fancontrol::RequestLimiter& limiter, const RequestPriority priority,
+            std::string name, std::vector<std::string>& order)
+      : limiter(limiter), priority(priority), name(std::move(name)), order(order) {}
+
+  void Resume(EventLoop& loop) override {
+    WORKFLOW_BEGIN;
+    start = EventLoop::Clock::now();
+    while (!limiter.TryAcquire("fan", priority, start, ticket, retryAt)) {
+      WORKFLOW_AWAIT(loop.Sleep(*this, retryAt));
+    }
+    order.push_back(name);
+    WORKFLOW_END;
+  }
+};
+
+void ThrottledWorkflowsGoInPriorityOrder() {
+  using namespace std::chrono_literals;
+  fancontrol::RequestLimiter limiter({100, 1ms});
+  limiter.AddDevice("fan", {1, 20ms});
+  std::vector<std::string> order;
+  // Takes the one token there is, so everything after it waits for the refill.
+  Throttled first(limiter, RequestPriority::LOW, "first", order);
+  Throttled low(limiter, RequestPriority::LOW, "low", order);
+  Throttled normal1(limiter, RequestPriority::NORMAL, "normal1", order);
+  Throttled high(limiter, RequestPriority::HIGH, "high", order);
+  Throttled normal2(limiter, RequestPriority::NORMAL, "normal2", order);
+  EventLoop loop;
+  for (Workflow* workflow : {&first, &low, &normal1, &high, &normal2}) loop.Start(*workflow);
+  CHECK(loop.Run(EventLoop::Clock::now() + 2s));
+  CHECK((order == std::vector<std::string>{"first", "high", "normal1", "normal2", "low"}));
+}
+
+void AbandonedTicketDoesNotHoldUpOthers() {
+  using namespace std::chrono_literals;
+  fancontrol::RequestLimiter limiter({100, 1ms});
+  limiter.AddDevice("fan", {1, 20ms});
+  const auto now = EventLoop::Clock::now();
+  EventLoop::Clock::time_point retryAt;
+  std::optional<uint64_t> ticket;
+  CHECK(limiter.TryAcquire("fan", RequestPriority::NORMAL, now, ticket, retryAt));
+  std::optional<uint64_t> abandoned;
+  CHECK(!limiter.TryAcquire("fan", RequestPriority::HIGH, now, abandoned, retryAt));
+  CHECK(abandoned.has_value());
+  limiter.Dropped("fan", abandoned);
+  CHECK(!abandoned.has_value());
+  std::vector<std::string> order;
+  Throttled low(limiter, RequestPriority::LOW, "low", order);
+  EventLoop loop;
+  loop.Start(low);
+  CHECK(loop.Run(EventLoop::Clock::now() + 2s));
+  CHECK((order == std::vector<std::string>{"low"}));
+}
+
+/** Config and Policies --- */
+
+// Defaults along the lines of the ones compiled into fan_controller.cpp.
+fancontrol::Config Defaults() {
+  using std::chrono::seconds;
+  fancontrol::Config config{};
+  config.policy = {seconds(60), seconds(180), seconds(360), 2, 1};
+  config.pollFrequency = seconds(15);
+  config.fastPollFrequency = seconds(3);
+  config.shutdownDeadline = seconds(5);
+  config.dispatchWindow = seconds(2);
+  config.dispatchConcurrency = 2;
+  config.dispatchDeadline = seconds(10);
+  return config;
+}
+
+// Loads `text` as a config file over Defaults().
+std::optional<fancontrol::Config> LoadConfig(const std::string& text, std::string& error) {
+  char path[] = "/tmp/fancontrol_test_config.XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) return std::nullopt;
+  close(fd);
+  std::ofstream(path) << text;
+  auto config = fancontrol::Config::Load(path, Defaults(), error);
+  unlink(path);
+  return config;
+}
+
+void BlowerStaysOffAtBootWithLongRunOn() {
+  std::string error;
+  const auto config = LoadConfig("runBlowerFanAfterHeatOff 3600\n", error);
+  CHECK(config.has_value());
+  if (!config) return;
+  CHECK(config->policy.runBlowerFanAfterHeatOff == std::chrono::seconds(3600));
+  // What Thermostat gives before it has seen the furnace turn on or off.
+  fancontrol::PolicyInput boot{false, false, std::nullopt, 0};
+  fancontrol::BlowerPolicy blower;
+  CHECK(!blower.Decide(boot, config->policy));
+  CHECK(!blower.Decide(boot, config->policy));
+  CHECK(!blower.LatchedState());
+  // Once the heat does go off, the run-on starts.
+  const fancontrol::PolicyInput heatOff{true, false, std::chrono::seconds(5), 0};
+  CHECK(blower.Decide(heatOff, config->policy) == fancontrol::BLOWER_ON);
+}
+
+void ValueWithTrailingCharactersIsRejected() {
+  for (const std::string text : {"dispatchWindow 1.5\n", "pollFrequency 60s\n"}) {
+    std::string error;
+    CHECK(!LoadConfig(text, error));
+    CHECK(error.find("bad value") != std::string::npos);
+  }
+  std::string error;
+  const auto config = LoadConfig("pollFrequency 60 \t\n", error);
+  CHECK(config && config->pollFrequency == std::chrono::seconds(60));
+}
+
+/** Event Log --- */
+
+void EventLogCarriesOnInNewestSegment() {
+  using fancontrol::EventKind;
+  char dir[] = "/tmp/fancontrol_test_events.XXXXXX";
+  if (!mkdtemp(dir)) return;
+  const std::string prefix = std::string(dir) + "/events";
+  {
+    fancontrol::EventLog log(prefix, 64 * 1024, 4);
+    CHECK(log.IsOpen());
+    CHECK(log.Append(EventKind::SIGNAL, nullptr, 15));
+    CHECK(log.Append(EventKind::MESSAGE, "fan", 3, 0, 0, 0, 0, "a message long enough to matter"));
+  }
+  // What a crash in the middle of an append leaves: a header with no length.
+  std::size_t end = 0;
+  {
+    const fancontrol::EventSegmentReader reader(
+        fancontrol::event_log_detail::SegmentPath(prefix, 0));
+    end = reader.Scan(reader.Begin(), [](const fancontrol::LoggedEvent&) {});
+  }
+  {
+    fancontrol::event_log_detail::RecordHeader torn{};
+    torn.deviceBytes = 3;
+    torn.textBytes = 200;
+    std::fstream file(fancontrol::event_log_detail::SegmentPath(prefix, 0),
+                      std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(std::streamoff(end));
+    file.write(reinterpret_cast<const char*>(&torn), sizeof(torn));
+    file << "fanxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx";
+  }
+  {
+    fancontrol::EventLog log(prefix, 64 * 1024, 4);
+    CHECK(log.Append(EventKind::SIGNAL, nullptr, 1));
+    CHECK(log.Append(EventKind::SIGNAL, nullptr, 2));
+  }
+  CHECK((fancontrol::EventLogSegments(prefix) == std::vector<uint64_t>{0}));
+  std::vector<uint64_t> sequences;
+  const std::string path = fancontrol::event_log_detail::SegmentPath(prefix, 0);
+  const fancontrol::EventSegmentReader reader(path);
+  end = reader.Scan(reader.Begin(), [&](const fancontrol::LoggedEvent& event) {
+    sequences.push_back(event.sequence);
+  });
+  CHECK((sequences == std::vector<uint64_t>{0, 1, 2, 3}));
+  // The cut off record's strings are gone rather than left where the next length would be.
+  std::ifstream file(path, std::ios::binary);
+  file.seekg(std::streamoff(end));
+  uint32_t length = 1;
+  file.read(reinterpret_cast<char*>(&length), sizeof(length));
+  CHECK(length == 0);
+  std::remove(path.c_str());
+  rmdir(dir);
+}
+
+/** Heat Call Predictor --- */
+
+void ModelPredictsBeforeThereIsATrend() {
+  using namespace std::chrono_literals;
+  using Clock = std::chrono::steady_clock;
+  // Loses a degree an hour at 69 with 49 outside.
+  const fancontrol::ThermalModel model{6.0, 1.5, 0.05, 49.0, 0, 0};
+  fancontrol::HeatCallPredictor predictor(3h, 0.5);
+  const auto start = Clock::now();
+  predictor.Add(start, 69.0f, 69.0f, true);
+  predictor.Add(start + 15s, 69.0f, 69.0f, false);
+  CHECK(!predictor.TimeUntilHeatCall(start + 15s));
+  predictor.SetModel(model);
+  const auto expected = model.SecondsUntilFallsTo(69.0, 68.5);
+  const auto predicted = predictor.TimeUntilHeatCall(start + 75s);
+  CHECK(expected && predicted);
+  if (expected && predicted) {
+    CHECK(std::abs(std::chrono::duration<double>(*predicted).count() - (*expected - 60)) < 1);
+  }
+}
+
+/** History --- */
+
+void HistoryBlockRoundTrips() {
+  // Steady polls (long zero runs in the time column), a gap, a step in the target and a temperature
+  // swing wide enough to need two-byte deltas.
+  std::vector<fancontrol::HistorySample> samples;
+  int64_t time = 1700000000;
+  for (int i = 0; i < 1000; ++i) {
+    time += i == 300 ? 3600 : (i < 600 && i % 7 == 0 ? 16 : 15);
+    const float temp = 68.0f + float(i % 40) * 0.25f + (i % 97 == 0 ? 5.0f : 0.0f);
+    samples.push_back({time, temp, i < 500 ? 68.0f : 70.5f, i % 3 == 0, uint8_t(i % 3)});
+  }
+  for (const std::size_t count : std::vector<std::size_t>{1, 2, 200, samples.size()}) {
+    const std::vector<fancontrol::HistorySample> in(samples.begin(), samples.begin() + count);
+    const std::vector<uint8_t> block = fancontrol::EncodeHistoryBlock(in);
+    fancontrol::history_detail::BlockHeader header;
+    std::memcpy(&header, block.data(), sizeof(header));
+    CHECK(fancontrol::history_detail::ValidBlockHeader(header));
+    std::vector<fancontrol::HistorySample> out(count);
+    CHECK(fancontrol::DecodeHistoryBlock(header, block.data() + sizeof(header), out.data()));
+    for (std::size_t i = 0; i < count; ++i) {
+      CHECK(out[i].time == in[i].time);
+      CHECK(std::abs(out[i].temp - in[i].temp) < 0.006f);
+      CHECK(std::abs(out[i].targetTemp - in[i].targetTemp) < 0.006f);
+      CHECK(out[i].isHeatOn == in[i].isHeatOn && out[i].blowerState == in[i].blowerState);
+    }
+  }
+}
+
+/** Standby --- */
+
+void DamagedSnapshotDoesNotLoad() {
+  char path[] = "/tmp/fancontrol_test_snapshot.XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) return;
+  close(fd);
+  fancontrol::ControllerSnapshot snapshot;
+  snapshot.written = 1700000000;
+  snapshot.fanCount = 2;
+  CHECK(fancontrol::SaveSnapshot(path, snapshot));
+  const auto loaded = fancontrol::LoadSnapshot(path);
+  CHECK(loaded && loaded->written == snapshot.written);
+  // Flip one bit of the saved time.
+  std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+  file.seekp(offsetof(fancontrol::ControllerSnapshot, written));
+  file.put(char((snapshot.written & 0xff) ^ 1));
+  file.close();
+  CHECK(!fancontrol::LoadSnapshot(path));
+  unlink(path);
+}
+
+}  // namespace
+
+int main() {
+  ThrottledWorkflowsGoInPriorityOrder();
+  AbandonedTicketDoesNotHoldUpOthers();
+  BlowerStaysOffAtBootWithLongRunOn();
+  ValueWithTrailingCharactersIsRejected();
+  EventLogCarriesOnInNewestSegment();
+  ModelPredictsBeforeThereIsATrend();
+  HistoryBlockRoundTrips();
+  DamagedSnapshotDoesNotLoad();
+  if (failures) {
+    std::cerr << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,106 @@
+/**
+ * Thermal Fit ---
+ * Fits the RC house model in thermal_model.h to recorded thermostat history.
+ *
+ *   thermal_fit <history file> [--threads N] [--from T] [--to T] [--swing F] [--out model file]
+ *
+ * Prints the fitted parameters and, from the last recorded sample, when the next call for heat is
+ * expected.  --swing is how far below the setpoint the thermostat lets the house drift before
+ * calling for heat.  The saved model can be passed to policy_sweep --model to simulate the house
+ * instead of replaying recorded temperatures, and saved as fancontrol_thermal_model.txt next to the
+ * controller it seeds its heat call prediction (see heat_predictor.h).
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "history.h"
+#include "thermal_model.h"
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " <history file> [--threads N] [--from T] [--to T] [--swing F] [--out file]"
+              << std::endl;
+    return 1;
+  }
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  int64_t from = INT64_MIN;
+  int64_t to = INT64_MAX;
+  double swing = 0.5;
+  std::string outPath;
+  for (int i = 2; i < argc; i += 2) {
+    const std::string option(argv[i]);
+    if (i + 1 == argc) {
+      std::cerr << "Missing value for " << option << std::endl;
+      return 1;
+    }
+    if (option == "--threads") {
+      threads = std::max(1, std::atoi(argv[i + 1]));
+    } else if (option == "--from") {
+      from = std::strtoll(argv[i + 1], nullptr, 10);
+    } else if (option == "--to") {
+      to = std::strtoll(argv[i + 1], nullptr, 10);
+    } else if (option == "--swing") {
+      swing = std::atof(argv[i + 1]);
+    } else if (option == "--out") {
+      outPath = argv[i + 1];
+    } else {
+      std::cerr << "Unknown option: " << option << std::endl;
+      return 1;
+    }
+  }
+
+  fancontrol::HistoryReader reader(argv[1]);
+  if (!reader.IsOpen()) {
+    std::cerr << "Unable to open history file: " << argv[1] << std::endl;
+    return 1;
+  }
+
+  using namespace std::chrono;
+  const auto startTime(steady_clock::now());
+  const auto model = fancontrol::FitThermalModel(reader, from, to, threads);
+  const auto fitTime(duration_cast<milliseconds>(steady_clock::now() - startTime));
+  if (!model) {
+    std::cerr << "Not enough varied history to fit a model" << std::endl;
+    return 1;
+  }
+
+  std::cout << "Fitted " << model->windows << " intervals from " << reader.SampleCount()
+            << " samples on " << threads << " threads in " << fitTime.count() << "ms" << std::endl
+            << "  Heat gain:   " << model->heatGain << " deg/hour" << std::endl
+            << "  Blower gain: " << model->blowerGain << " deg/hour (heat off, blower on)"
+            << std::endl
+            << "  Loss rate:   " << model->lossRate << " /hour (time constant "
+            << 1 / model->lossRate << " hours)" << std::endl
+            << "  Ambient:     " << model->ambient << " deg" << std::endl
+            << "  RMS error:   " << model->rmsError << " deg/hour" << std::endl;
+
+  // Predict the next heat call from where the history leaves off.
+  reader.Scan(reader.LastTime(), reader.LastTime(),
+              [&](const fancontrol::HistorySample* s, std::size_t count) {
+                const auto& last = s[count - 1];
+                if (last.isHeatOn) {
+                  std::cout << "Heat was on at the last sample" << std::endl;
+                  return;
+                }
+                const auto secs = model->SecondsUntilFallsTo(last.temp, last.targetTemp - swing);
+                if (secs) {
+                  std::cout << "Next heat call expected " << int64_t(*secs) / 60
+                            << " minutes after the last sample (" << last.time + int64_t(*secs)
+                            << ")" << std::endl;
+                } else {
+                  std::cout << "No heat call expected at the current setpoint" << std::endl;
+                }
+              });
+
+  if (!outPath.empty() && !model->Save(outPath)) {
+    std::cerr << "Unable to write model to " << outPath << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,271 @@
+/**
+ * Thermal Model ---
+ * A first order (RC) model of the house fitted to recorded history:
+ *
+ *   dT/dt = heatGain * heating + blowerGain * blowing - lossRate * (T - ambient)
+ *
+ * in degrees per hour, where `heating` is 1 while the furnace is on and `blowing` is 1 while the
+ * blower runs with the heat off (our extended run, pushing out what's left in the heat exchanger).
+ * `ambient` is where the house would settle with no heat, so it folds in the outdoor temperature
+ * and any other gains; with only thermostat data that's the best we can do.
+ *
+ * The model is linear in its parameters, so fitting is ordinary least squares.  Each worker builds
+ * the normal equations for its share of the history and the sums are added up at the end, so the
+ * fit scales with cores and is a single pass over the data.
+ */
+#ifndef THERMAL_MODEL_H_
+#define THERMAL_MODEL_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fan_policy.h"
+#include "history.h"
+
+namespace fancontrol {
+
+struct ThermalModel {
+  double heatGain;    // degrees/hour
+  double blowerGain;  // degrees/hour
+  double lossRate;    // 1/hour
+  double ambient;     // degrees
+  double rmsError;    // degrees/hour, of the fitted rate
+  uint64_t windows;   // how many intervals the fit used
+
+  // Rate of change in degrees/hour.
+  double Rate(const double temp, const bool heating, const bool blowing) const {
+    return (heating ? heatGain : 0) + (blowing && !heating ? blowerGain : 0) -
+           lossRate * (temp - ambient);
+  }
+
+  // Temperature after `seconds` with the given inputs held constant.
+  double Step(const double temp, const bool heating, const bool blowing,
+              const double seconds) const {
+    const double hours = seconds / 3600;
+    if (lossRate <= 0) return temp + Rate(temp, heating, blowing) * hours;
+    const double settle = temp + Rate(temp, heating, blowing) / lossRate;
+    return settle + (temp - settle) * std::exp(-lossRate * hours);
+  }
+
+  // Seconds until the temperature drifts down to `threshold` with the heat off, or nullopt if it
+  // never gets there.  This is when we expect the next call for heat.
+  std::optional<double> SecondsUntilFallsTo(const double temp, const double threshold) const {
+    if (temp <= threshold) return 0.0;
+    if (lossRate <= 0 || threshold <= ambient) return std::nullopt;
+    return -std::log((threshold - ambient) / (temp - ambient)) / lossRate * 3600;
+  }
+
+  bool Save(const std::string& path) const {
+    std::ofstream out(path);
+    out.precision(10);
+    out << "heatGain " << heatGain << "\nblowerGain " << blowerGain << "\nlossRate " << lossRate
+        << "\nambient " << ambient << "\nrmsError " << rmsError << "\nwindows " << windows << "\n";
+    return bool(out);
+  }
+
+  static std::optional<ThermalModel> Load(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) return std::nullopt;
+    ThermalModel model{0, 0, 0, 0, 0, 0};
+    std::string key;
+    double value;
+    int fields = 0;
+    while (in >> key >> value) {
+      ++fields;
+      if (key == "heatGain") {
+        model.heatGain = value;
+      } else if (key == "blowerGain") {
+        model.blowerGain = value;
+      } else if (key == "lossRate") {
+        model.lossRate = value;
+      } else if (key == "ambient") {
+        model.ambient = value;
+      } else if (key == "rmsError") {
+        model.rmsError = value;
+      } else if (key == "windows") {
+        model.windows = uint64_t(value);
+      } else {
+        --fields;
+      }
+    }
+    if (fields < 4) return std::nullopt;
+    return model;
+  }
+};
+
+namespace thermal_detail {
+
+// Unknowns, in order: heatGain, blowerGain, lossRate * ambient, lossRate.
+static const int k_params = 4;
+// Rows span at least this long where the state allows, to average out sensor noise.  They never
+// span a change of heat/blower state or a gap in the history.
+static const int64_t k_rowSeconds = 15 * 60;
+static const int64_t k_maxSampleGap = 5 * 60;
+
+struct NormalEquations {
+  double xtx[k_params][k_params] = {};
+  double xty[k_params] = {};
+  double yty = 0;
+  uint64_t rows = 0;
+
+  void Add(const double (&x)[k_params], const double y) {
+    for (int i = 0; i < k_params; ++i) {
+      for (int j = 0; j < k_params; ++j) xtx[i][j] += x[i] * x[j];
+      xty[i] += x[i] * y;
+    }
+    yty += y * y;
+    ++rows;
+  }
+
+  void Merge(const NormalEquations& other) {
+    for (int i = 0; i < k_params; ++i) {
+      for (int j = 0; j < k_params; ++j) xtx[i][j] += other.xtx[i][j];
+      xty[i] += other.xty[i];
+    }
+    yty += other.yty;
+    rows += other.rows;
+  }
+};
+
+/**
+ * Turns samples into rows of the fit.  The thermostat reports temperature in coarse steps, so
+ * instead of differencing samples we measure between the moments the reading changes: at each
+ * change the real temperature is about halfway between the two readings, which removes most of
+ * the quantization bias.  Each row is the rate between two such crossings in one heat/blower state.
+ */
+struct WindowBuilder {
+  struct Crossing {
+    double time;
+    double temp;
+  };
+  HistorySample last;
+  bool haveLast = false;
+  int crossings = 0;  // since the current row started
+  Crossing start;
+  Crossing end;
+
+  static bool Blowing(const HistorySample& s) { return s.blowerState == BLOWER_ON; }
+
+  void AddRow(NormalEquations& eq) {
+    const double hours = (end.time - start.time) / 3600;
+    if (crossings < 2 || hours <= 0) return;
+    const bool heating = last.isHeatOn;
+    const double x[k_params] = {heating ? 1.0 : 0.0, Blowing(last) && !heating ? 1.0 : 0.0, 1.0,
+                                -(start.temp + end.temp) / 2};
+    eq.Add(x, (end.temp - start.temp) / hours);
+  }
+
+  void Add(const HistorySample& s, NormalEquations& eq) {
+    if (!haveLast || s.isHeatOn != last.isHeatOn || Blowing(s) != Blowing(last) ||
+        s.time - last.time > k_maxSampleGap) {
+      // Use whatever the finished run had, even if it was short (heat cycles often are).
+      if (haveLast) AddRow(eq);
+      crossings = 0;
+    } else if (s.temp != last.temp) {
+      end = {(double(last.time) + s.time) / 2, (double(last.temp) + s.temp) / 2};
+      if (crossings++ == 0) {
+        start = end;
+      } else if (end.time - start.time >= k_rowSeconds) {
+        AddRow(eq);
+        start = end;
+        crossings = 1;
+      }
+    }
+    last = s;
+    haveLast = true;
+  }
+};
+
+// Solves A x = b in place by Gaussian elimination with partial pivoting.
+inline bool Solve(double (&a)[k_params][k_params], double (&b)[k_params], double (&x)[k_params]) {
+  for (int col = 0; col < k_params; ++col) {
+    int pivot = col;
+    for (int row = col + 1; row < k_params; ++row)
+      if (std::fabs(a[row][col]) > std::fabs(a[pivot][col])) pivot = row;
+    if (std::fabs(a[pivot][col]) < 1e-12) return false;
+    std::swap(a[col], a[pivot]);
+    std::swap(b[col], b[pivot]);
+    for (int row = col + 1; row < k_params; ++row) {
+      const double f = a[row][col] / a[col][col];
+      for (int k = col; k < k_params; ++k) a[row][k] -= f * a[col][k];
+      b[row] -= f * b[col];
+    }
+  }
+  for (int row = k_params - 1; row >= 0; --row) {
+    double sum = b[row];
+    for (int k = row + 1; k < k_params; ++k) sum -= a[row][k] * x[k];
+    x[row] = sum / a[row][row];
+  }
+  return true;
+}
+
+}  // namespace thermal_detail
+
+/**
+ * Fits the model to the samples of `reader` in [from, to] using `threads` workers, each scanning
+ * a contiguous slice of the time range.  Returns nullopt if the history doesn't pin the model down
+ * (e.g. it never saw the heat on).
+ */
+inline std::optional<ThermalModel> FitThermalModel(const HistoryReader& reader, int64_t from,
+                                                   int64_t to, const int threads) {
+  using namespace thermal_detail;
+  from = std::max(from, reader.FirstTime());
+  to = std::min(to, reader.LastTime());
+  if (to <= from) return std::nullopt;
+
+  std::vector<NormalEquations> partial(std::max(1, threads));
+  std::vector<std::thread> workers;
+  const int64_t slice = (to - from) / int64_t(partial.size()) + 1;
+  for (std::size_t t = 0; t < partial.size(); ++t) {
+    workers.emplace_back([&reader, &partial, t, from, to, slice]() {
+      WindowBuilder windows;
+      NormalEquations& eq = partial[t];
+      const int64_t sliceFrom = from + int64_t(t) * slice;
+      const int64_t sliceTo = std::min(to, sliceFrom + slice - 1);
+      reader.Scan(sliceFrom, sliceTo, [&](const HistorySample* s, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) windows.Add(s[i], eq);
+      });
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  NormalEquations total;
+  for (const auto& eq : partial) total.Merge(eq);
+  if (total.rows < k_params) return std::nullopt;
+
+  // A tiny ridge keeps the system solvable when the blower term never appears (e.g. history from
+  // before we ran the blower after heat); its coefficient then just comes out as zero.
+  double a[k_params][k_params];
+  double b[k_params];
+  for (int i = 0; i < k_params; ++i) {
+    for (int j = 0; j < k_params; ++j) a[i][j] = total.xtx[i][j];
+    a[i][i] += 1e-9 * (1 + total.xtx[i][i]);
+    b[i] = total.xty[i];
+  }
+  double x[k_params] = {};
+  if (!Solve(a, b, x) || x[3] <= 0) return std::nullopt;
+
+  // Residual sum of squares from the normal equations: y'y - 2 x'X'y + x'X'X x.
+  double rss = total.yty;
+  for (int i = 0; i < k_params; ++i) {
+    rss -= 2 * x[i] * total.xty[i];
+    for (int j = 0; j < k_params; ++j) rss += x[i] * total.xtx[i][j] * x[j];
+  }
+  ThermalModel model;
+  model.heatGain = x[0];
+  model.blowerGain = x[1];
+  model.lossRate = x[3];
+  model.ambient = x[2] / x[3];
+  model.rmsError = std::sqrt(std::max(0.0, rss) / double(total.rows));
+  model.windows = total.rows;
+  return model;
+}
+
+}  // namespace fancontrol
+
+#endif  // THERMAL_MODEL_H_
@@ -0,0 +1,113 @@
+/**
+ * Thermostat Program ---
+ * The weekly heat program from the Radio Thermostat (/tstat/program/heat), indexed so we can ask
+ * when the next setpoint change is.  The device returns one array per day, Monday = "0", of
+ * (minutes after midnight, setpoint) pairs:
+ *
+ *   {"0": [360, 70, 480, 62, 1080, 70, 1320, 62], "1": [...], ... "6": [...]}
+ *
+ * Scheduled setpoint changes are when calls for heat (and their end) are most likely, so the
+ * controller polls faster around them.
+ */
+#ifndef THERMOSTAT_PROGRAM_H_
+#define THERMOSTAT_PROGRAM_H_
+
+#include <rapidjson/document.h>
+
+#include <algorithm>
+#include <ctime>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace fancontrol {
+
+class ThermostatProgram final {
+ public:
+  static const int k_minutesPerWeek = 7 * 24 * 60;
+
+  struct Change {
+    int minuteOfWeek;  // Monday 00:00 = 0
+    float setpoint;
+  };
+
+  // Returns nullopt if the response isn't a program we understand.
+  static std::optional<ThermostatProgram> Parse(const std::string& json) {
+    rapidjson::Document doc;
+    doc.Parse(json.c_str());
+    if (doc.HasParseError() || !doc.IsObject()) return std::nullopt;
+    ThermostatProgram program;
+    for (int day = 0; day < 7; ++day) {
+      const std::string key = std::to_string(day);
+      if (!doc.HasMember(key.c_str())) return std::nullopt;
+      const auto& entries = doc[key.c_str()];
+      if (!entries.IsArray() || entries.Size() % 2 != 0) return std::nullopt;
+      for (rapidjson::SizeType i = 0; i < entries.Size(); i += 2) {
+        if (!entries[i].IsInt() || !entries[i + 1].IsNumber()) return std::nullopt;
+        const int minute = entries[i].GetInt();
+        if (minute < 0 || minute >= 24 * 60) return std::nullopt;
+        program.changes.push_back({day * 24 * 60 + minute, entries[i + 1].GetFloat()});
+      }
+    }
+    if (program.changes.empty()) return std::nullopt;
+    std::sort(program.changes.begin(), program.changes.end(),
+              [](const Change& a, const Change& b) { return a.minuteOfWeek < b.minuteOfWeek; });
+    // Entries that repeat the setpoint before them (the schedule wraps weekly) don't change
+    // anything, so leave them out of the index.
+    std::vector<Change> effective;
+    const std::size_t count = program.changes.size();
+    for (std::size_t i = 0; i < count; ++i) {
+      const auto& previous = program.changes[(i + count - 1) % count];
+      if (program.changes[i].setpoint != previous.setpoint || count == 1)
+        effective.push_back(program.changes[i]);
+    }
+    if (effective.empty()) effective.push_back(program.changes.front());
+    program.changes.swap(effective);
+    return program;
+  }
+
+  // Seconds since Monday 00:00 local time, which is what the thermostat's program runs on.
+  static int SecondOfWeek(const std::time_t now) {
+    std::tm local;
+    localtime_r(&now, &local);
+    const int day = (local.tm_wday + 6) % 7;
+    return ((day * 24 + local.tm_hour) * 60 + local.tm_min) * 60 + local.tm_sec;
+  }
+
+  // The first change strictly after `secondOfWeek`, wrapping into next week, and the seconds until
+  // it happens.
+  std::pair<Change, int> NextChange(const int secondOfWeek) const {
+    const int minute = secondOfWeek / 60;
+    auto it = std::upper_bound(changes.begin(), changes.end(), minute,
+                               [](int m, const Change& c) { return m < c.minuteOfWeek; });
+    int wrap = 0;
+    if (it == changes.end()) {
+      it = changes.begin();
+      wrap = k_minutesPerWeek * 60;
+    }
+    return {*it, it->minuteOfWeek * 60 + wrap - secondOfWeek};
+  }
+
+  // The most recent change at or before `secondOfWeek`, and the seconds since it happened.
+  std::pair<Change, int> PreviousChange(const int secondOfWeek) const {
+    const int minute = secondOfWeek / 60;
+    auto it = std::upper_bound(changes.begin(), changes.end(), minute,
+                               [](int m, const Change& c) { return m < c.minuteOfWeek; });
+    int wrap = 0;
+    if (it == changes.begin()) {
+      it = changes.end();
+      wrap = k_minutesPerWeek * 60;
+    }
+    --it;
+    return {*it, secondOfWeek + wrap - it->minuteOfWeek * 60};
+  }
+
+  std::size_t Size() const { return changes.size(); }
+
+ private:
+  std::vector<Change> changes;
+};
+
+}  // namespace fancontrol
+
+#endif  // THERMOSTAT_PROGRAM_H_
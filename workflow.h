@@ -0,0 +1,285 @@
+/**
+ * Workflows ---
+ * A device interaction ("ask the fan its speed", "set the speed and check the answer says it
+ * took") written as one straight-line sequence that suspends at each request or timer, with any
+ * number of them in flight on one thread.  The event loop runs the requests through libcurl's
+ * multi interface and resumes each workflow where it left off once its request completes or its
+ * timer is up.
+ *
+ * We build as C++17, so these are stackless coroutines done the old way: a workflow is an object
+ * whose Resume() is a switch on where it last suspended, and WORKFLOW_AWAIT leaves a case label
+ * behind to come back to.  Anything that must survive an await is a member rather than a local
+ * (locals can't be declared across an await at all), so a suspended workflow costs only its own
+ * object, with no thread or stack of its own:
+ *
+ *   void Resume(EventLoop& loop) override {
+ *     WORKFLOW_BEGIN;
+ *     WORKFLOW_AWAIT(loop.Sleep(*this, wake));
+ *     WORKFLOW_AWAIT(loop.Request(*this, handle, response));
+ *     ok = response.code == 200;
+ *     WORKFLOW_END;
+ *   }
+ *
+ * A workflow awaits another with loop.Call(), which is how the device workflows share the rate
+ * limited request (see DeviceRequest in fan_controller.cpp), or starts several with loop.Fork() and
+ * awaits them all with loop.Join().  Only one await may go on a line, as the line number is the
+ * resume point.  Nothing is ever resumed from inside an await, so a workflow never runs
+ * re-entrantly.
+ *
+ * A handle has one request in flight at a time, so requests on a handle that's busy queue behind
+ * it.  Each request sets its handle's options in a setup function that runs once the handle is
+ * free, so it never changes a handle under a request that's still going.
+ */
+#ifndef WORKFLOW_H_
+#define WORKFLOW_H_
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace fancontrol {
+
+class EventLoop;
+
+class Workflow {
+  friend class EventLoop;
+  // Resumed when this finishes, if it was started by Call().
+  Workflow* caller = nullptr;
+  // Told when this finishes, if it was started by Fork().
+  Workflow* parent = nullptr;
+  // Forked workflows still running, and whether this is waiting in Join() for them.
+  std::size_t children = 0;
+  bool joining = false;
+
+ protected:
+  // The line of the await to resume after, or 0 to start.
+  int resumePoint = 0;
+  bool done = false;
+
+ public:
+  virtual ~Workflow() = default;
+  virtual void Resume(EventLoop& loop) = 0;
+  bool Done() const { return done; }
+};
+
+#define WORKFLOW_BEGIN   \
+  switch (resumePoint) { \
+    case 0:
+#define WORKFLOW_AWAIT(...)   \
+  do {                        \
+    resumePoint = __LINE__;   \
+    __VA_ARGS__;              \
+    return;                   \
+    case __LINE__:;           \
+  } while (false)
+#define WORKFLOW_RETURN \
+  do {                  \
+    done = true;        \
+    return;             \
+  } while (false)
+#define WORKFLOW_END \
+  }                  \
+  done = true
+
+struct HttpResponse {
+  CURLcode result = CURLE_OK;
+  long code = 0;
+  std::string body;
+};
+
+class EventLoop final {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+ private:
+  struct Timer {
+    Clock::time_point at;
+    uint64_t sequence;
+    Workflow* workflow;
+    bool operator>(const Timer& other) const {
+      return std::tie(at, sequence) > std::tie(other.at, other.sequence);
+    }
+  };
+
+  struct QueuedRequest {
+    Workflow* workflow;
+    HttpResponse* response;
+    std::function<void()> setup;
+  };
+
+  CURLM* const multi;
+  std::vector<Workflow*> ready;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+  uint64_t nextTimer = 0;
+  // Requests on each handle; the first is in flight and the rest wait for it.
+  std::map<CURL*, std::deque<QueuedRequest>> requests;
+  // Workflows started with Start() that haven't finished.
+  std::size_t running = 0;
+  std::function<void(Workflow&)> onFinish;
+
+  static std::size_t Append(const char* in, std::size_t size, std::size_t num, std::string* out) {
+    out->append(in, size * num);
+    return size * num;
+  }
+
+  void Step(Workflow* workflow) {
+    workflow->Resume(*this);
+    if (!workflow->done) return;
+    if (workflow->caller) {
+      ready.push_back(std::exchange(workflow->caller, nullptr));
+    } else if (Workflow* const parent = std::exchange(workflow->parent, nullptr)) {
+      if (--parent->children == 0 && std::exchange(parent->joining, false)) {
+        ready.push_back(parent);
+      }
+    } else {
+      --running;
+      if (onFinish) onFinish(*workflow);
+    }
+  }
+
+  // Sends the first request queued on `handle`, or fails it (and the ones after it that fail
+  // too) if libcurl won't take it.
+  void Send(CURL* const handle) {
+    auto& queue = requests[handle];
+    while (!queue.empty()) {
+      const QueuedRequest& request = queue.front();
+      *request.response = HttpResponse();
+      if (request.setup) request.setup();
+      curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, Append);
+      curl_easy_setopt(handle, CURLOPT_WRITEDATA, &request.response->body);
+      if (curl_multi_add_handle(multi, handle) == CURLM_OK) return;
+      request.response->result = CURLE_FAILED_INIT;
+      ready.push_back(request.workflow);
+      queue.pop_front();
+    }
+    requests.erase(handle);
+  }
+
+  // Makes the workflows whose requests finished ready.
+  void Collect() {
+    int queued;
+    while (CURLMsg* message = curl_multi_info_read(multi, &queued)) {
+      if (message->msg != CURLMSG_DONE) continue;
+      CURL* const handle = message->easy_handle;
+      const auto found = requests.find(handle);
+      if (found == requests.end() || found->second.empty()) continue;
+      const QueuedRequest& request = found->second.front();
+      request.response->result = message->data.result;
+      curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &request.response->code);
+      curl_multi_remove_handle(multi, handle);
+      ready.push_back(request.workflow);
+      found->second.pop_front();
+      Send(handle);
+    }
+  }
+
+ public:
+  EventLoop() : multi(curl_multi_init()) {}
+  ~EventLoop() {
+    for (const auto& request : requests) curl_multi_remove_handle(multi, request.first);
+    curl_multi_cleanup(multi);
+  }
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  // Runs `workflow` from the next Run() or RunReady().  It must outlive the loop.
+  void Start(Workflow& workflow) {
+    ++running;
+    ready.push_back(&workflow);
+  }
+  // Called as each workflow started with Start() finishes.
+  void OnFinish(std::function<void(Workflow&)> callback) { onFinish = std::move(callback); }
+
+  // The awaits.  Each suspends `workflow` until the timer is up, `callee` has finished, or the
+  // request has a response (or failed, with the libcurl error in `response.result`).  `setup`
+  // sets the handle's options for the request just before it's sent.
+  void Sleep(Workflow& workflow, const Clock::time_point until) {
+    timers.push({until, nextTimer++, &workflow});
+  }
+  void Call(Workflow& workflow, Workflow& callee) {
+    callee.caller = &workflow;
+    ready.push_back(&callee);
+  }
+  void Request(Workflow& workflow, CURL* handle, HttpResponse& response,
+               std::function<void()> setup = nullptr) {
+    auto& queue = requests[handle];
+    queue.push_back({&workflow, &response, std::move(setup)});
+    if (queue.size() == 1) Send(handle);
+  }
+  // Runs `child` alongside `workflow`, which must Join() before it finishes.
+  void Fork(Workflow& workflow, Workflow& child) {
+    child.parent = &workflow;
+    ++workflow.children;
+    ready.push_back(&child);
+  }
+  // Suspends `workflow` until everything it forked has finished.
+  void Join(Workflow& workflow) {
+    if (workflow.children) {
+      workflow.joining = true;
+    } else {
+      ready.push_back(&workflow);
+    }
+  }
+
+  // Steps every ready workflow, including any that become ready as it goes.
+  void RunReady() {
+    for (std::size_t i = 0; i < ready.size(); ++i) Step(ready[i]);
+    ready.clear();
+  }
+
+  /**
+   * Waits for a timer, a request or Wakeup(), up to `deadline`, and makes the workflows it was
+   * for ready.  Returns false if nothing was ready by the deadline.
+   */
+  bool Poll(const Clock::time_point deadline) {
+    const auto now = Clock::now();
+    for (; !timers.empty() && timers.top().at <= now; timers.pop()) {
+      ready.push_back(timers.top().workflow);
+    }
+    if (!ready.empty()) return true;
+    if (now >= deadline) return false;
+
+    const auto wake = std::min(deadline, timers.empty() ? deadline : timers.top().at);
+    const auto timeout = std::chrono::ceil<std::chrono::milliseconds>(wake - now).count();
+    int active;
+    curl_multi_perform(multi, &active);
+    Collect();
+    if (!ready.empty()) return true;
+    // libcurl wakes up sooner if one of its own timeouts is due first.
+    curl_multi_poll(multi, nullptr, 0, int(std::min<int64_t>(timeout, INT_MAX)), nullptr);
+    curl_multi_perform(multi, &active);
+    Collect();
+    return true;
+  }
+
+  // Cuts short a Poll() on another thread.  The only call that may be made from one.
+  void Wakeup() { curl_multi_wakeup(multi); }
+
+  /**
+   * Runs until every workflow started has finished, or until `deadline`.  Returns true for the
+   * former.  Workflows still waiting at the deadline stay suspended, and their requests are
+   * abandoned when the loop goes away.
+   */
+  bool Run(const Clock::time_point deadline) {
+    while (true) {
+      RunReady();
+      if (!running) return true;
+      if (!Poll(deadline)) return false;
+    }
+  }
+};
+
+}  // namespace fancontrol
+
+#endif  // WORKFLOW_H_